@@ -1,3 +1,8 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
 /* Instructions */
 enum Instruction {
     ADD,
@@ -20,21 +25,29 @@ enum Instruction {
 
     STO,
     STOI,
+    OUT,        // Writes a register to the output channel (-out)
 
     AND,
     OR,
     NOT,
     LSHFT,
     RSHFT,
+    CMOV,       // CMOVZ/CMOVNE/CMOVPO - a move predicated on a CMP result
 
     JMP,
     JMPI,
     BNE,
     BPO,
     BZ,
+    CALL,
+    RET,
+    CMPBZ,      // CMP + BZ/BNE/BPO fused by decode
+    CMPBNE,
+    CMPBPO,
 
     HALT,
     NOP,
+    LOOP,       // Hardware loop - handled by decode and fetch, never reaches an EU
     MV,
     MVHI,
     MVLO,
@@ -45,6 +58,20 @@ enum Instruction {
 #pragma region Registers
 enum Register { R0, R1, R2, R3, R4, R5, R6, R7, R8, R9, R10, R11, R12, R13, R14, R15, X }; // X acts a dummy regsiter - doesn't exist but acts as a way to have uniform structure to all instructions that the ISA uses
 enum FP_Register {FP0, FP1, FP2, FP3};
+const Register LINK_REGISTER = R15;             // CALL leaves the return address here for RET
+
+
+/* Datapath word - registers, data memory and the EUs all work in Words. 32 bits unless built with -DISA_WORD_64 */
+#ifdef ISA_WORD_64
+typedef int64_t Word;
+typedef __int128 DoubleWord;    // Holds a full MULO product
+#else
+typedef int32_t Word;
+typedef int64_t DoubleWord;
+#endif
+const int WORD_BITS = sizeof(Word) * 8;
+
+typedef std::vector<Word> DataMemory;   // Sized at run time (-memsize)
 
 
 /* States of a single pipeline stage */
@@ -56,4 +83,29 @@ enum EUState {IDLE, READY, RUNNING, DONE};
 
 /* Constants */
 const int SIZE_OF_INSTRUCTION_MEMORY = 256;     // size of the read-only instruction memory
-const int SIZE_OF_DATA_MEMORY = 256;            // pretty much the heap and all
\ No newline at end of file
+const int SIZE_OF_DATA_MEMORY = 256;            // pretty much the heap and all - the default, -memsize changes it
+const int MAX_LSUS = 4;                         // most memory ops decode can put into one slot (-lsus)
+const int DATA_CACHE_LINE_SIZE = 4;             // words per line of data memory in the memory latency model
+const int DATA_CACHE_LINES = 8;                 // lines that can be held close to the LSU before going back to memory
+const int MAX_OUTSTANDING_PREFETCHES = 8;       // prefetches that can be waiting on memory at once
+const int PREFETCH_DEGREE = 2;                  // how far ahead the next-line and stride prefetchers go
+const int STRIDE_TABLE_SIZE = 16;               // load/stores the stride prefetcher can track
+const int STREAM_BUFFERS = 4;                   // streams the stream buffer prefetcher can follow
+const int STREAM_BUFFER_DEPTH = 2;              // lines each stream stays ahead
+const int RETURN_ADDRESS_STACK_SIZE = 8;        // number of return addresses fetch can remember
+const int LOOP_BUFFER_SIZE = 32;                // longest loop (in instructions) the loop buffer can hold
+const int HARDWARE_LOOP_DEPTH = 4;              // LOOPs that can be running inside each other
+const int JOURNAL_SNAPSHOT_INTERVAL = 1024;     // cycles between full copies of the state in the debugger's journal
+const int JOURNAL_SNAPSHOTS = 64;               // copies the journal keeps, history before the oldest one is dropped
+const int COSIM_HISTORY = 8;                    // instructions before a divergence -cosim shows
+const int HOTSPOTS_LISTED = 5;                  // instructions -annotate sums up after the listing
+const int INTERVAL_WARMUP = 2000;               // instructions -intervals simulates before each interval to warm it up (-warmup)
+const int TRACE_BLOCK_SIZE = 1 << 16;           // bytes of records -record compresses at a time
+const int RESULT_CACHE_LIMIT = 256;             // megabytes of results -cache keeps before it deletes the least recently used (-cachelimit)
+const int MAX_THREADS = 8;                      // hardware thread contexts -threads can give the pipeline
+const int SMT_SWITCH_LATENCY = 4;               // -threads: an access that keeps memory waiting longer than this sends its thread away instead of stalling everyone
+const int MAX_SUB_STAGES = 8;                   // most stages -pipeline can split IF, ID or EX into
+const int VALUE_PREDICTOR_SIZE = 32;            // loads the value predictor (-vpred) can track
+const int VALUE_PREDICTOR_CONFIDENCE = 3;       // times in a row a load's value has to have been guessed right before -vpred predicts it
+const int INSTRUCTION_CACHE_LINE_SIZE = 4;      // instructions per line of instruction memory in its latency model (-imemlat)
+const int INSTRUCTION_CACHE_LINES = 8;          // lines that can be held close to fetch before going back to memory
\ No newline at end of file
@@ -3,6 +3,9 @@
 #include <string>
 
 #include "EnumsAndConstants.hpp"
+#include "Journal.hpp"
+#include "MemoryModel.hpp"
+#include "Profiler.hpp"
 
 // General class for all Components
 class ExecutionUnit{
@@ -12,16 +15,21 @@ class ExecutionUnit{
         std::string typeOfEU = "DefaultEU";
 
         bool writeBackFlag = false;
+        bool outputFlag = false;    // Set once cycle() has produced a result that complete() hasn't taken yet - issue() can hand the EU its next instruction in the meantime
 
         Instruction OpCodeRegister;
 
-        int IN0;
-        int IN1;
-        int IMMEDIATE;
+        Word IN0;
+        Word IN1;
+        Word IMMEDIATE;
 
-        int DEST;
-        int DEST_OUT;       // We need 2 destination registers - one between I/EX and one between EX/C
-        int OUT;
+        Word DEST;
+        Word DEST_OUT;      // We need 2 destination registers - one between I/EX and one between EX/C
+        Word OUT;
+
+        int PC;             // Address of the instruction being executed
+
+        std::ostream* logStream = &std::cout;   // Where cycle() says what it is doing
     
     ExecutionUnit(){
         state = IDLE;
@@ -41,6 +49,12 @@ class ExecutionUnit{
 // Implementation for an arithmetic logic unity (ALU)
 class ALU : public ExecutionUnit{
     public:
+        Word HI = 0;        // Top and bottom half of the last MULO, only the ALU that multiplies uses them
+        Word LO = 0;
+
+        Instruction GUARD_CONDITION = NOP;  // BZ/BNE/BPO if the instruction only runs when GUARD is zero/negative/positive, NOP if it always runs
+        Word GUARD = 0;
+        bool predicatedOff = false;         // The guard was false so the instruction did nothing
     
     ALU(){
         typeOfEU = "ALU";
@@ -50,13 +64,26 @@ class ALU : public ExecutionUnit{
     }
 
     void cycle(){
+        PROFILE(PROFILE_ALU);
+
         // set State
         state = RUNNING;
 
         // Update the second destination register 
         DEST_OUT = DEST;
+        writeBackFlag = true;
 
-        std::cout << "ALU cycle called" << std::endl;
+        *logStream << "ALU cycle called" << std::endl;
+
+        // A predicated instruction whose guard is false doesn't write anything (not even HI/LO)
+        predicatedOff = (GUARD_CONDITION == BZ && GUARD != 0) || (GUARD_CONDITION == BNE && GUARD >= 0) || (GUARD_CONDITION == BPO && GUARD <= 0);
+        if (predicatedOff) {
+            *logStream << "Predicated off" << std::endl;
+            writeBackFlag = false;
+            state = DONE;
+            outputFlag = true;
+            return;
+        }
 
         switch(OpCodeRegister){
             case ADD:                   // #####################
@@ -83,16 +110,25 @@ class ALU : public ExecutionUnit{
                 //writeBackFlag = true;
                 break;
 
-            /*case MULO:
-                long int tempResult = (long int) IN0 * (long int) IN1;    // Not a register, only used to simulate a multiplication w/ overflow
-                long int HImask = (long int) (pow(2, 32) - 1) << 32;        // Again, not a register, only used to simulated multiplication w/ overflow
+            case MULO: {
+                DoubleWord product = (DoubleWord) IN0 * IN1;
 
-                HI = (int) ( (tempResult & HImask) >> 32);
-                LO = (int) tempResult;
-                break;*/
+                HI = (Word) (product >> WORD_BITS);
+                LO = (Word) product;
+                writeBackFlag = false;
+                break;
+            }
+
+            case MVHI:
+                OUT = HI;
+                break;
+
+            case MVLO:
+                OUT = LO;
+                break;
 
             case DIV:
-                OUT = (int) IN0 / IN1;
+                OUT = IN0 / IN1;
 
                 //writeBackFlag = true;
                 break;
@@ -130,6 +166,10 @@ class ALU : public ExecutionUnit{
 
                 //writeBackFlag = true;
                 break;
+
+            case CMOV:                  // The guard has already decided
+                OUT = IN0;
+                break;
             
             default:
                 throw std::invalid_argument("ALU cannot execute instruction: " + OpCodeRegister);
@@ -137,6 +177,7 @@ class ALU : public ExecutionUnit{
         }
 
         state = DONE;
+        outputFlag = true;
     }
 };
 
@@ -146,16 +187,28 @@ class BU : public ExecutionUnit{
 
     public:
         bool branchFlag = false;    // True is there is going to be a branch - default = no branch
+        bool taken = false;         // The JMP/conditional branch went to its target (even if fetch already had)
+        int PREDICTED;              // Where fetch went after this instruction (CALL/RET are followed at fetch)
+        Word LINK;                  // Return address CALL writes back into the link register
+        int PC_OUT = 0;             // Like DEST_OUT - issue() can give the BU its next branch before complete() has taken this one
+        Instruction OPCODE_OUT = NOP;
 
     BU(){
         typeOfEU = "BU";
     }
 
     void cycle(){
+        PROFILE(PROFILE_BU);
+
         // Set state to RUNNING
         state = RUNNING;
+        branchFlag = false;
+        taken = false;
+        writeBackFlag = false;
+        PC_OUT = PC;
+        OPCODE_OUT = OpCodeRegister;
 
-        std::cout << "BU cycle called" << std::endl;
+        *logStream << "BU cycle called" << std::endl;
         switch(OpCodeRegister){
             case JMP:
             OUT = DEST;//registerFile[BUD];      // Again as in STO, is accessing the register file at this point illegal?
@@ -167,7 +220,7 @@ class BU : public ExecutionUnit{
             break;
 
         case JMPI:
-            OUT = OUT + DEST;//registerFile[BUD]; // WARNING ERROR HERE
+            OUT = PC + DEST;    // Relative to the JMPI itself, not to wherever fetch had got to
 
             branchFlag = true;
             
@@ -207,12 +260,53 @@ class BU : public ExecutionUnit{
                 //cout << "BRANCH" << endl; 
             }
             break;
+
+        case CALL:
+            OUT = IMMEDIATE;
+            LINK = IN0;
+            DEST_OUT = DEST;
+            writeBackFlag = true;
+
+            // Fetch has already jumped to the target so only branch if that went wrong
+            branchFlag = (OUT != PREDICTED);
+            break;
+
+        case CMPBZ:
+        case CMPBNE:
+        case CMPBPO:
+            // The CMP's result still has to be written back (IMMEDIATE holds its destination register)
+            if      (IN0 < IN1) LINK = -1;
+            else if (IN0 > IN1) LINK =  1;
+            else                LINK =  0;
+            DEST_OUT = IMMEDIATE;
+            writeBackFlag = true;
+
+            if ((OpCodeRegister == CMPBZ && LINK == 0) || (OpCodeRegister == CMPBNE && LINK < 0) || (OpCodeRegister == CMPBPO && LINK > 0)) {
+                OUT = DEST;
+                branchFlag = true;
+            }
+            break;
+
+        case RET:
+            OUT = IN0;
+
+            // Only branch if the return address stack predicted the wrong address
+            branchFlag = (OUT != PREDICTED);
+            break;
         
         default:
             throw std::invalid_argument("BU cannot execute instruction: " + OpCodeRegister);
         }
 
+        // Fetch normally carries on after a branch but the loop buffer sends it back round the loop, only redirect if it went the wrong way
+        if ((OpCodeRegister >= JMP && OpCodeRegister <= BZ) || (OpCodeRegister >= CMPBZ && OpCodeRegister <= CMPBPO)) {
+            taken = branchFlag;
+            if (!taken) OUT = PC + 1;
+            branchFlag = (OUT != PREDICTED);
+        }
+
         state = DONE;
+        outputFlag = true;
     }
 
 };
@@ -221,28 +315,71 @@ class BU : public ExecutionUnit{
 // Implementation for a load/store unit (LSU)
 class LSU : public ExecutionUnit{
     public:
-        std::array<int, SIZE_OF_DATA_MEMORY>* memoryData;
-
-    LSU(std::array<int, SIZE_OF_DATA_MEMORY>* memData){
+        DataMemory* memoryData;
+        Journal* journal = nullptr;     // Only set when the debugger is recording history
+        MemoryModel* memoryModel = nullptr; // Only set when memory has a latency (-memlat)
+        std::ostream* output = &std::cout;  // Where OUT writes to (-out)
+
+        int stallCycles = 0;            // Extra cycles the last instruction spent waiting on memory
+        int misses = 0;                 // ... and the accesses of it that went all the way to memory
+        bool accessedMemory = false;    // The last instruction read or wrote data memory (LDI/OUT don't) ...
+        Word accessAddress = 0;         // ... at this address, execute() works out bank conflicts from it
+        int PC_OUT = 0;                 // Like DEST_OUT, the LSUs after the first in a memory group only go through complete()
+        Instruction OPCODE_OUT = NOP;   // so it needs to know what they ran after issue() has given them the next one
+        Word overwritten = 0;           // What the last store replaced, so a thread switching out (-threads) can take it back
+        int addressSpace = 0;           // Added to addresses for memoryModel, each thread (-threads) has its own lines
+
+    LSU(DataMemory* memData){
         memoryData = memData;
         typeOfEU = "LSU";
     }
 
+    void timeAccess(Word address){
+        stallCycles += memoryModel->access(PC, addressSpace + address) - 1;
+        if (memoryModel->lastMissed) misses++;
+    }
+
+    // All reads of data memory go through here so that they can be timed
+    Word load(Word address){
+        Word value = memoryData->at(address);
+        accessedMemory = true;
+        accessAddress = address;
+        if (memoryModel) timeAccess(address);
+        return value;
+    }
+
+    // All writes to data memory go through here so that they can be timed and journaled
+    void store(Word address, Word value){
+        overwritten = memoryData->at(address);
+        memoryData->at(address) = value;
+        accessedMemory = true;
+        accessAddress = address;
+        if (memoryModel) timeAccess(address);
+        if (journal) journal->recordMemory(address, value);
+    }
+
     void cycle(){
+        PROFILE(PROFILE_LSU);
+
         // Set state to RUNNING
         state = RUNNING;
+        stallCycles = 0;
+        misses = 0;
+        accessedMemory = false;
+        PC_OUT = PC;
+        OPCODE_OUT = OpCodeRegister;
 
-        std::cout << "LSU cycle called" << std::endl;
+        *logStream << "LSU cycle called" << std::endl;
         switch(OpCodeRegister){
             case LD:
-                OUT = memoryData->at(IN0);
+                OUT = load(IN0);
                 DEST_OUT = DEST;
                 
                 writeBackFlag = true;
                 break;
 
             case LDD:
-                OUT = memoryData->at(IMMEDIATE);
+                OUT = load(IMMEDIATE);
                 DEST_OUT = DEST;
 
                 writeBackFlag = true;
@@ -259,18 +396,33 @@ class LSU : public ExecutionUnit{
                 registerFile[ALUD] = dataMemory[dataMemory[IN0]];
                 break;*/
             case LDA:
-                OUT = memoryData->at(IN0 + IN1);
+                OUT = load(IN0 + IN1);
                 DEST_OUT = DEST;
 
                 writeBackFlag = true;
                 break;
 
             case STO:
-                memoryData->at(DEST) = IN0;
+                store(DEST, IN0);
+                OUT = IN0;          // Not written back - passed on so -cosim can see what was stored where
+                DEST_OUT = DEST;
+
+                writeBackFlag = false;
                 break;
 
             case STOI:                   // #####################
-                memoryData->at(IMMEDIATE) = IN0;
+                store(IMMEDIATE, IN0);
+                OUT = IN0;
+                DEST_OUT = IMMEDIATE;
+
+                writeBackFlag = false;
+                break;
+
+            case Instruction::OUT:      // OUT on its own is the output register
+                *output << DEST << "\n";
+                OUT = DEST;
+
+                writeBackFlag = false;
                 break;
 
             default:
@@ -279,6 +431,7 @@ class LSU : public ExecutionUnit{
 
         // Announce the fact that the instruction has been completed
         state = DONE;
+        outputFlag = true;
     }
 };
 
@@ -291,8 +444,9 @@ class MISC : public ExecutionUnit{
     void cycle(){
         // Set state to RUNNING
         state = RUNNING;
-        std::cout << "NOT IMPLEMENTED MISC EU YET" << std::endl;
+        *logStream << "NOT IMPLEMENTED MISC EU YET" << std::endl;
         
         state = DONE;
+        outputFlag = true;
     }
 };
\ No newline at end of file
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <array>
+#include <deque>
+#include <string>
+
+#include "EnumsAndConstants.hpp"
+#include "MemoryModel.hpp"
+#include "ReturnAddressStack.hpp"
+#include "HardwareLoopStack.hpp"
+
+// Decoupled front end (-ftq) - a branch prediction stage in front of fetch that runs ahead of it and queues up the blocks
+// of instructions fetch is going to go through, asking instruction memory for each block's line as it goes so that the
+// line is there by the time fetch gets to it. It predicts the same way fetch does (straight on, CALLs to their target,
+// RETs from the return address stack, round hardware loops) with its own copies of the return address stack and loops.
+// Fetch still works out where it goes itself and checks it against the queue - where the two disagree (a branch went the
+// other way, decode changed the path) the queue is thrown away and the stage starts again from where fetch is.
+
+
+class FetchTargetQueue{
+    private:
+        struct Block {
+            int start;          // Next address fetch should get from the block ...
+            int end;            // ... up to and including this one, all in the same line
+        };
+
+        std::deque<Block> blocks;
+        int size;
+        const std::array<std::string, SIZE_OF_INSTRUCTION_MEMORY>* program;
+        MemoryModel* instructionMemory;
+
+        // Where the stage has got to and what it predicts with
+        int PC = 0;
+        ReturnAddressStack returnAddresses;
+        HardwareLoopStack loops;
+        bool stopped = false;       // Ran into a HALT or the end of the program, nothing to predict after it
+        bool fetched = false;       // Started again from the instruction fetch has just got, which mustn't be queued
+
+    public:
+        /* Stats */
+        long long numOfBlocks = 0;      // Blocks queued
+        long long numOfResteers = 0;    // Times fetch went somewhere the queue didn't say
+
+    FetchTargetQueue(int entries, const std::array<std::string, SIZE_OF_INSTRUCTION_MEMORY>* instructions, MemoryModel* memory){
+        size = entries;
+        program = instructions;
+        instructionMemory = memory;
+    }
+
+    bool full() const {
+        return (int) blocks.size() >= size || stopped;
+    }
+
+    // One cycle of the prediction stage - queues the next block and prefetches its line
+    void predict(){
+        if (full()) return;
+        if (PC < 0 || PC >= SIZE_OF_INSTRUCTION_MEMORY) {
+            stopped = true;
+            return;
+        }
+
+        Block block = {PC, PC};
+        int line = PC / INSTRUCTION_CACHE_LINE_SIZE;
+        while (true){
+            const std::string& instruction = program->at(block.end);
+            int next = block.end + 1;
+
+            if (instruction.empty() || instruction.compare(0, 4, "HALT") == 0) stopped = true;
+            else if (instruction.compare(0, 4, "CALL") == 0) {
+                returnAddresses.push(block.end + 1);
+                next = std::stoi(instruction.substr(instruction.find(' ') + 1));
+            } else if (instruction.compare(0, 3, "RET") == 0) {
+                int returnAddress;
+                if (returnAddresses.pop(returnAddress)) next = returnAddress;
+            }
+            loops.next(block.end, next);
+
+            // A block ends where the path leaves the line or goes anywhere but straight on
+            if (stopped || next != block.end + 1 || next >= SIZE_OF_INSTRUCTION_MEMORY || next / INSTRUCTION_CACHE_LINE_SIZE != line) {
+                PC = next;
+                break;
+            }
+            block.end++;
+        }
+
+        instructionMemory->prefetch(line);
+        if (fetched) {
+            fetched = false;
+            if (block.start == block.end) return;
+            block.start++;
+        }
+        blocks.push_back(block);
+        numOfBlocks++;
+    }
+
+    // Fetch is getting the instruction at pc, with its return address stack and loops as they are before it does
+    void follow(int pc, const ReturnAddressStack& fetchReturnAddresses, const HardwareLoopStack& fetchLoops){
+        if (!blocks.empty() && blocks.front().start == pc) {
+            if (blocks.front().start == blocks.front().end) blocks.pop_front();
+            else blocks.front().start++;
+            return;
+        }
+
+        // Not where the queue said - the stage being exactly there without having queued it yet isn't a resteer
+        if (!blocks.empty() || PC != pc || stopped) numOfResteers++;
+        blocks.clear();
+        PC = pc;
+        returnAddresses = fetchReturnAddresses;
+        loops = fetchLoops;
+        stopped = false;
+        fetched = true;
+    }
+};
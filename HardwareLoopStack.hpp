@@ -0,0 +1,64 @@
+#pragma once
+
+#include <array>
+#include <stdexcept>
+
+#include "EnumsAndConstants.hpp"
+
+// Hardware loops - LOOP rs end runs the instructions between the LOOP and end rs times. Decode starts the loop and
+// fetch goes back to the start of the body by itself every time it fetches the body's last instruction, so going round
+// costs no instruction and no branch. A loop can run inside another one as long as it ends at or before the outer end.
+// Small enough to copy - fetch runs ahead of the BU, so each stage keeps the copy from before its instruction was
+// fetched and flushPipeline() puts back the one of the oldest instruction it throws away.
+class HardwareLoopStack{
+    private:
+        struct Loop {
+            int start;          // First and last address of the body
+            int end;
+            Word count;         // Times the body still has to run, including the current one
+        };
+
+        std::array<Loop, HARDWARE_LOOP_DEPTH> loops;
+
+    public:
+        int depth = 0;          // Loops running
+
+        /* Stats - kept in here so that a flush takes back what the thrown away instructions counted */
+        int numOfLoops = 0;             // LOOPs that ran their body at least once
+        long long numOfBackEdges = 0;   // Times fetch went back to the start of a body
+
+    // Returns false (and starts nothing) if the body shouldn't run at all
+    bool start(int bodyStart, int bodyEnd, Word count){
+        if (bodyEnd < bodyStart) throw std::invalid_argument("LOOP needs at least one instruction in its body");
+        if (depth > 0 && bodyEnd > loops[depth - 1].end) throw std::invalid_argument("LOOP has to end inside the loop it is in");
+        if (count <= 0) return false;
+        if (depth == HARDWARE_LOOP_DEPTH) throw std::invalid_argument("LOOPs are nested too deep (HARDWARE_LOOP_DEPTH)");
+
+        loops[depth] = {bodyStart, bodyEnd, count};
+        depth++;
+        numOfLoops++;
+        return true;
+    }
+
+    // The instruction at pc is the last of a running loop's body
+    bool isEnd(int pc) const {
+        for (int i = 0; i < depth; i++) if (loops[i].end == pc) return true;
+        return false;
+    }
+
+    // Called for every instruction fetched, returns true if the one at pc ends a body that has to run again - nextPC is then its start.
+    // Loops that end at the same place finish inner first.
+    bool next(int pc, int& nextPC){
+        while (depth > 0 && loops[depth - 1].end == pc){
+            Loop& loop = loops[depth - 1];
+            if (loop.count > 1) {
+                loop.count--;
+                nextPC = loop.start;
+                numOfBackEdges++;
+                return true;
+            }
+            depth--;
+        }
+        return false;
+    }
+};
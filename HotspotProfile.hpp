@@ -0,0 +1,73 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <ostream>
+#include <iomanip>
+#include <algorithm>
+
+#include "EnumsAndConstants.hpp"
+
+// What one instruction of the program cost over the run
+struct HotspotCounters {
+    long long runs = 0;                 // Times it was written back
+    long long slots = 0;                // Cycles it went down the pipeline in a slot of its own (not a fused branch or the rest of a memory group)
+    long long memoryStallCycles = 0;    // Cycles the pipeline waited for it to get its data from memory ...
+    long long bankConflictCycles = 0;   // ... and for another access in its group to the same bank
+    long long misses = 0;               // Accesses that went all the way to memory
+    long long mispredicts = 0;          // Times the BU had to send fetch somewhere else
+    long long flushCycles = 0;          // Cycles the pipeline took to fill up again after it did
+
+    long long cycles() const {
+        return slots + memoryStallCycles + bankConflictCycles + flushCycles;
+    }
+};
+
+
+// Per instruction profile for -annotate - the pipeline puts every cycle it can down to the instruction at fault and
+// print() lists the program with what each line cost, hottest first in the summary
+class HotspotProfile{
+    private:
+        std::vector<HotspotCounters> counters;
+
+    public:
+
+    HotspotProfile(int size) : counters(size) {}
+
+    HotspotCounters& at(int pc){
+        return counters.at(pc);
+    }
+
+    void print(std::ostream& out, const std::vector<std::string>& program, int lines, long long numOfCycles) const {
+        long long attributed = 0;
+        for (const HotspotCounters& c : counters) attributed += c.cycles();
+
+        out << "\n---------- ANNOTATED PROGRAM ----------\n" << std::endl;
+        out << std::right << std::setw(7) << "%" << std::setw(9) << "Cycles" << std::setw(9) << "Runs" << std::setw(9) << "Memory"
+            << std::setw(7) << "Bank" << std::setw(8) << "Misses" << std::setw(9) << "Mispred" << std::setw(9) << "Refill" << "   PC  Instruction" << std::endl;
+
+        for (int pc = 0; pc < lines && pc < (int) counters.size(); pc++){
+            const HotspotCounters& c = counters.at(pc);
+            out << std::right << std::fixed << std::setprecision(2) << std::setw(7) << (numOfCycles ? 100.0 * c.cycles() / numOfCycles : 0)
+                << std::setw(9) << c.cycles() << std::setw(9) << c.runs << std::setw(9) << c.memoryStallCycles << std::setw(7) << c.bankConflictCycles
+                << std::setw(8) << c.misses << std::setw(9) << c.mispredicts << std::setw(9) << c.flushCycles
+                << std::setw(5) << pc << "  " << program.at(pc) << std::endl;
+        }
+        out.unsetf(std::ios::fixed);
+        out << std::setprecision(6);
+
+        out << "\nCycles put down to an instruction:\t\t" << attributed << "/" << numOfCycles << std::endl;
+        out << "(the rest are the pipeline filling up at the start and draining at the HALT)" << std::endl;
+
+        // Hottest lines
+        std::vector<int> order;
+        for (int pc = 0; pc < lines && pc < (int) counters.size(); pc++) if (counters.at(pc).cycles() > 0) order.push_back(pc);
+        std::stable_sort(order.begin(), order.end(), [this](int a, int b){ return counters.at(a).cycles() > counters.at(b).cycles(); });
+
+        out << "\nHottest instructions:" << std::endl;
+        for (int i = 0; i < (int) order.size() && i < HOTSPOTS_LISTED; i++){
+            int pc = order.at(i);
+            out << "  " << pc << "\t" << counters.at(pc).cycles() << " cycles\t" << program.at(pc) << std::endl;
+        }
+    }
+};
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <array>
+#include <deque>
+#include <vector>
+#include <cstdint>
+#include <stdexcept>
+
+#include "EnumsAndConstants.hpp"
+
+// Records what changed in each cycle so that the debugger can go back to any earlier cycle.
+// Every cycle only stores the register/memory writes it made (and the PC if it did not just increment),
+// a full copy of the architectural state is kept every JOURNAL_SNAPSHOT_INTERVAL cycles to replay from.
+// Only the last JOURNAL_SNAPSHOTS copies are kept, and the cycles before the oldest one go with the copies dropped.
+class Journal{
+    private:
+        // Kind of write is stored in the top 2 bits of the location, the register/address in the rest
+        enum EntryKind { REGISTER_WRITE = 0, MEMORY_WRITE = 1, PC_WRITE = 2 };
+        static const int KIND_SHIFT = 30;
+
+        struct Entry {
+            uint32_t location;
+            Word value;
+        };
+
+        struct Snapshot {
+            std::array<Word, 16> registers;
+            DataMemory memory;
+            int PC;
+        };
+
+        std::array<Word, 16>* registerFile;
+        DataMemory* dataMemory;
+        int* PC;
+
+        std::vector<Entry> entries;
+        std::vector<uint32_t> cycleEnds;        // cycleEnds[c] = number of entries once cycle firstCycle + c has finished
+        std::deque<Snapshot> snapshots;         // snapshots[i] = state at the end of cycle firstCycle + i * JOURNAL_SNAPSHOT_INTERVAL
+
+        int firstCycle = 0;                     // Oldest cycle that can still be rebuilt
+        int lastPC;
+
+        void record(EntryKind kind, size_t index, Word value){
+            if (index >> KIND_SHIFT) throw std::out_of_range("Address too large for the journal");
+            entries.push_back({ ((uint32_t) kind << KIND_SHIFT) | (uint32_t) index, value });
+        }
+
+        void takeSnapshot(){
+            snapshots.push_back({ *registerFile, *dataMemory, *PC });
+            if (snapshots.size() > (size_t) JOURNAL_SNAPSHOTS) dropOldestSnapshot();
+        }
+
+        // The oldest copy goes along with the writes made up to the next one, which is where history then starts
+        void dropOldestSnapshot(){
+            uint32_t dropped = cycleEnds.at(JOURNAL_SNAPSHOT_INTERVAL);
+            entries.erase(entries.begin(), entries.begin() + dropped);
+            cycleEnds.erase(cycleEnds.begin(), cycleEnds.begin() + JOURNAL_SNAPSHOT_INTERVAL);
+            for (uint32_t& end : cycleEnds) end -= dropped;
+
+            snapshots.pop_front();
+            firstCycle += JOURNAL_SNAPSHOT_INTERVAL;
+        }
+
+    public:
+
+    Journal(std::array<Word, 16>* regs, DataMemory* memData, int* programCounter){
+        registerFile = regs;
+        dataMemory = memData;
+        PC = programCounter;
+
+        // Cycle 0 is the state before anything has ran
+        lastPC = *PC;
+        cycleEnds.push_back(0);
+        takeSnapshot();
+    }
+
+    void recordRegister(int reg, Word value){
+        record(REGISTER_WRITE, reg, value);
+    }
+
+    void recordMemory(size_t address, Word value){
+        record(MEMORY_WRITE, address, value);
+    }
+
+    // Closes the current cycle, must be called once at the end of every cycle
+    void endCycle(){
+        // A PC that just moved on by one is implied, anything else (branches/stalls) is stored
+        if (*PC != lastPC + 1) record(PC_WRITE, 0, *PC);
+        lastPC = *PC;
+
+        cycleEnds.push_back(entries.size());
+        if (latestCycle() % JOURNAL_SNAPSHOT_INTERVAL == 0) takeSnapshot();
+    }
+
+    // Last cycle that has been recorded
+    int latestCycle() const {
+        return firstCycle + cycleEnds.size() - 1;
+    }
+
+    // Cycles before this one have been dropped to keep the journal's size down
+    int oldestCycle() const {
+        return firstCycle;
+    }
+
+    // Rebuilds the architectural state as it was at the end of the given cycle
+    void reconstruct(int cycle, std::array<Word, 16>& regs, DataMemory& memData, int& programCounter) const {
+        if (cycle < firstCycle || cycle > latestCycle()) throw std::out_of_range("Cycle has not been recorded");
+
+        int start = (cycle / JOURNAL_SNAPSHOT_INTERVAL) * JOURNAL_SNAPSHOT_INTERVAL;
+        const Snapshot& snapshot = snapshots.at((start - firstCycle) / JOURNAL_SNAPSHOT_INTERVAL);
+        regs = snapshot.registers;
+        memData = snapshot.memory;
+        programCounter = snapshot.PC;
+
+        // Replay every cycle after the snapshot
+        for (int c = start + 1; c <= cycle; c++){
+            bool PCWritten = false;
+            for (uint32_t i = cycleEnds.at(c - firstCycle - 1); i < cycleEnds.at(c - firstCycle); i++){
+                const Entry& e = entries.at(i);
+                uint32_t index = e.location & ((1u << KIND_SHIFT) - 1);
+
+                switch (e.location >> KIND_SHIFT){
+                    case REGISTER_WRITE: regs.at(index) = e.value; break;
+                    case MEMORY_WRITE:   memData.at(index) = e.value; break;
+                    case PC_WRITE:       programCounter = (int) e.value; PCWritten = true; break;
+                }
+            }
+            if (!PCWritten) programCounter++;
+        }
+    }
+
+    // Rough amount of host memory the journal is holding
+    size_t bytesUsed() const {
+        size_t bytes = entries.capacity() * sizeof(Entry) + cycleEnds.capacity() * sizeof(uint32_t) + snapshots.size() * sizeof(Snapshot);
+        for (const Snapshot& s : snapshots) bytes += s.memory.capacity() * sizeof(Word);
+        return bytes;
+    }
+};
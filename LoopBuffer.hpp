@@ -0,0 +1,87 @@
+#pragma once
+
+#include <vector>
+
+#include "EnumsAndConstants.hpp"
+
+// An instruction once decode has parsed it - registers are still indexes, decode reads their values
+struct DecodedInstruction {
+    Instruction opCode = NOP;
+    int dest = -1;              // Register in the first operand (-1 = not a register)
+    int src0 = -1;              // Register in the second operand
+    int src1 = -1;              // Register in the third operand
+    int target = -1;            // Register holding the branch target of a fused CMP + branch
+    int guard = -1;             // Register an ALU instruction is predicated on (-1 = always runs)
+    Instruction guardCondition = NOP;   // ... and whether it has to be zero (BZ), negative (BNE) or positive (BPO)
+    Word immediate = 0;
+    bool hasImmediate = false;
+};
+
+
+// Loop buffer - holds the decoded instructions of a short loop so that fetch can hand them straight to decode
+// instead of reading and parsing them again every iteration.
+// A taken backward branch covering at most LOOP_BUFFER_SIZE instructions makes that loop the one being captured,
+// decode fills it in as the loop runs. Once the same branch has been taken twice fetch also sends the loop's last
+// instruction straight back to the start, the BU only redirects when the loop is left.
+class LoopBuffer{
+    private:
+        std::vector<DecodedInstruction> instructions;
+        std::vector<bool> valid;
+        bool confirmed = false;     // The backward branch has been taken again since the loop was captured
+
+    public:
+        int start = -1;             // First and last (the backward branch) address of the loop
+        int end = -1;
+
+        /* Stats */
+        int numOfHits = 0;          // Fetches served by the loop buffer
+        int numOfMisses = 0;        // Fetches that had to go to instruction memory
+        int numOfLoopsCaptured = 0;
+
+    // Called for every taken backward branch
+    void backwardBranch(int from, int to){
+        if (from - to + 1 > LOOP_BUFFER_SIZE) return;
+
+        if (from == end && to == start) {
+            confirmed = true;
+            return;
+        }
+
+        // A different loop, throw the old one away
+        start = to;
+        end = from;
+        confirmed = false;
+        instructions.assign(end - start + 1, DecodedInstruction());
+        valid.assign(end - start + 1, false);
+        numOfLoopsCaptured++;
+    }
+
+    bool contains(int pc) const {
+        return pc >= start && pc <= end;
+    }
+
+    // Decode hands over every instruction it parses in the loop
+    void capture(int pc, const DecodedInstruction& instruction){
+        if (!contains(pc)) return;
+        instructions.at(pc - start) = instruction;
+        valid.at(pc - start) = true;
+    }
+
+    // Where fetch should go after the instruction at pc
+    int predict(int pc) const {
+        return (pc == end && confirmed) ? start : pc + 1;
+    }
+
+    // Returns true if the instruction at pc has already been decoded, nextPC is where fetch should go after it
+    bool lookup(int pc, DecodedInstruction& instruction, int& nextPC){
+        if (!contains(pc) || !valid.at(pc - start)) {
+            numOfMisses++;
+            return false;
+        }
+
+        numOfHits++;
+        instruction = instructions.at(pc - start);
+        nextPC = predict(pc);
+        return true;
+    }
+};
@@ -0,0 +1,287 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+
+#include "EnumsAndConstants.hpp"
+
+// Timing only - the values still live in dataMemory, this just decides how many cycles an access takes.
+// Data memory sits behind a small fully associative buffer of lines (LRU), anything not in it
+// takes memoryLatency cycles to come back. Prefetchers can ask for lines before they are needed.
+// Instruction memory (-imemlat) gets a model of its own with instruction sized lines.
+
+
+// A prefetcher is told about every demand access and returns the lines it wants fetched
+class Prefetcher{
+    public:
+        std::string name = "none";
+
+    virtual ~Prefetcher(){}
+
+    virtual void access(int pc, int address, bool miss, std::vector<int>& lines) = 0;
+};
+
+
+// Fetches the next PREFETCH_DEGREE lines after a miss
+class NextLinePrefetcher : public Prefetcher{
+    public:
+
+    NextLinePrefetcher(){
+        name = "next-line";
+    }
+
+    void access(int /*pc*/, int address, bool miss, std::vector<int>& lines){
+        if (!miss) return;
+
+        int line = address / DATA_CACHE_LINE_SIZE;
+        for (int i = 1; i <= PREFETCH_DEGREE; i++) lines.push_back(line + i);
+    }
+};
+
+
+// Remembers the last address and stride for each load/store (indexed by PC) and prefetches
+// PREFETCH_DEGREE strides ahead once the same stride has been seen twice in a row
+class StridePrefetcher : public Prefetcher{
+    private:
+        struct Entry {
+            int pc = -1;
+            int lastAddress = 0;
+            int stride = 0;
+            int confidence = 0;     // 2 bit saturating counter
+        };
+
+        std::vector<Entry> table;
+
+    public:
+
+    StridePrefetcher() : table(STRIDE_TABLE_SIZE) {
+        name = "stride";
+    }
+
+    void access(int pc, int address, bool /*miss*/, std::vector<int>& lines){
+        Entry& e = table.at(pc % STRIDE_TABLE_SIZE);
+
+        // New instruction in this slot, start again
+        if (e.pc != pc) {
+            e.pc = pc;
+            e.lastAddress = address;
+            e.stride = 0;
+            e.confidence = 0;
+            return;
+        }
+
+        int stride = address - e.lastAddress;
+        if (stride == e.stride && stride != 0) { if (e.confidence < 3) e.confidence++; }
+        else                                   { e.stride = stride; e.confidence = 0; }
+        e.lastAddress = address;
+
+        if (e.confidence < 2) return;
+
+        int lastLine = address / DATA_CACHE_LINE_SIZE;
+        for (int i = 1; i <= PREFETCH_DEGREE; i++){
+            int line = (address + e.stride * i) / DATA_CACHE_LINE_SIZE;
+            if (line != lastLine) lines.push_back(line);
+            lastLine = line;
+        }
+    }
+};
+
+
+// STREAM_BUFFERS buffers each following a run of ascending lines. A miss that isn't the next line of
+// any stream starts a new one (replacing the least recently used), a hit on a stream keeps it
+// STREAM_BUFFER_DEPTH lines ahead.
+class StreamBufferPrefetcher : public Prefetcher{
+    private:
+        struct Stream {
+            int nextLine = -1;      // Line the stream expects to be asked for next
+            int lastUse = 0;
+        };
+
+        std::vector<Stream> streams;
+        int uses = 0;
+
+    public:
+
+    StreamBufferPrefetcher() : streams(STREAM_BUFFERS) {
+        name = "stream";
+    }
+
+    void access(int /*pc*/, int address, bool miss, std::vector<int>& lines){
+        int line = address / DATA_CACHE_LINE_SIZE;
+        uses++;
+
+        for (Stream& s : streams){
+            if (s.nextLine == line){
+                s.nextLine = line + 1;
+                s.lastUse = uses;
+                lines.push_back(line + STREAM_BUFFER_DEPTH);
+                return;
+            }
+        }
+
+        if (!miss) return;
+
+        // Start a new stream
+        Stream* victim = &streams.at(0);
+        for (Stream& s : streams) if (s.lastUse < victim->lastUse) victim = &s;
+
+        victim->nextLine = line + 1;
+        victim->lastUse = uses;
+        for (int i = 1; i <= STREAM_BUFFER_DEPTH; i++) lines.push_back(line + i);
+    }
+};
+
+
+class MemoryModel{
+    private:
+        struct Line {
+            int line;
+            int lastUse;
+            bool prefetched;        // Brought in by a prefetch and not used yet
+        };
+
+        struct Request {
+            int line;
+            int ready;              // Cycle the line arrives
+        };
+
+        const int* clock;           // Current cycle
+        int memoryLatency;
+        int memorySize;             // Words of data memory, nothing past it is prefetched
+        int lineSize;               // Words per line
+        int capacity;               // Lines held
+
+        std::vector<Line> lines;
+        std::vector<Request> inFlight;
+
+        Line* find(int line){
+            for (Line& l : lines) if (l.line == line) return &l;
+            return nullptr;
+        }
+
+        Request* findInFlight(int line){
+            for (Request& r : inFlight) if (r.line == line) return &r;
+            return nullptr;
+        }
+
+        void install(int line, bool prefetched){
+            if ((int) lines.size() < capacity) {
+                lines.push_back({line, *clock, prefetched});
+                return;
+            }
+
+            Line* victim = &lines.at(0);
+            for (Line& l : lines) if (l.lastUse < victim->lastUse) victim = &l;
+
+            if (victim->prefetched) numOfUselessPrefetches++;
+            *victim = {line, *clock, prefetched};
+        }
+
+        // Moves any prefetches that have arrived into the buffer
+        void arrive(){
+            for (size_t i = 0; i < inFlight.size();){
+                if (inFlight.at(i).ready <= *clock) {
+                    if (!find(inFlight.at(i).line)) install(inFlight.at(i).line, true);
+                    inFlight.erase(inFlight.begin() + i);
+                } else i++;
+            }
+        }
+
+    public:
+        Prefetcher* prefetcher = nullptr;
+
+        /* Stats */
+        int numOfAccesses = 0;
+        int numOfHits = 0;
+        int numOfMisses = 0;                // Had to wait the full memory latency
+        bool lastMissed = false;            // ... the last access() did
+        int numOfPrefetches = 0;            // Prefetches sent to memory
+        int numOfDroppedPrefetches = 0;     // Prefetches thrown away because too many were in flight
+        int numOfUsefulPrefetches = 0;      // Prefetched lines a demand access used
+        int numOfLatePrefetches = 0;        // ... of which were still on their way when they were needed
+        int numOfUselessPrefetches = 0;     // Prefetched lines evicted without being used
+        long long numOfStallCycles = 0;     // Cycles spent waiting on memory
+
+    MemoryModel(const int* cycleCounter, int latency, int size, int wordsPerLine = DATA_CACHE_LINE_SIZE, int linesHeld = DATA_CACHE_LINES){
+        clock = cycleCounter;
+        memoryLatency = latency;
+        memorySize = size;
+        lineSize = wordsPerLine;
+        capacity = linesHeld;
+    }
+
+    ~MemoryModel(){
+        delete prefetcher;
+    }
+
+    // Returns how many cycles the access at address (made by the instruction at pc) takes - loads and stores are treated the same
+    int access(int pc, int address){
+        arrive();
+        numOfAccesses++;
+
+        int line = address / lineSize;
+        int latency = 1;
+        bool miss = false;
+
+        Line* l = find(line);
+        Request* r = findInFlight(line);
+        if (l) {
+            numOfHits++;
+            if (l->prefetched) {
+                numOfUsefulPrefetches++;
+                l->prefetched = false;
+            }
+            l->lastUse = *clock;
+        } else if (r) {
+            // Prefetched but hasn't arrived yet
+            numOfUsefulPrefetches++;
+            numOfLatePrefetches++;
+            latency = std::max(1, r->ready - *clock);
+            inFlight.erase(inFlight.begin() + (r - &inFlight.at(0)));
+            install(line, false);
+        } else {
+            numOfMisses++;
+            miss = true;
+            latency = memoryLatency;
+            install(line, false);
+        }
+
+        if (prefetcher){
+            std::vector<int> requests;
+            prefetcher->access(pc, address, miss, requests);
+
+            for (int p : requests) prefetch(p);
+        }
+
+        numOfStallCycles += latency - 1;
+        lastMissed = miss;
+        return latency;
+    }
+
+    // Asks memory for line before it is needed, unless it is already here or on its way. Returns false if it wasn't sent.
+    bool prefetch(int line){
+        arrive();
+        if (line < 0 || line >= (memorySize + lineSize - 1) / lineSize) return false;
+        if (find(line) || findInFlight(line)) return false;
+        if ((int) inFlight.size() >= MAX_OUTSTANDING_PREFETCHES) {
+            numOfDroppedPrefetches++;
+            return false;
+        }
+
+        inFlight.push_back({line, *clock + memoryLatency});
+        numOfPrefetches++;
+        return true;
+    }
+};
+
+
+// Builds the prefetcher asked for on the command line
+inline Prefetcher* makePrefetcher(std::string name){
+    if (name == "nextline") return new NextLinePrefetcher();
+    if (name == "stride")   return new StridePrefetcher();
+    if (name == "stream")   return new StreamBufferPrefetcher();
+    if (name == "none")     return nullptr;
+    throw std::invalid_argument("Unknown prefetcher: " + name);
+}
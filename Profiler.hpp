@@ -0,0 +1,133 @@
+#pragma once
+
+// Host side profiling of the simulator itself - how long each stage and EU takes to simulate.
+// Only compiled in with -DISA_PROFILE, otherwise PROFILE() is empty and printProfile() does nothing.
+
+enum ProfileStage {
+    PROFILE_FETCH,
+    PROFILE_DECODE,
+    PROFILE_ISSUE,
+    PROFILE_EXECUTE,
+    PROFILE_COMPLETE,
+    PROFILE_WRITE_BACK,
+    PROFILE_ALU,
+    PROFILE_BU,
+    PROFILE_LSU,
+    NUM_OF_PROFILE_STAGES
+};
+
+#ifdef ISA_PROFILE
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <iomanip>
+#include <mutex>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+inline uint64_t readTimestamp(){ return __rdtsc(); }
+#else
+// No TSC, fall back to the steady clock (ticks are then already nanoseconds)
+inline uint64_t readTimestamp(){ return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+#endif
+
+struct ProfileCounter {
+    uint64_t ticks = 0;
+    uint64_t calls = 0;
+};
+
+// What the threads that have exited counted, added up
+inline ProfileCounter* finishedProfileCounters(){
+    static ProfileCounter counters[NUM_OF_PROFILE_STAGES];
+    return counters;
+}
+
+inline std::mutex& profileMutex(){
+    static std::mutex mutex;
+    return mutex;
+}
+
+// Each thread counts on its own (-intervals and library callers run a machine per thread) and hands its counts over when it exits
+struct ThreadProfileCounters {
+    ProfileCounter stages[NUM_OF_PROFILE_STAGES];
+
+    ~ThreadProfileCounters(){
+        std::lock_guard<std::mutex> lock(profileMutex());
+        for (int s = 0; s < NUM_OF_PROFILE_STAGES; s++){
+            finishedProfileCounters()[s].ticks += stages[s].ticks;
+            finishedProfileCounters()[s].calls += stages[s].calls;
+        }
+    }
+};
+
+inline ProfileCounter* profileCounters(){
+    thread_local ThreadProfileCounters counters;
+    return counters.stages;
+}
+
+// Timestamp and wall clock when the program started, used to turn ticks into nanoseconds
+struct ProfileClock {
+    uint64_t ticks = readTimestamp();
+    std::chrono::steady_clock::time_point time = std::chrono::steady_clock::now();
+};
+
+inline ProfileClock& profileStart(){
+    static ProfileClock start;
+    return start;
+}
+
+// Adds the time between construction and destruction to a stage
+class ScopedTimer{
+    private:
+        ProfileCounter& counter;
+        uint64_t start;
+
+    public:
+
+    ScopedTimer(ProfileStage stage) : counter(profileCounters()[stage]), start(readTimestamp()) {}
+
+    ~ScopedTimer(){
+        counter.ticks += readTimestamp() - start;
+        counter.calls++;
+    }
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE(stage) ScopedTimer PROFILE_CONCAT(profileTimer, __LINE__)(stage)
+
+// Call at the start of main so the whole run is timed
+inline void startProfile(){
+    profileStart();
+}
+
+// Counts this thread and every thread that has exited, numOfCycles is what all of them simulated
+inline void printProfile(long long numOfCycles){
+    static const char* names[NUM_OF_PROFILE_STAGES] = {"fetch()", "decode()", "issue()", "execute()", "complete()", "writeBack()", "ALU::cycle()", "BU::cycle()", "LSU::cycle()"};
+
+    ProfileClock& start = profileStart();
+    double elapsedNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start.time).count();
+    double nsPerTick = elapsedNs / (double) (readTimestamp() - start.ticks);
+
+    std::cout << "\n---------- HOST PROFILE ----------\n" << std::endl;
+    std::cout << std::left << std::setw(16) << "Stage" << std::setw(12) << "Calls" << std::setw(14) << "Total ms" << std::setw(12) << "ns/call" << "ns/cycle" << std::endl;
+    std::lock_guard<std::mutex> lock(profileMutex());
+    for (int s = 0; s < NUM_OF_PROFILE_STAGES; s++){
+        ProfileCounter c = finishedProfileCounters()[s];
+        c.ticks += profileCounters()[s].ticks;
+        c.calls += profileCounters()[s].calls;
+        double ns = c.ticks * nsPerTick;
+        std::cout << std::left << std::setw(16) << names[s] << std::setw(12) << c.calls << std::setw(14) << ns / 1e6
+                  << std::setw(12) << (c.calls ? ns / c.calls : 0) << (numOfCycles ? ns / numOfCycles : 0) << std::endl;
+    }
+    std::cout << "Whole run: " << elapsedNs / 1e6 << " ms, " << (numOfCycles ? elapsedNs / numOfCycles : 0) << " ns/cycle" << std::endl;
+}
+
+#else
+
+#define PROFILE(stage)
+inline void startProfile(){}
+inline void printProfile(long long){}
+
+#endif
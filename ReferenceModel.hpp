@@ -0,0 +1,221 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include "EnumsAndConstants.hpp"
+#include "LoopBuffer.hpp"       // DecodedInstruction
+#include "HardwareLoopStack.hpp"
+
+// What one instruction did to the architectural state
+struct ReferenceEffect {
+    int reg = -1;               // Register written (-1 = none)
+    Word regValue = 0;
+    Word address = -1;          // Data memory address written (-1 = none)
+    Word memValue = 0;
+    bool output = false;        // OUT
+    Word outValue = 0;
+    Word loaded = -1;           // Data memory address read (-1 = none), for -record
+    Word loopCount = 0;         // What a LOOP found in its register
+    bool predicatedOff = false; // A guarded instruction whose guard was false
+};
+
+
+// Architectural state between two instructions - -intervals starts the pipeline from these
+struct Checkpoint {
+    long long instructions = 0;         // Instructions ran before it
+    int PC = 0;
+    std::array<Word, 16> registers;
+    Word HI = 0;
+    Word LO = 0;
+    DataMemory memory;
+    HardwareLoopStack loops;
+};
+
+
+// Functional model of the ISA for -cosim - runs one instruction at a time in program order without any pipeline,
+// writeBack() checks every instruction the pipeline retires against what this says it should have done.
+// The program is decoded once up front so a step is only a switch.
+class ReferenceModel{
+    private:
+        std::vector<DecodedInstruction> program;
+        std::vector<bool> decoded;                  // false if the line couldn't be decoded (running it is a divergence)
+
+        std::array<int, COSIM_HISTORY> history;     // The last instructions retired
+        int historyTop = 0;
+
+    public:
+        std::array<Word, 16> registers;
+        DataMemory memory;
+        Word HI = 0;
+        Word LO = 0;
+        HardwareLoopStack loops;
+        int PC = 0;
+        bool halted = false;
+
+        long long numOfInstructions = 0;            // Instructions checked
+
+    ReferenceModel(const std::vector<DecodedInstruction>& instructions, const std::vector<bool>& valid, const DataMemory& initialMemory){
+        program = instructions;
+        decoded = valid;
+        registers.fill(0);
+        memory = initialMemory;
+        history.fill(-1);
+    }
+
+    Instruction opCodeAt(int pc) const {
+        if (pc < 0 || pc >= (int) program.size() || !decoded.at(pc)) return HALT;
+        return program.at(pc).opCode;
+    }
+
+    Checkpoint checkpoint() const {
+        Checkpoint c;
+        c.instructions = numOfInstructions;
+        c.PC = PC;
+        c.registers = registers;
+        c.HI = HI;
+        c.LO = LO;
+        c.memory = memory;
+        c.loops = loops;
+        return c;
+    }
+
+    // Carries on from a checkpoint as if it had ran up to it
+    void restore(const Checkpoint& c){
+        numOfInstructions = c.instructions;
+        PC = c.PC;
+        registers = c.registers;
+        HI = c.HI;
+        LO = c.LO;
+        memory = c.memory;
+        loops = c.loops;
+        halted = false;
+    }
+
+    // Oldest first, -1 where fewer have been retired
+    std::vector<int> recentPCs() const {
+        std::vector<int> pcs;
+        for (int i = 0; i < COSIM_HISTORY; i++) pcs.push_back(history.at((historyTop + i) % COSIM_HISTORY));
+        return pcs;
+    }
+
+    ReferenceEffect step(){
+        if (halted) throw std::invalid_argument("the reference model has already halted");
+        if (PC < 0 || PC >= (int) program.size() || !decoded.at(PC)) throw std::invalid_argument("the reference model cannot run the instruction at " + std::to_string(PC));
+
+        const DecodedInstruction& d = program.at(PC);
+        ReferenceEffect effect;
+        int nextPC = PC + 1;
+
+        history.at(historyTop) = PC;
+        historyTop = (historyTop + 1) % COSIM_HISTORY;
+        numOfInstructions++;
+
+        // A guarded instruction whose guard is false does nothing at all
+        if (d.guard >= 0) {
+            Word guard = reg(d.guard);
+            bool runs = (d.guardCondition == BZ && guard == 0) || (d.guardCondition == BNE && guard < 0) || (d.guardCondition == BPO && guard > 0);
+            if (!runs) {
+                effect.predicatedOff = true;
+                loops.next(PC, nextPC);
+                PC = nextPC;
+                return effect;
+            }
+        }
+
+        switch (d.opCode){
+            case ADD:   write(effect, d.dest, reg(d.src0) + reg(d.src1)); break;
+            case ADDI:  write(effect, d.dest, reg(d.src0) + d.immediate); break;
+            case SUB:   write(effect, d.dest, reg(d.src0) - reg(d.src1)); break;
+            case MUL:   write(effect, d.dest, reg(d.src0) * reg(d.src1)); break;
+            case MULO: {
+                DoubleWord product = (DoubleWord) reg(d.src0) * reg(d.src1);
+                HI = (Word) (product >> WORD_BITS);
+                LO = (Word) product;
+                break;
+            }
+            case MVHI:  write(effect, d.dest, HI); break;
+            case MVLO:  write(effect, d.dest, LO); break;
+            case DIV:
+                if (reg(d.src1) == 0) throw std::invalid_argument("the reference model divided by zero");
+                write(effect, d.dest, reg(d.src0) / reg(d.src1));
+                break;
+            case CMP:   write(effect, d.dest, reg(d.src0) < reg(d.src1) ? -1 : (reg(d.src0) > reg(d.src1) ? 1 : 0)); break;
+
+            case AND:   write(effect, d.dest, reg(d.src0) & reg(d.src1)); break;
+            case OR:    write(effect, d.dest, reg(d.src0) | reg(d.src1)); break;
+            case NOT:   write(effect, d.dest, ~reg(d.src0)); break;
+            case LSHFT: write(effect, d.dest, reg(d.src0) << reg(d.src1)); break;
+            case RSHFT: write(effect, d.dest, reg(d.src0) >> reg(d.src1)); break;
+            case CMOV:  write(effect, d.dest, reg(d.src0)); break;
+
+            case LD:    write(effect, d.dest, load(effect, reg(d.src0))); break;
+            case LDD:   write(effect, d.dest, load(effect, d.immediate)); break;
+            case LDI:   write(effect, d.dest, d.immediate); break;
+            case LDA:   write(effect, d.dest, load(effect, reg(d.src0) + reg(d.src1))); break;
+
+            case STO:   store(effect, reg(d.dest), reg(d.src0)); break;
+            case STOI:  store(effect, d.immediate, reg(d.src0)); break;
+            case OUT:
+                effect.output = true;
+                effect.outValue = reg(d.dest);
+                break;
+
+            case JMP:   nextPC = (int) reg(d.dest); break;
+            case JMPI:  nextPC = (int) (PC + reg(d.dest)); break;
+            case BNE:   if (reg(d.src0) <  0) nextPC = (int) reg(d.dest); break;
+            case BPO:   if (reg(d.src0) >  0) nextPC = (int) reg(d.dest); break;
+            case BZ:    if (reg(d.src0) == 0) nextPC = (int) reg(d.dest); break;
+            case CALL:
+                write(effect, LINK_REGISTER, PC + 1);
+                nextPC = d.immediate;
+                break;
+            case RET:   nextPC = (int) reg(LINK_REGISTER); break;
+
+            case LOOP:
+                effect.loopCount = reg(d.dest);
+                if (!loops.start(PC + 1, (int) d.immediate - 1, reg(d.dest))) nextPC = (int) d.immediate;
+                break;
+
+            case HALT:
+                halted = true;
+                nextPC = PC;
+                break;
+
+            // NOP and the instructions the pipeline doesn't implement either
+            default:
+                break;
+        }
+
+        // Nothing at the end of a loop's body branches, so going back round doesn't fight with nextPC
+        loops.next(PC, nextPC);
+
+        PC = nextPC;
+        return effect;
+    }
+
+    private:
+
+    Word reg(int r) const {
+        return registers.at(r);
+    }
+
+    void write(ReferenceEffect& effect, int r, Word value){
+        registers.at(r) = value;
+        effect.reg = r;
+        effect.regValue = value;
+    }
+
+    Word load(ReferenceEffect& effect, Word address){
+        effect.loaded = address;
+        return memory.at(address);
+    }
+
+    void store(ReferenceEffect& effect, Word address, Word value){
+        memory.at(address) = value;
+        effect.address = address;
+        effect.memValue = value;
+    }
+};
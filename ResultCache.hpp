@@ -0,0 +1,206 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <streambuf>
+#include <cstdio>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "EnumsAndConstants.hpp"
+
+// Results of finished runs kept on disk for -cache, one file per run named by a hash of everything the run depends on.
+// The file keeps everything that went into the hash as well and a result is only used if that is the same too, so two
+// runs with the same hash just take turns at the file. The least recently used files are deleted once the cache is bigger
+// than its limit. Files are written under a temporary name and renamed, so runs sharing a cache never see half a result.
+
+
+// Everything a run depends on, and a name for its file made from it with two 64 bit FNV-1a hashes. FNV-1a isn't made to
+// keep different inputs apart, so the name only says where to look - what was added is compared as well.
+class ResultKey{
+    private:
+        unsigned long long a = 14695981039346656037ull;
+        unsigned long long b = 7809847782465536322ull;
+        std::string material;       // Every byte added
+
+    public:
+
+    void add(const void* data, size_t size){
+        const unsigned char* bytes = (const unsigned char*) data;
+        for (size_t i = 0; i < size; i++){
+            a = (a ^ bytes[i]) * 1099511628211ull;
+            b = (b ^ bytes[i]) * 1099511628211ull;
+        }
+        material.append((const char*) data, size);
+    }
+
+    // Strings end with a 0 so "ab" + "c" and "a" + "bc" don't hash the same
+    void add(const std::string& text){
+        add(text.c_str(), text.size() + 1);
+    }
+
+    void add(long long value){
+        add(&value, sizeof(value));
+    }
+
+    std::string hex() const {
+        std::ostringstream out;
+        out << std::hex << std::setfill('0') << std::setw(16) << a << std::setw(16) << b;
+        return out.str();
+    }
+
+    const std::string& contents() const {
+        return material;
+    }
+};
+
+
+// Everything a run leaves behind that gets printed or looked at afterwards
+struct CachedResult {
+    int status = 0;                 // What main() returns
+    std::string output;             // What OUT wrote
+    std::string report;             // -cosim divergence report, if there was one
+    std::string statistics;         // What -s prints
+    int PC = 0;
+    std::array<Word, 16> registers;
+    DataMemory memory;
+};
+
+
+// Sends everything written to it on to two other buffers - OUT still streams while the run is saving it for the cache
+class TeeBuffer : public std::streambuf{
+    private:
+        std::streambuf* first;
+        std::streambuf* second;
+
+    protected:
+        int overflow(int c){
+            if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+            if (first->sputc(c) == EOF || second->sputc(c) == EOF) return traits_type::eof();
+            return c;
+        }
+
+        std::streamsize xsputn(const char* s, std::streamsize n){
+            first->sputn(s, n);
+            return second->sputn(s, n);
+        }
+
+        int sync(){
+            return first->pubsync() == 0 && second->pubsync() == 0 ? 0 : -1;
+        }
+
+    public:
+
+    TeeBuffer(std::streambuf* a, std::streambuf* b) : first(a), second(b) {}
+};
+
+
+class ResultCache{
+    private:
+        std::string directory;
+        long long limit;            // Bytes
+
+        std::string pathOf(const std::string& key) const {
+            return directory + "/" + key + ".result";
+        }
+
+        static void putText(std::ostream& out, const std::string& text){
+            out << text.size() << "\n" << text << "\n";
+        }
+
+        static bool getText(std::istream& in, std::string& text){
+            size_t size;
+            if (!(in >> size) || in.get() != '\n') return false;
+            text.assign(size, ' ');
+            if (size > 0 && !in.read(&text[0], size)) return false;
+            return in.get() == '\n';
+        }
+
+    public:
+
+    ResultCache(const std::string& dir, long long limitBytes) : directory(dir), limit(limitBytes) {
+        mkdir(directory.c_str(), 0755);
+        struct stat info;
+        if (stat(directory.c_str(), &info) != 0 || !S_ISDIR(info.st_mode)) throw std::invalid_argument("Cannot use cache directory: " + directory);
+    }
+
+    // false if there is no result for key (or it can't be read, or it is another run's with the same hash)
+    bool load(const ResultKey& key, CachedResult& result) const {
+        std::ifstream in(pathOf(key.hex()), std::ios::binary);
+        std::string magic, material;
+        if (!in || !(in >> magic) || magic != "ISARESULT2") return false;
+        if (!getText(in, material) || material != key.contents()) return false;
+
+        size_t words;
+        if (!(in >> result.status >> result.PC)) return false;
+        for (Word& r : result.registers) if (!(in >> r)) return false;
+        if (!(in >> words) || in.get() != '\n') return false;
+        result.memory.assign(words, 0);
+        for (Word& w : result.memory) if (!(in >> w)) return false;
+        if (!getText(in, result.output) || !getText(in, result.report) || !getText(in, result.statistics)) return false;
+
+        // Used again, so it is the last to go
+        utime(pathOf(key.hex()).c_str(), nullptr);
+        return true;
+    }
+
+    void store(const ResultKey& key, const CachedResult& result) const {
+        std::string path = pathOf(key.hex());
+        std::string temporary = path + ".tmp" + std::to_string(getpid());
+        {
+            std::ofstream out(temporary, std::ios::binary);
+            if (!out) throw std::invalid_argument("Cannot write to cache directory: " + directory);
+
+            out << "ISARESULT2\n";
+            putText(out, key.contents());
+            out << result.status << " " << result.PC << "\n";
+            for (Word r : result.registers) out << r << " ";
+            out << "\n" << result.memory.size() << "\n";
+            for (Word w : result.memory) out << w << " ";
+            out << "\n";
+            putText(out, result.output);
+            putText(out, result.report);
+            putText(out, result.statistics);
+        }
+        std::rename(temporary.c_str(), path.c_str());
+        evict();
+    }
+
+    // Deletes the least recently used results until the cache fits in its limit
+    void evict() const {
+        struct Entry {
+            std::string path;
+            long long size;
+            time_t used;
+        };
+        std::vector<Entry> entries;
+        long long total = 0;
+
+        DIR* dir = opendir(directory.c_str());
+        if (dir == nullptr) return;
+        while (dirent* e = readdir(dir)){
+            std::string name = e->d_name;
+            if (name.size() < 7 || name.compare(name.size() - 7, 7, ".result") != 0) continue;
+
+            struct stat info;
+            std::string path = directory + "/" + name;
+            if (stat(path.c_str(), &info) != 0) continue;
+            entries.push_back({path, (long long) info.st_size, info.st_mtime});
+            total += info.st_size;
+        }
+        closedir(dir);
+
+        std::sort(entries.begin(), entries.end(), [](const Entry& x, const Entry& y){ return x.used < y.used; });
+        for (const Entry& e : entries){
+            if (total <= limit) break;
+            if (std::remove(e.path.c_str()) == 0) total -= e.size;
+        }
+    }
+};
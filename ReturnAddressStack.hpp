@@ -0,0 +1,67 @@
+#pragma once
+
+#include <array>
+
+#include "EnumsAndConstants.hpp"
+
+// Return address stack (RAS) - fetch pushes the return address of every CALL and pops one for every RET
+// so that returns can be followed before the BU has read the link register.
+// When full the oldest return address is thrown away, when empty a RET just isn't predicted.
+class ReturnAddressStack{
+    private:
+        std::array<int, RETURN_ADDRESS_STACK_SIZE> stack = {};
+        int top = 0;        // Where the next return address goes
+        int size = 0;
+
+    public:
+        // The return addresses as they are now, for putting back when fetch has pushed and popped down a path that gets flushed
+        struct Checkpoint {
+            std::array<int, RETURN_ADDRESS_STACK_SIZE> stack = {};
+            int top = 0;
+            int size = 0;
+        };
+
+        /* Stats */
+        int numOfPushes = 0;
+        int numOfPops = 0;
+        int numOfOverflows = 0;     // Pushes that threw away the oldest return address
+        int numOfUnderflows = 0;    // Pops with nothing to predict
+
+    void push(int returnAddress){
+        if (size == RETURN_ADDRESS_STACK_SIZE) numOfOverflows++;
+        else                                   size++;
+
+        stack[top] = returnAddress;
+        top = (top + 1) % RETURN_ADDRESS_STACK_SIZE;
+        numOfPushes++;
+    }
+
+    // Returns false if there is no return address to predict with
+    bool pop(int& returnAddress){
+        numOfPops++;
+        if (size == 0) {
+            numOfUnderflows++;
+            return false;
+        }
+
+        top = (top + RETURN_ADDRESS_STACK_SIZE - 1) % RETURN_ADDRESS_STACK_SIZE;
+        size--;
+        returnAddress = stack[top];
+        return true;
+    }
+
+    Checkpoint checkpoint() const {
+        Checkpoint c;
+        c.stack = stack;
+        c.top = top;
+        c.size = size;
+        return c;
+    }
+
+    // Only the return addresses go back, the stats still count what the wrong path did
+    void restore(const Checkpoint& c){
+        stack = c.stack;
+        top = c.top;
+        size = c.size;
+    }
+};
@@ -0,0 +1,306 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstring>
+#include <stdexcept>
+
+#include "EnumsAndConstants.hpp"
+
+// Binary trace of the instructions a program committed, for -record and -replay. The file starts with the program itself
+// (every line of instruction memory and what its records carry), after that come the records in blocks of up to
+// TRACE_BLOCK_SIZE bytes, each compressed on its own so that neither side ever holds more than one block.
+// A record is the PC relative to the one after the last PC (0 when running straight on) as a varint, then depending on
+// the instruction: the address it read or wrote relative to the last one it used, the count a LOOP found in its register,
+// or whether a guarded instruction ran. Loops come out as the same few bytes over and over, which the compression eats.
+
+
+// What the records of a line carry on top of the PC
+enum TraceKind : unsigned char { TRACE_PLAIN, TRACE_ACCESS, TRACE_LOOP, TRACE_GUARDED };
+
+struct TraceRecord {
+    int PC = 0;
+    Word value = 0;             // Address for TRACE_ACCESS, count for TRACE_LOOP
+    bool predicatedOff = false; // TRACE_GUARDED and the guard was false
+};
+
+
+#pragma region encoding
+
+inline void putVarint(std::vector<unsigned char>& out, unsigned long long value){
+    while (value >= 0x80) {
+        out.push_back((unsigned char) (value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((unsigned char) value);
+}
+
+inline unsigned long long getVarint(const unsigned char*& in, const unsigned char* end){
+    unsigned long long value = 0;
+    for (int shift = 0; shift < 64; shift += 7){
+        if (in == end) throw std::invalid_argument("Trace is cut short");
+        unsigned char byte = *in++;
+        value |= (unsigned long long) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+    throw std::invalid_argument("Trace has a broken number in it");
+}
+
+// Small signed numbers to small unsigned ones (0, -1, 1, -2 ...)
+inline unsigned long long zigzag(long long value){
+    return ((unsigned long long) value << 1) ^ (unsigned long long) (value >> 63);
+}
+
+inline long long unzigzag(unsigned long long value){
+    return (long long) (value >> 1) ^ -(long long) (value & 1);
+}
+
+// LZ77 - runs of literal bytes, each followed by a copy of something already in the block. Every token is
+// varint literals, the literals, varint (match length - 3) and varint offset back, a match length of 0 ends the block.
+inline void compressBlock(const std::vector<unsigned char>& in, std::vector<unsigned char>& out){
+    const int HASH_BITS = 14;
+    std::vector<int> table(1 << HASH_BITS, -1);
+    size_t literals = 0;
+    size_t i = 0;
+
+    auto hashAt = [&in](size_t at){
+        unsigned int word;
+        std::memcpy(&word, &in[at], 4);
+        return (word * 2654435761u) >> (32 - HASH_BITS);
+    };
+    auto token = [&](size_t from, size_t count, size_t length, size_t offset){
+        putVarint(out, count);
+        out.insert(out.end(), in.begin() + from, in.begin() + from + count);
+        putVarint(out, length ? length - 3 : 0);
+        if (length) putVarint(out, offset);
+    };
+
+    while (i + 4 <= in.size()){
+        unsigned int h = hashAt(i);
+        int candidate = table[h];
+        table[h] = (int) i;
+
+        if (candidate < 0 || std::memcmp(&in[candidate], &in[i], 4) != 0) {
+            i++;
+            continue;
+        }
+
+        size_t length = 4;
+        while (i + length < in.size() && in[candidate + length] == in[i + length]) length++;
+        token(literals, i - literals, length, i - candidate);
+        i += length;
+        literals = i;
+    }
+    token(literals, in.size() - literals, 0, 0);
+}
+
+inline void decompressBlock(const unsigned char* in, const unsigned char* end, std::vector<unsigned char>& out){
+    out.clear();
+    while (true){
+        size_t count = getVarint(in, end);
+        if ((size_t) (end - in) < count) throw std::invalid_argument("Trace is cut short");
+        out.insert(out.end(), in, in + count);
+        in += count;
+
+        size_t length = getVarint(in, end);
+        if (length == 0) return;
+        length += 3;
+        size_t offset = getVarint(in, end);
+        if (offset == 0 || offset > out.size()) throw std::invalid_argument("Trace has a broken block in it");
+
+        // Byte by byte, a match can run into what it is copying
+        size_t from = out.size() - offset;
+        for (size_t k = 0; k < length; k++) out.push_back(out[from + k]);
+    }
+}
+
+#pragma endregion encoding
+
+
+const char TRACE_MAGIC[8] = {'I', 'S', 'A', 'T', 'R', 'A', 'C', 'E'};
+
+// Writes records as they come, a block at a time
+class TraceWriter{
+    private:
+        std::ofstream file;
+        std::vector<TraceKind> kinds;
+        std::vector<Word> lastAddress;      // Per line, what its last access was relative to
+        std::vector<unsigned char> block;
+        std::vector<unsigned char> compressed;
+        int lastPC = -1;
+
+        void writeBytes(const std::vector<unsigned char>& bytes){
+            file.write((const char*) bytes.data(), bytes.size());
+            numOfBytes += bytes.size();
+        }
+
+        void flushBlock(){
+            if (block.empty()) return;
+            compressed.clear();
+            compressBlock(block, compressed);
+
+            std::vector<unsigned char> sizes;
+            putVarint(sizes, block.size());
+            putVarint(sizes, compressed.size());
+            writeBytes(sizes);
+            writeBytes(compressed);
+            block.clear();
+        }
+
+    public:
+        long long numOfRecords = 0;
+        long long numOfBytes = 0;           // Written to the file so far
+
+    TraceWriter(const std::string& path, const std::vector<std::string>& program, const std::vector<TraceKind>& lineKinds)
+        : file(path, std::ios::binary), kinds(lineKinds), lastAddress(lineKinds.size(), 0) {
+        if (!file) throw std::invalid_argument("Cannot open trace file: " + path);
+
+        std::vector<unsigned char> header(TRACE_MAGIC, TRACE_MAGIC + sizeof(TRACE_MAGIC));
+        putVarint(header, program.size());
+        for (size_t i = 0; i < program.size(); i++){
+            putVarint(header, program.at(i).size());
+            header.insert(header.end(), program.at(i).begin(), program.at(i).end());
+            header.push_back(kinds.at(i));
+        }
+        writeBytes(header);
+    }
+
+    ~TraceWriter(){
+        close();
+    }
+
+    void write(const TraceRecord& r){
+        putVarint(block, zigzag((long long) r.PC - (lastPC + 1)));
+        lastPC = r.PC;
+
+        switch (kinds.at(r.PC)){
+            case TRACE_ACCESS:
+                putVarint(block, zigzag((long long) r.value - lastAddress.at(r.PC)));
+                lastAddress.at(r.PC) = r.value;
+                break;
+            case TRACE_LOOP:    putVarint(block, zigzag(r.value)); break;
+            case TRACE_GUARDED: block.push_back(r.predicatedOff); break;
+            default: break;
+        }
+
+        numOfRecords++;
+        if (block.size() >= (size_t) TRACE_BLOCK_SIZE) flushBlock();
+    }
+
+    void close(){
+        if (!file.is_open()) return;
+        flushBlock();
+        file.close();
+    }
+};
+
+
+// Reads records back a block at a time - peek() is the one next() will give
+class TraceReader{
+    private:
+        std::ifstream file;
+        std::vector<Word> lastAddress;
+        std::vector<unsigned char> compressed;
+        std::vector<unsigned char> block;
+        size_t position = 0;                // In block
+        int lastPC = -1;
+
+        TraceRecord upcoming;
+        bool hasUpcoming = false;
+
+        unsigned long long readVarint(){
+            unsigned long long value = 0;
+            for (int shift = 0; shift < 64; shift += 7){
+                int byte = file.get();
+                if (byte == EOF) throw std::invalid_argument("Trace is cut short");
+                value |= (unsigned long long) (byte & 0x7f) << shift;
+                if (!(byte & 0x80)) return value;
+            }
+            throw std::invalid_argument("Trace has a broken number in it");
+        }
+
+        bool readBlock(){
+            if (file.peek() == EOF) return false;
+            size_t rawSize = readVarint();
+            size_t size = readVarint();
+            compressed.resize(size);
+            if (!file.read((char*) compressed.data(), size)) throw std::invalid_argument("Trace is cut short");
+
+            decompressBlock(compressed.data(), compressed.data() + size, block);
+            if (block.size() != rawSize) throw std::invalid_argument("Trace has a broken block in it");
+            position = 0;
+            return true;
+        }
+
+        bool decodeNext(){
+            if (position == block.size() && !readBlock()) return false;
+
+            const unsigned char* in = block.data() + position;
+            const unsigned char* end = block.data() + block.size();
+            TraceRecord r;
+            r.PC = (int) (lastPC + 1 + unzigzag(getVarint(in, end)));
+            if (r.PC < 0 || r.PC >= (int) kinds.size()) throw std::invalid_argument("Trace goes outside of its program");
+            lastPC = r.PC;
+
+            switch (kinds.at(r.PC)){
+                case TRACE_ACCESS:
+                    r.value = (Word) (lastAddress.at(r.PC) + unzigzag(getVarint(in, end)));
+                    lastAddress.at(r.PC) = r.value;
+                    break;
+                case TRACE_LOOP: r.value = (Word) unzigzag(getVarint(in, end)); break;
+                case TRACE_GUARDED:
+                    if (in == end) throw std::invalid_argument("Trace is cut short");
+                    r.predicatedOff = *in++;
+                    break;
+                default: break;
+            }
+
+            position = in - block.data();
+            upcoming = r;
+            return true;
+        }
+
+    public:
+        std::vector<std::string> program;
+        std::vector<TraceKind> kinds;
+        long long numOfRecords = 0;         // Given out by next()
+
+    TraceReader(const std::string& path) : file(path, std::ios::binary) {
+        if (!file) throw std::invalid_argument("Cannot open trace file: " + path);
+
+        char magic[sizeof(TRACE_MAGIC)];
+        if (!file.read(magic, sizeof(magic)) || std::memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0)
+            throw std::invalid_argument("Not a trace file: " + path);
+
+        size_t lines = readVarint();
+        if (lines > (size_t) SIZE_OF_INSTRUCTION_MEMORY) throw std::invalid_argument("Trace has a program too big for instruction memory");
+        for (size_t i = 0; i < lines; i++){
+            std::string line(readVarint(), ' ');
+            file.read(&line[0], line.size());
+            int kind = file.get();
+            if (!file || kind > TRACE_GUARDED) throw std::invalid_argument("Trace has a broken program in it");
+            program.push_back(line);
+            kinds.push_back((TraceKind) kind);
+        }
+        lastAddress.assign(lines, 0);
+
+        hasUpcoming = decodeNext();
+    }
+
+    bool more() const {
+        return hasUpcoming;
+    }
+
+    const TraceRecord& peek() const {
+        if (!hasUpcoming) throw std::invalid_argument("Trace has ended");
+        return upcoming;
+    }
+
+    TraceRecord next(){
+        TraceRecord r = peek();
+        numOfRecords++;
+        hasUpcoming = decodeNext();
+        return r;
+    }
+};
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <stdexcept>
+
+#include "EnumsAndConstants.hpp"
+
+// Load value prediction (-vpred) - guesses what a load that has to wait on memory will read, so the instructions after it
+// can run on the guess instead of the pipeline freezing until the data arrives. A table indexed by PC remembers the last
+// value each load read and the stride between its last two, with a saturating counter of how many times in a row the
+// guess would have been right. Only loads whose counter is full are predicted. A wrong guess resets the counter.
+
+
+class ValuePredictor{
+    protected:
+        struct Entry {
+            int pc = -1;
+            Word lastValue = 0;
+            Word stride = 0;
+            int confidence = 0;
+        };
+
+        std::vector<Entry> table;
+
+        // What the load in e will read next
+        virtual Word guess(const Entry& e) const = 0;
+
+    public:
+        std::string name;
+
+        /* Stats */
+        long long numOfLoads = 0;           // Loads that would have kept the pipeline waiting on memory
+        long long numOfPredictions = 0;     // ... that ran on a predicted value instead
+        long long numOfMispredictions = 0;  // ... that turned out wrong
+        long long numOfHiddenCycles = 0;    // Cycles of waiting on memory the right ones took off
+
+    ValuePredictor() : table(VALUE_PREDICTOR_SIZE) {}
+
+    virtual ~ValuePredictor(){}
+
+    // false if the load at pc isn't predicted
+    bool predict(int pc, Word& value) const {
+        const Entry& e = table.at(pc % VALUE_PREDICTOR_SIZE);
+        if (e.pc != pc || e.confidence < VALUE_PREDICTOR_CONFIDENCE) return false;
+
+        value = guess(e);
+        return true;
+    }
+
+    // The load at pc was predicted wrong - stop predicting it now rather than once it has been run again and retired
+    void mispredicted(int pc){
+        Entry& e = table.at(pc % VALUE_PREDICTOR_SIZE);
+        if (e.pc == pc) e.confidence = 0;
+    }
+
+    // The load at pc read value, called as loads retire in program order
+    void train(int pc, Word value){
+        Entry& e = table.at(pc % VALUE_PREDICTOR_SIZE);
+
+        // New load in this slot, start again
+        if (e.pc != pc) {
+            e = Entry();
+            e.pc = pc;
+            e.lastValue = value;
+            return;
+        }
+
+        if (guess(e) == value) { if (e.confidence < VALUE_PREDICTOR_CONFIDENCE) e.confidence++; }
+        else                   e.confidence = 0;
+        e.stride = value - e.lastValue;
+        e.lastValue = value;
+    }
+};
+
+
+// The load reads the same as last time
+class LastValuePredictor : public ValuePredictor{
+    protected:
+        Word guess(const Entry& e) const {
+            return e.lastValue;
+        }
+
+    public:
+
+    LastValuePredictor(){
+        name = "last";
+    }
+};
+
+
+// The load reads the last value plus the last stride - walking an array of a sequence or of constants (stride 0)
+class StrideValuePredictor : public ValuePredictor{
+    protected:
+        Word guess(const Entry& e) const {
+            return e.lastValue + e.stride;
+        }
+
+    public:
+
+    StrideValuePredictor(){
+        name = "stride";
+    }
+};
+
+
+// Builds the value predictor asked for on the command line
+inline ValuePredictor* makeValuePredictor(std::string name){
+    if (name == "last")   return new LastValuePredictor();
+    if (name == "stride") return new StrideValuePredictor();
+    if (name == "none")   return nullptr;
+    throw std::invalid_argument("Unknown value predictor: " + name);
+}
@@ -4,44 +4,496 @@
 #include <string>
 #include <stdexcept>
 #include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+
+#include "EnumsAndConstants.hpp"
 
 using  namespace std;
 
+// Assembles a .j program into the format isa loads.
+// The source is the same as the machine format except that:
+//   - NOPs don't have to be written, the assembler puts them in where they are needed
+//   - `name:` on its own line defines a label and `@name` can be used anywhere a number can (e.g. LDI r4 @loop, CALL @function)
+//   - LOOP rs @name runs everything up to the label name rs times
+// Instructions are reordered within basic blocks (list scheduling) so that independent instructions fill the slots
+// an instruction would otherwise have to wait for a register, NOPs only go where nothing else fits.
+
+
+/* Assembler flags */
+bool FUSION_FLAG = true;        // Keep CMP + branch pairs together so that decode fuses them (-nofuse for isa -nofuse)
+bool SCHEDULE_FLAG = true;      // -noschedule keeps the order of the source and only puts NOPs in
+int LSUS = 1;                   // Memory ops in a row decode puts into one slot (-lsus, the same as isa is run with)
+int READ_DISTANCE = 4;          // Registers are read in ID and written in WB, so a register can be read by the 4th instruction after the one that writes it (more with -pipeline)
+
+
+/* Pipeline model */
+const int NUM_OF_REGISTERS = 17;        // r0-r15 and HI/LO
+const int HI_LO = 16;
+
+
+/* Structures */
+struct AsmInstruction {
+    string text;
+    vector<string> tokens;
+    set<int> reads;
+    set<int> writes;
+    bool memory = false;        // Goes to the LSU
+    bool store = false;
+    bool guarded = false;       // Ends in ?Z/?NE/?PO rc
+    bool lsu = false;           // Can share a slot with the memory ops next to it (-lsus)
+};
+
+struct Block {
+    string label;                               // Label at the start of the block ("" if none)
+    bool afterCall = false;                     // RETs come back to the start of this block
+    bool loopStart = false;                     // First block of a LOOP's body, the end of the body comes back to it
+    vector<AsmInstruction> body;                // Everything but the last control instruction, NOPs dropped
+    bool hasTerminator = false;
+    AsmInstruction terminator;
+
+    // Filled in by scheduleBlock()
+    vector<string> output;
+    array<int, NUM_OF_REGISTERS> tail;          // Slots into the next block before each register written here can be read
+    int nops = 0;
+    bool fused = false;
+    int grouped = 0;                            // Memory ops that share a slot with the one before them
+};
+
+
 /* Function Headers */
 void assemble(string filePath, string outputPath);
-void parse(string line, string outputPath);
+AsmInstruction parse(string line);
+vector<Block> buildBlocks(string filePath, int& sourceNOPs);
+void scheduleBlock(Block& block, const array<int, NUM_OF_REGISTERS>& incoming, bool reorder);
+int scheduleProgram(vector<Block>& blocks, bool reorder, int& fusedPairs);
+int closeGroups(vector<Block>& blocks);
+vector<string> split(string str, char deliminator);
+
 
+#pragma region parsing
 
-// Parse each line and append to the output file
-string parse(string line){
-    return "ADD r0 r0 r0";
+// Splits a string by a delminiter and returns it as a std::vector<std::string>
+vector<string> split(string str, char deliminator){
+    vector<string> out;
+    string current;
+    for (char ch : str){
+        if (ch == deliminator) {
+            if (!current.empty()) out.push_back(current);
+            current.clear();
+        } else current += ch;
+    }
+    if (!current.empty()) out.push_back(current);
+    return out;
 }
 
-// Main Assembly function
-void assemble(string filePath, string outputPath){
+// Register index of an operand, -1 if it isn't a register
+int registerOf(const string& operand){
+    if (operand.size() < 2 || operand[0] != 'r') return -1;
+    try { return stoi(operand.substr(1)); } catch (const logic_error&) { throw invalid_argument("Not a register: " + operand); }
+}
+
+bool isControl(const string& op){
+    return op == "JMP" || op == "JMPI" || op == "BZ" || op == "BNE" || op == "BPO" || op == "CALL" || op == "RET" || op == "HALT" || op == "LOOP";
+}
+
+bool isConditionalBranch(const string& op){
+    return op == "BZ" || op == "BNE" || op == "BPO";
+}
+
+// Control never carries on to the next instruction
+bool isUnconditional(const string& op){
+    return op == "JMP" || op == "JMPI" || op == "RET" || op == "HALT";
+}
+
+// Works out which registers an instruction reads and writes
+AsmInstruction parse(string line){
+    AsmInstruction instr;
+    instr.text = line;
+    instr.tokens = split(line, ' ');
+    const string& op = instr.tokens.at(0);
+
+    // The first operand is read by stores and branches and written by everything else
+    bool firstIsRead = op == "STO" || op == "OUT" || op == "JMP" || op == "JMPI" || op == "LOOP" || isConditionalBranch(op);
+    for (size_t i = 1; i < instr.tokens.size(); i++){
+        int r = registerOf(instr.tokens.at(i));
+        if (r < 0) continue;
+        if (i == 1 && !firstIsRead) instr.writes.insert(r);
+        else                        instr.reads.insert(r);
+    }
+
+    if (op == "CALL") instr.writes.insert(LINK_REGISTER);
+    if (op == "RET")  instr.reads.insert(LINK_REGISTER);
+    if (op == "MULO") { instr.writes.clear(); instr.writes.insert(HI_LO); }
+    if (op == "MVHI" || op == "MVLO") instr.reads.insert(HI_LO);
+
+    instr.guarded = instr.tokens.size() > 2 && instr.tokens.at(instr.tokens.size() - 2)[0] == '?';
+    instr.memory = op == "LD" || op == "LDD" || op == "LDA" || op == "LID" || op == "STO" || op == "STOI" || op == "OUT";
+    instr.store  = op == "STO" || op == "STOI" || op == "OUT";     // OUTs stay in order with stores
+    instr.lsu = (instr.memory && op != "LID") || op == "LDI";
+    return instr;
+}
+
+// Splits the source into basic blocks - a new one starts at every label and after every control instruction
+vector<Block> buildBlocks(string filePath, int& sourceNOPs){
     ifstream program(filePath);
-    ofstream output(outputPath);
+    if (!program) throw invalid_argument("Cannot open " + filePath);
 
+    vector<Block> blocks(1);
     string line;
-    int counter = 0;
+    sourceNOPs = 0;
+
+    while (getline(program, line)){
+        // Strip comments, line endings and indentation
+        size_t comment = line.find("//");
+        if (comment != string::npos) line = line.substr(0, comment);
+        line.erase(remove(line.begin(), line.end(), '\r'), line.end());
+        size_t first = line.find_first_not_of(" \t");
+        if (first == string::npos) continue;
+        line = line.substr(first, line.find_last_not_of(" \t") - first + 1);
+
+        // Label
+        if (line.back() == ':') {
+            if (!blocks.back().body.empty() || blocks.back().hasTerminator || !blocks.back().label.empty()) blocks.push_back(Block());
+            blocks.back().label = line.substr(0, line.size() - 1);
+            continue;
+        }
+
+        AsmInstruction instr = parse(line);
+        const string& op = instr.tokens.at(0);
+
+        if (op == "NOP") { sourceNOPs++; continue; }
+
+        if (isControl(op)) {
+            blocks.back().terminator = instr;
+            blocks.back().hasTerminator = true;
+            blocks.push_back(Block());
+            blocks.back().afterCall = (op == "CALL");
+            blocks.back().loopStart = (op == "LOOP");
+        } else blocks.back().body.push_back(instr);
+    }
 
-    while (!program.eof()){
-        getline(program, line);
-        output << parse(line) << endl;;
+    // Always finish with a HALT
+    int numOfBlocks = blocks.size();
+    bool endsInHalt = numOfBlocks > 1 && blocks.back().body.empty() && blocks.back().label.empty() &&
+                      blocks.at(numOfBlocks - 2).hasTerminator && blocks.at(numOfBlocks - 2).terminator.tokens.at(0) == "HALT";
+    if (endsInHalt) blocks.pop_back();
+    else {
+        blocks.back().terminator = parse("HALT");
+        blocks.back().hasTerminator = true;
+    }
+    return blocks;
+}
+
+#pragma endregion parsing
+
+
+#pragma region scheduling
+
+// List schedules one block. incoming[r] is the number of slots into the block before register r can be read.
+// With reorder false the source order is kept and NOPs are only added.
+void scheduleBlock(Block& block, const array<int, NUM_OF_REGISTERS>& incoming, bool reorder){
+    vector<AsmInstruction> nodes = block.body;
+    int n = nodes.size();
+
+    block.output.clear();
+    block.nops = 0;
+    block.fused = false;
+    block.grouped = 0;
+
+    // Decode fuses a CMP with the branch after it, the pair then reads its registers and takes a slot as one instruction.
+    // Only done if nothing between the CMP and the branch depends on the CMP.
+    int fusedCMP = -1;
+    int condition = -1;
+    if (FUSION_FLAG && block.hasTerminator && isConditionalBranch(block.terminator.tokens.at(0))){
+        condition = registerOf(block.terminator.tokens.at(2));
+        for (int k = n - 1; k >= 0; k--){
+            if (!nodes.at(k).writes.count(condition)) continue;
+            if (nodes.at(k).tokens.at(0) == "CMP" && !nodes.at(k).guarded) {
+                fusedCMP = k;
+                for (int j = k + 1; j < n; j++){
+                    for (int r : nodes.at(j).reads)  if (nodes.at(k).writes.count(r)) fusedCMP = -1;
+                    for (int r : nodes.at(j).writes) if (nodes.at(k).writes.count(r) || nodes.at(k).reads.count(r)) fusedCMP = -1;
+                }
+            }
+            break;
+        }
+    }
+
+    // The terminator (fused with its CMP) goes last, treat it as one more node
+    AsmInstruction last = block.terminator;
+    if (fusedCMP >= 0) {
+        last.reads.erase(condition);
+        last.reads.insert(nodes.at(fusedCMP).reads.begin(), nodes.at(fusedCMP).reads.end());
+        last.writes = nodes.at(fusedCMP).writes;
+        last.memory = false;
+    }
+    vector<AsmInstruction> all;
+    for (int i = 0; i < n; i++) if (i != fusedCMP) all.push_back(nodes.at(i));
+    int terminatorIndex = -1;
+    if (block.hasTerminator) { terminatorIndex = all.size(); all.push_back(last); }
+    int total = all.size();
+
+    // latency[i][j] = slots j has to be after i (0 = no dependency)
+    vector<vector<int>> latency(total, vector<int>(total, 0));
+    for (int i = 0; i < total; i++){
+        for (int j = i + 1; j < total; j++){
+            int l = 0;
+            for (int r : all.at(j).reads)  if (all.at(i).writes.count(r)) l = READ_DISTANCE;
+            for (int r : all.at(j).writes) if (all.at(i).reads.count(r) || all.at(i).writes.count(r)) l = max(l, 1);
+            if (all.at(i).memory && all.at(j).memory && (all.at(i).store || all.at(j).store)) l = max(l, 1);
+            if (j == terminatorIndex) l = max(l, 1);
+            latency[i][j] = l;
+        }
+    }
+
+    // Priority - longest chain of latencies to the end of the block
+    vector<int> height(total, 0);
+    for (int i = total - 1; i >= 0; i--)
+        for (int j = i + 1; j < total; j++)
+            if (latency[i][j]) height[i] = max(height[i], latency[i][j] + height[j]);
+
+    vector<int> earliest(total, 0);
+    for (int i = 0; i < total; i++) for (int r : all.at(i).reads) earliest[i] = max(earliest[i], incoming[r]);
+
+    // With -lsus decode puts a memory op straight after another into its slot until every LSU has one, so while the
+    // last slot has room any memory op placed next joins it. Within a group everything is read together and written
+    // in order, so only a register read has to wait for an earlier slot.
+    vector<int> slotOf(total, -1);
+    int scheduled = 0;
+    int slot = 0;
+    int groupSize = 0;                      // Memory ops in the last slot
+    while (scheduled < total){
+        int best = -1;
+        bool open = groupSize > 0 && groupSize < LSUS;
+
+        // Joining the group is free so it goes first
+        if (open) for (int j = 0; j < total; j++){
+            if (slotOf[j] >= 0) continue;
+            bool ready = all.at(j).lsu && slot - 1 >= earliest[j];
+            for (int i = 0; i < j && ready; i++)
+                if (latency[i][j] && (slotOf[i] < 0 || (latency[i][j] > 1 && slot - 1 < slotOf[i] + latency[i][j]))) ready = false;
+            if (ready && (best < 0 || height[j] > height[best])) best = j;
+            if (!reorder) break;
+        }
+        if (best >= 0) {
+            block.output.push_back(all.at(best).text);
+            slotOf[best] = slot - 1;
+            scheduled++;
+            groupSize++;
+            block.grouped++;
+            continue;
+        }
+
+        for (int j = 0; j < total; j++){
+            if (slotOf[j] >= 0) continue;
+            bool ready = slot >= earliest[j] && !(open && all.at(j).lsu);      // It would join the group it can't be in
+            for (int i = 0; i < j && ready; i++) if (latency[i][j] && (slotOf[i] < 0 || slot < slotOf[i] + latency[i][j])) ready = false;
+            if (ready && (best < 0 || height[j] > height[best])) best = j;
+            if (!reorder) break;            // Only the next instruction in the source can go
+        }
+
+        groupSize = (best >= 0 && all.at(best).lsu) ? 1 : 0;
+        if (best < 0) {
+            block.output.push_back("NOP");
+            block.nops++;
+        } else {
+            if (best == terminatorIndex && fusedCMP >= 0) {
+                block.output.push_back(nodes.at(fusedCMP).text);
+                block.fused = true;
+            }
+            block.output.push_back(all.at(best).text);
+            slotOf[best] = slot;
+            scheduled++;
+        }
+        slot++;
+    }
+
+    // A fused branch doesn't take a slot of its own so the block is one slot shorter than it looks
+    int length = slot;
+    block.tail.fill(0);
+    for (int r = 0; r < NUM_OF_REGISTERS; r++) block.tail[r] = max(0, incoming[r] - length);
+    for (int i = 0; i < total; i++)
+        for (int r : all.at(i).writes) block.tail[r] = max(block.tail[r], slotOf[i] + READ_DISTANCE - length);
+}
+
+// Schedules every block. Registers written near the end of a block can still be in flight at the start of the next one,
+// so each block starts with what its predecessors leave behind. Blocks that can be branched to (labels/after a CALL) get
+// what every block ending in a branch leaves and the start of a LOOP's body gets what the end of any body leaves,
+// repeated until that stops changing. Returns the number of NOPs.
+int scheduleProgram(vector<Block>& blocks, bool reorder, int& fusedPairs){
+    int numOfBlocks = blocks.size();
+    vector<array<int, NUM_OF_REGISTERS>> incoming(numOfBlocks);
+    for (auto& in : incoming) in.fill(0);
+
+    // Labels that end a LOOP's body
+    set<string> loopEnds;
+    for (const Block& block : blocks)
+        if (block.hasTerminator && block.terminator.tokens.at(0) == "LOOP" && block.terminator.tokens.size() > 2)
+            loopEnds.insert(block.terminator.tokens.at(2).substr(1));
+
+    bool changed = true;
+    while (changed){
+        for (int b = 0; b < numOfBlocks; b++) scheduleBlock(blocks.at(b), incoming.at(b), reorder);
+
+        array<int, NUM_OF_REGISTERS> branched;
+        branched.fill(0);
+        for (const Block& block : blocks)
+            if (block.hasTerminator && block.terminator.tokens.at(0) != "HALT")
+                for (int r = 0; r < NUM_OF_REGISTERS; r++) branched[r] = max(branched[r], block.tail[r]);
+
+        array<int, NUM_OF_REGISTERS> loopedBack;
+        loopedBack.fill(0);
+        for (int b = 0; b + 1 < numOfBlocks; b++)
+            if (loopEnds.count(blocks.at(b + 1).label))
+                for (int r = 0; r < NUM_OF_REGISTERS; r++) loopedBack[r] = max(loopedBack[r], blocks.at(b).tail[r]);
+
+        changed = false;
+        for (int b = 1; b < numOfBlocks; b++){
+            array<int, NUM_OF_REGISTERS> in = incoming.at(b);
+            const Block& previous = blocks.at(b - 1);
+            bool fallsThrough = !previous.hasTerminator || !isUnconditional(previous.terminator.tokens.at(0));
+
+            for (int r = 0; r < NUM_OF_REGISTERS; r++){
+                if (fallsThrough) in[r] = max(in[r], previous.tail[r]);
+                if (!blocks.at(b).label.empty() || blocks.at(b).afterCall) in[r] = max(in[r], branched[r]);
+                if (blocks.at(b).loopStart) in[r] = max(in[r], loopedBack[r]);
+            }
+            if (in != incoming.at(b)) { incoming.at(b) = in; changed = true; }
+        }
+    }
+
+    int nops = 0;
+    fusedPairs = 0;
+    for (const Block& block : blocks) { nops += block.nops; fusedPairs += block.fused; }
+    return nops;
+}
+
+// Decode groups memory ops by address, so a group left open at the end of a block would take in the start of the
+// next one when it falls through but not when it is branched to. A NOP closes it so the block is scheduled the same
+// either way. Returns the NOPs added.
+int closeGroups(vector<Block>& blocks){
+    int nops = 0;
+    int run = 0;                    // Memory ops in a row up to here
+    for (Block& block : blocks){
+        if (run % LSUS != 0 && !block.output.empty() && parse(block.output.front()).lsu) {
+            block.output.insert(block.output.begin(), "NOP");
+            nops++;
+        }
+        for (const string& line : block.output) run = parse(line).lsu ? run + 1 : 0;
+    }
+    return nops;
+}
+
+#pragma endregion scheduling
+
+
+// Main Assembly function
+void assemble(string filePath, string outputPath){
+    int sourceNOPs;
+    vector<Block> blocks = buildBlocks(filePath, sourceNOPs);
+
+    // Scheduled in source order first to see how many slots reordering saves
+    int fusedPairs;
+    int inOrderNOPs = scheduleProgram(blocks, false, fusedPairs);
+    int nops = SCHEDULE_FLAG ? scheduleProgram(blocks, true, fusedPairs) : inOrderNOPs;
+    int groupNOPs = closeGroups(blocks);
+    int grouped = 0;
+    for (const Block& block : blocks) grouped += block.grouped;
+
+    // Labels can only be given addresses once everything has been placed
+    map<string, int> labels;
+    int address = 0;
+    for (const Block& block : blocks){
+        if (!block.label.empty()) {
+            if (labels.count(block.label)) throw invalid_argument("Label defined twice: " + block.label);
+            labels[block.label] = address;
+        }
+        address += block.output.size();
+    }
+    if (address > SIZE_OF_INSTRUCTION_MEMORY) throw invalid_argument("Program is too large for the instruction memory");
+
+    // Fetch goes back round a LOOP after the last instruction of its body, so that can't be a branch
+    vector<string> program;
+    for (const Block& block : blocks){
+        program.insert(program.end(), block.output.begin(), block.output.end());
+        if (!block.hasTerminator || block.terminator.tokens.at(0) != "LOOP") continue;
+
+        const string& end = block.terminator.tokens.at(2);
+        if (end[0] != '@' || !labels.count(end.substr(1))) throw invalid_argument("LOOP needs a label to end at: " + block.terminator.text);
+
+        // The LOOP is the last thing in its block
+        int last = labels[end.substr(1)] - 1;
+        if (last < (int) program.size()) throw invalid_argument("LOOP body is empty: " + block.terminator.text);
+    }
+    for (const Block& block : blocks){
+        if (!block.hasTerminator || block.terminator.tokens.at(0) != "LOOP") continue;
+        string op = split(program.at(labels[block.terminator.tokens.at(2).substr(1)] - 1), ' ').at(0);
+        if (isControl(op) && op != "HALT") throw invalid_argument("LOOP body cannot end with " + op + ": " + block.terminator.text);
+    }
+
+    ofstream output(outputPath, ios::binary);
+    int instructions = 0;
+    for (const Block& block : blocks){
+        for (const string& line : block.output){
+            vector<string> tokens = split(line, ' ');
+            string out;
+            for (string& token : tokens){
+                if (token[0] == '@') {
+                    if (!labels.count(token.substr(1))) throw invalid_argument("Unknown label: " + token.substr(1));
+                    token = to_string(labels[token.substr(1)]);
+                }
+                out += (out.empty() ? "" : " ") + token;
+            }
+            if (out != "NOP") instructions++;
+
+            // CRLF like the programs already in the repo (isa reads LF too)
+            output << out << "\r\n";
+        }
     }
-    output << "HALT" << endl;
-    
-    program.close();
     output.close();
+
+    cout << "Assembled " << instructions << " instructions in " << blocks.size() << " basic blocks into " << address << " words" << endl;
+    cout << "NOPs in the source (dropped):\t\t" << sourceNOPs << endl;
+    cout << "NOPs needed in source order:\t\t" << inOrderNOPs << endl;
+    cout << "NOPs inserted:\t\t" << nops << endl;
+    cout << "Slots filled by reordering:\t\t" << inOrderNOPs - nops << endl;
+    cout << "CMP + branch pairs left for fusion:\t\t" << fusedPairs << endl;
+    if (LSUS > 1) cout << "Memory ops sharing a slot:\t\t" << grouped << " (" << groupNOPs << " NOPs to keep groups in their block)" << endl;
 }
 
 int main(int argc, char** argv){
-    if (argc != 2){
-        std::cout << "Usage: ./assemble fileName.j" << std::endl; 
-    } else {
+    const char* usage = "Usage: ./assemble fileName.j [-nofuse] [-noschedule] [-lsus n] [-pipeline stages]";
+    if (argc < 2){
+        std::cout << usage << std::endl;
+        return 1;
+    }
+
+    try {
+        for (int i = 2; i < argc; i++){
+            if (string(argv[i]) == "-nofuse")     FUSION_FLAG = false;
+            if (string(argv[i]) == "-noschedule") SCHEDULE_FLAG = false;
+            if (string(argv[i]) == "-lsus" && i + 1 < argc) {
+                try { LSUS = stoi(argv[i + 1]); } catch (const logic_error&) { throw invalid_argument("-lsus needs a number, not " + string(argv[i + 1])); }
+            }
+
+            // The same stages as isa -pipeline, what matters here is how many come after the last ID
+            if (string(argv[i]) == "-pipeline" && i + 1 < argc) {
+                vector<string> stages = split(argv[i + 1], ',');
+                auto lastID = find(stages.rbegin(), stages.rend(), "ID");
+                if (lastID == stages.rend() || stages.back() != "WB") throw invalid_argument("-pipeline needs ID and to end with WB: " + string(argv[i + 1]));
+                READ_DISTANCE = lastID - stages.rbegin();
+            }
+        }
+        if (LSUS < 1 || LSUS > MAX_LSUS) throw invalid_argument("-lsus needs between 1 and " + to_string(MAX_LSUS) + " LSUs");
+
         string outputFilePath = string(argv[1]).substr(0, string(argv[1]).size() - 2);
         assemble(argv[1], outputFilePath);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        std::cerr << usage << std::endl;
+        return 2;
     }
-    return 1;
+    return 0;
 }
-
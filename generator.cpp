@@ -0,0 +1,290 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <stdexcept>
+#include <cstdint>
+
+#include "EnumsAndConstants.hpp"
+
+using namespace std;
+
+// Generates synthetic .j programs (run them through the assembler) to stress particular parts of the pipeline.
+// The program is a loop run -iterations times around a body of -size operations. Each operation is an ALU op on one of
+// the dependency chains, a load/store walking through -footprint words of data memory -stride apart or a forward branch
+// over the next few operations. A branch is taken when 4 bits of its source are below a threshold (-taken), the source
+// is either the loop counter (a repeating pattern) or a random number updated every iteration (-entropy of the branches).
+// The loop goes round with CMP + BNE, or with a hardware LOOP (-hwloop 1) to compare the two. With -ifconvert 1 a branch
+// over nothing but ALU ops becomes those ops guarded by the branch's condition instead.
+//
+// Registers:
+//   r0 loop counter, r1 iterations, r2 loop address, r3 random state (16 bit LCG), r4/r5 LCG constants,
+//   r6/r7 branch temporaries, r8 memory pointer, r9 footprint mask, r10-r14 dependency chains
+
+
+/* Generator parameters */
+unsigned SEED = 1;
+int ITERATIONS = 100;
+int BODY_SIZE = 20;             // Operations in the loop body
+int ALU_WEIGHT = 6;             // -mix alu:bu:lsu
+int BU_WEIGHT = 1;
+int LSU_WEIGHT = 3;
+int CHAINS = 2;                 // Independent dependency chains the ALU ops are spread over (1-5)
+int CHAIN_LENGTH = 8;           // ALU ops on a chain before it starts again from a constant
+double TAKEN_RATE = 0.5;        // Chance a branch is taken (in steps of 1/16)
+double ENTROPY = 0.0;           // Fraction of branches that depend on random numbers instead of the loop counter
+int FOOTPRINT = 64;             // Words of data memory touched (rounded up to a power of 2)
+int STRIDE = 1;                 // Words between consecutive loads/stores
+double STORE_RATE = 0.5;        // Fraction of loads/stores that are stores
+bool HARDWARE_LOOP = false;     // LOOP instead of a CMP + BNE back edge
+bool IF_CONVERT = false;        // Predicate the ops a branch would jump over instead of branching
+
+
+const int FIRST_CHAIN_REGISTER = 10;
+const int MAX_CHAINS = 5;
+const int MAX_SKIP = 3;                 // Most operations a branch jumps over
+const int LCG_MULTIPLIER = 25173;       // x = (x * 25173 + 13849) & 0xFFFF, never overflows an int
+const int LCG_INCREMENT = 13849;
+
+
+/* Random numbers - mt19937 is the same everywhere so a seed always gives the same program */
+mt19937 generator;
+
+int randomInt(int low, int high){
+    return low + (int) (generator() % (uint32_t) (high - low + 1));
+}
+
+double randomReal(){
+    return generator() / 4294967296.0;
+}
+
+
+/* Stats - written into the header of the program */
+int numOfALU = 0;
+int numOfBU = 0;
+int numOfLSU = 0;
+int numOfOverhead = 0;          // Instructions that only set up branches/addresses
+int numOfRandomBranches = 0;
+int numOfIfConverted = 0;
+
+vector<string> body;
+vector<int> chainLength(MAX_CHAINS, 0);
+int nextChain = 0;
+int numOfLabels = 0;
+
+
+void emit(string instruction){
+    body.push_back(instruction);
+}
+
+string chainRegister(int chain){
+    return "r" + to_string(FIRST_CHAIN_REGISTER + chain);
+}
+
+// One ALU op on the next chain, chains start again from a constant every CHAIN_LENGTH ops
+void aluOperation(){
+    int chain = nextChain;
+    nextChain = (nextChain + 1) % CHAINS;
+    string r = chainRegister(chain);
+
+    if (chainLength[chain] >= CHAIN_LENGTH) {
+        emit("LDI " + r + " " + to_string(randomInt(1, 100)));
+        chainLength[chain] = 0;
+        numOfOverhead++;
+    }
+
+    switch (randomInt(0, 3)){
+        case 0: emit("ADDI " + r + " " + r + " " + to_string(randomInt(1, 9))); break;
+        case 1: emit("SUB " + r + " " + r + " r1"); break;
+        case 2: emit("AND " + r + " " + r + " r9"); break;
+        case 3: emit("NOT " + r + " " + r); break;
+    }
+    chainLength[chain]++;
+    numOfALU++;
+}
+
+// A load into a chain (which starts it again) or a store of one, then moves the pointer on
+void memoryOperation(){
+    string r = chainRegister(randomInt(0, CHAINS - 1));
+
+    if (randomReal() < STORE_RATE) emit("STO r8 " + r);
+    else                           emit("LD " + r + " r8");
+
+    emit("ADDI r8 r8 " + to_string(STRIDE));
+    emit("AND r8 r8 r9");
+    numOfLSU++;
+    numOfOverhead += 2;
+}
+
+// A forward branch over the next 1-MAX_SKIP operations
+void branchOperation(){
+    string label = "skip" + to_string(numOfLabels++);
+    int threshold = (int) (TAKEN_RATE * 16 + 0.5);
+
+    // Branch is taken when (source & 15) < threshold
+    if (randomReal() < ENTROPY) {
+        emit("LDI r6 8");
+        emit("RSHFT r6 r3 r6");
+        emit("LDI r7 15");
+        emit("AND r6 r6 r7");
+        numOfOverhead += 4;
+        numOfRandomBranches++;
+    } else {
+        emit("LDI r6 15");
+        emit("AND r6 r0 r6");
+        numOfOverhead += 2;
+    }
+    numOfBU++;
+
+    // What is jumped over is never another branch. Made on its own first to see if it can all be predicated instead.
+    vector<string> outer;
+    outer.swap(body);
+    int skip = randomInt(1, MAX_SKIP);
+    for (int i = 0; i < skip; i++){
+        if (randomInt(1, ALU_WEIGHT + LSU_WEIGHT) <= ALU_WEIGHT) aluOperation();
+        else                                                     memoryOperation();
+    }
+    vector<string> skipped;
+    skipped.swap(body);
+    body.swap(outer);
+
+    bool convertible = IF_CONVERT;
+    for (const string& op : skipped) if (op.compare(0, 2, "LD") == 0 || op.compare(0, 3, "STO") == 0) convertible = false;
+
+    if (convertible) {
+        // Skipped when r6 < 0, so the ops run when r6 + 1 > 0
+        emit("ADDI r6 r6 " + to_string(1 - threshold));
+        for (const string& op : skipped) emit(op + " ?PO r6");
+        numOfOverhead += 1;
+        numOfIfConverted++;
+    } else {
+        emit("ADDI r6 r6 " + to_string(-threshold));
+        emit("LDI r7 @" + label);
+        emit("BNE r7 r6");
+        for (const string& op : skipped) emit(op);
+        emit(label + ":");
+        numOfOverhead += 2;
+    }
+}
+
+void generate(ostream& out){
+    generator.seed(SEED);
+
+    // Body first so that the header can say what is in it
+    for (int i = 0; i < BODY_SIZE; i++){
+        int pick = randomInt(1, ALU_WEIGHT + BU_WEIGHT + LSU_WEIGHT);
+        if      (pick <= ALU_WEIGHT)             aluOperation();
+        else if (pick <= ALU_WEIGHT + BU_WEIGHT) branchOperation();
+        else                                     memoryOperation();
+    }
+
+    out << "// Generated by generator -seed " << SEED << " -iterations " << ITERATIONS << " -size " << BODY_SIZE
+        << " -mix " << ALU_WEIGHT << ":" << BU_WEIGHT << ":" << LSU_WEIGHT << " -chains " << CHAINS << " -chainlength " << CHAIN_LENGTH
+        << " -taken " << TAKEN_RATE << " -entropy " << ENTROPY << " -footprint " << FOOTPRINT << " -stride " << STRIDE << " -stores " << STORE_RATE << " -hwloop " << HARDWARE_LOOP << " -ifconvert " << IF_CONVERT << "\r\n";
+    out << "// Loop body: " << numOfALU << " ALU ops, " << numOfBU << " branches (" << numOfRandomBranches << " random, " << numOfIfConverted << " if-converted), "
+        << numOfLSU << " loads/stores, " << numOfOverhead << " set up instructions\r\n\r\n";
+
+    out << "LDI r0 0\r\n";
+    out << "LDI r1 " << ITERATIONS << "\r\n";
+    out << "LDI r3 " << (SEED & 0xFFFF) << "\r\n";
+    out << "LDI r4 " << LCG_MULTIPLIER << "\r\n";
+    out << "LDI r5 " << LCG_INCREMENT << "\r\n";
+    out << "LDI r8 0\r\n";
+    out << "LDI r9 " << FOOTPRINT - 1 << "\r\n";
+    for (int c = 0; c < CHAINS; c++) out << "LDI " << chainRegister(c) << " " << c + 1 << "\r\n";
+    out << "LDI r2 @loop\r\n\r\n";
+
+    // r0 still counts the iterations, the branches in the body use it
+    if (HARDWARE_LOOP) out << "LOOP r1 @done\r\n";
+    out << "loop:\r\n";
+    if (numOfRandomBranches > 0) {
+        out << "MUL r3 r3 r4\r\n";
+        out << "ADD r3 r3 r5\r\n";
+        out << "LDI r6 65535\r\n";
+        out << "AND r3 r3 r6\r\n";
+    }
+    for (const string& line : body) out << line << "\r\n";
+
+    out << "ADDI r0 r0 1\r\n";
+    if (HARDWARE_LOOP) out << "\r\ndone:\r\n";
+    else {
+        out << "CMP r6 r0 r1\r\n";
+        out << "BNE r2 r6\r\n\r\n";
+    }
+
+    // Leave the chains in memory so runs can be checked against each other
+    for (int c = 0; c < CHAINS; c++) out << "STOI " << SIZE_OF_DATA_MEMORY - CHAINS + c << " " << chainRegister(c) << "\r\n";
+    out << "HALT\r\n";
+}
+
+
+bool handleProgramFlags(int c, char** arguments){
+    for (int i = 1; i < c; i++){
+        string flag = arguments[i];
+        if (i + 1 >= c) return false;
+        string value = arguments[++i];
+
+        // stoi and friends only say which function failed, not which flag
+        try {
+            if      (flag == "-seed")        SEED = stoul(value);
+            else if (flag == "-iterations")  ITERATIONS = stoi(value);
+            else if (flag == "-size")        BODY_SIZE = stoi(value);
+            else if (flag == "-chains")      CHAINS = stoi(value);
+            else if (flag == "-chainlength") CHAIN_LENGTH = stoi(value);
+            else if (flag == "-taken")       TAKEN_RATE = stod(value);
+            else if (flag == "-entropy")     ENTROPY = stod(value);
+            else if (flag == "-footprint")   FOOTPRINT = stoi(value);
+            else if (flag == "-stride")      STRIDE = stoi(value);
+            else if (flag == "-stores")      STORE_RATE = stod(value);
+            else if (flag == "-hwloop")      HARDWARE_LOOP = stoi(value) != 0;
+            else if (flag == "-ifconvert")   IF_CONVERT = stoi(value) != 0;
+            else if (flag == "-o")           continue;
+            else if (flag == "-mix") {
+                char colon;
+                stringstream mix(value);
+                if (!(mix >> ALU_WEIGHT >> colon >> BU_WEIGHT >> colon >> LSU_WEIGHT)) return false;
+            }
+            else return false;
+        } catch (const logic_error&) {
+            throw invalid_argument(flag + " needs a number, not " + value);
+        }
+    }
+
+    if (CHAINS < 1 || CHAINS > MAX_CHAINS) throw invalid_argument("-chains has to be between 1 and " + to_string(MAX_CHAINS));
+    if (ALU_WEIGHT + LSU_WEIGHT <= 0 || ALU_WEIGHT < 0 || BU_WEIGHT < 0 || LSU_WEIGHT < 0) throw invalid_argument("-mix needs some ALU or LSU ops");
+    if (FOOTPRINT < 1 || FOOTPRINT > SIZE_OF_DATA_MEMORY - MAX_CHAINS) throw invalid_argument("-footprint has to fit in data memory");
+
+    // The pointer wraps with an AND so the footprint has to be a power of 2
+    int rounded = 1;
+    while (rounded < FOOTPRINT) rounded *= 2;
+    FOOTPRINT = rounded > SIZE_OF_DATA_MEMORY / 2 ? SIZE_OF_DATA_MEMORY / 2 : rounded;
+    return true;
+}
+
+
+int main(int argc, char** argv){
+    const char* usage = "Usage: ./generator [-o file.j] [-seed n] [-iterations n] [-size n] [-mix alu:bu:lsu] [-chains n] [-chainlength n]"
+                        " [-taken p] [-entropy p] [-footprint n] [-stride n] [-stores p] [-hwloop 0|1] [-ifconvert 0|1]";
+    try {
+        if (!handleProgramFlags(argc, argv)) {
+            std::cout << usage << std::endl;
+            return 1;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        std::cerr << usage << std::endl;
+        return 2;
+    }
+
+    string outputPath;
+    for (int i = 1; i + 1 < argc; i++) if (string(argv[i]) == "-o") outputPath = argv[i + 1];
+
+    if (outputPath.empty()) generate(cout);
+    else {
+        ofstream output(outputPath, ios::binary);
+        generate(output);
+    }
+    return 0;
+}
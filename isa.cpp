@@ -7,61 +7,172 @@
 #include <iomanip>
 #include <algorithm>
 #include <thread>
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <map>
+#include <sstream>
+#include <cstring>
+#include <climits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 //#include "EnumsAndConstants.hpp"
 #include "ExecutionUnits.hpp"
+#include "ReturnAddressStack.hpp"
+#include "LoopBuffer.hpp"
+#include "HardwareLoopStack.hpp"
+#include "ReferenceModel.hpp"
+#include "HotspotProfile.hpp"
+#include "Trace.hpp"
+#include "ResultCache.hpp"
+#include "ValuePredictor.hpp"
+#include "FetchTargetQueue.hpp"
+#include "isa.h"
 
 using namespace std;
 
+// Everything the simulated machine is made of is thread_local so the library build (isa.h) can run one machine per thread
+
 
 /* Debugging Flags */
 bool PRINT_REGISTERS_FLAG = false;
 bool PRINT_MEMORY_FLAG = false;
 bool PRINT_STATS_FLAG = false;
-
-
-int amount_of_instruction_memory_to_output = 8;  // default = 8
+bool DEBUG_MODE_FLAG = false;           // Runs the program under the interactive debugger (-d)
+
+/* Memory latency model */
+thread_local int MEMORY_SIZE = SIZE_OF_DATA_MEMORY;   // Words of data memory (-memsize)
+thread_local int MEMORY_LATENCY = 0;                 // Cycles a data memory access takes when the line isn't close to the LSU (-memlat, 0 = no latency model)
+thread_local std::string PREFETCHER_NAME = "none";   // -prefetch none|nextline|stride|stream
+thread_local std::string VALUE_PREDICTOR_NAME = "none";  // -vpred none|last|stride
+thread_local int INSTRUCTION_MEMORY_LATENCY = 0;     // Cycles fetching an instruction takes when its line isn't close to fetch (-imemlat, 0 = no latency model)
+thread_local int FETCH_TARGET_QUEUE_SIZE = 0;        // Blocks the branch prediction stage can queue up ahead of fetch (-ftq, 0 = no decoupled front end)
+
+/* Memory ports */
+thread_local int NUM_OF_LSUS = 1;                    // LSUs - decode puts up to this many memory ops in a row into one slot (-lsus)
+thread_local int NUM_OF_BANKS = 1;                   // Data memory banks, memory ops in the same slot that use the same bank take turns (-banks)
+thread_local int BANK_INTERLEAVE = 1;                // Words in a row that are in the same bank (-interleave)
+
+/* Simultaneous multithreading */
+thread_local int NUM_OF_THREADS = 1;                 // Hardware threads sharing the pipeline, each running its own copy of the program (-threads)
+thread_local std::string FETCH_POLICY = "roundrobin";    // How fetch picks a thread each cycle (-smtfetch roundrobin|icount)
+
+/* Pipeline depth (-pipeline) */
+thread_local int FETCH_STAGES = 1;                   // Stages IF is split into ...
+thread_local int DECODE_STAGES = 1;                  // ... ID ...
+thread_local int EXECUTE_STAGES = 1;                 // ... and EX
+thread_local bool MEMORY_STAGE_FLAG = false;         // An MA stage between EX and C
+
+std::vector<std::string> DATA_FILES;   // -load file@address, binary files of 32 bit words put into data memory before the program starts
+std::string OUTPUT_FILE;                // -out file, where OUT writes to (stdout if not given)
+int NUM_OF_INTERVALS = 0;               // -intervals n, splits the run into n intervals simulated on their own threads (0 = one normal run)
+long long WARMUP_INSTRUCTIONS = INTERVAL_WARMUP;    // -warmup n, instructions each interval simulates before it starts counting
+std::string RECORD_FILE;                // -record file, runs the program functionally and writes the trace of what it did to file
+bool REPLAY_FLAG = false;               // -replay, the program argument is a trace to time instead of a program
+std::string CACHE_DIRECTORY;            // -cache dir, keeps the results of runs there and prints them instead of running again
+bool BYPASS_CACHE_FLAG = false;         // -nocache, runs even if the result is in the cache (and replaces it)
+long long CACHE_LIMIT = RESULT_CACHE_LIMIT;     // -cachelimit n, megabytes the cache can take up
+
+thread_local bool EVENT_DRIVEN_FLAG = false;         // Jumps the clock over cycles where nothing but the cycle count changes (-event)
+
+thread_local bool LOOP_BUFFER_FLAG = false;          // Replays short loops from the loop buffer (-loopbuffer)
+thread_local bool FUSION_FLAG = true;                // Fuses CMP + branch pairs in decode (turned off with -nofuse)
+thread_local bool COSIM_FLAG = false;                // Checks every retired instruction against the reference model (-cosim)
+thread_local bool ANNOTATE_FLAG = false;             // Lists the program with what each instruction cost once it halts (-annotate)
+
+
+thread_local int amount_of_instruction_memory_to_output = 8;  // default = 8
 
 /* States */
-StageState IF_State = Empty;
-StageState ID_State = Empty;
-StageState I_State = Empty;
-StageState EX_State = Empty;
-StageState C_State = Empty;
-StageState MA_State = Empty;
-StageState WB_State = Empty;
+thread_local StageState IF_State = Empty;
+thread_local StageState ID_State = Empty;
+thread_local StageState I_State = Empty;
+thread_local StageState EX_State = Empty;
+thread_local StageState C_State = Empty;
+thread_local StageState WB_State = Empty;
 
 
 /* Registers */
 #pragma region Registers
 
 /* "Register File" - currently just a bunch of variables */
-std::array<int, 16> registerFile;    // All 16 general purpose registers
-std::array<float, 4> floatingPointRegisterFile;
+thread_local std::array<Word, 16> registerFile;   // All 16 general purpose registers
+thread_local std::array<float, 4> floatingPointRegisterFile;
 
-int PC;                     // Program Counter
+thread_local int PC;                     // Program Counter
 
 // IF/ID registers
-std::string CIR;            // Current Instruction Register
-int IMMEDIATE;              // Immediate register used for immediate addressing
+thread_local std::string CIR;            // Current Instruction Register
+thread_local int IF_PC;                  // Address of the instruction that is in the CIR
+thread_local int IF_PredictedPC;         // Where fetch went after the instruction in the CIR
+thread_local bool IF_FromLoopBuffer = false;     // The instruction came out of the loop buffer already decoded
+thread_local DecodedInstruction IF_Decoded;      // ... and this is it
+thread_local HardwareLoopStack IF_Loops;         // Hardware loops as they were before the instruction was fetched (put back by a flush)
+thread_local ReturnAddressStack::Checkpoint IF_ReturnAddresses;     // ... and the return address stack
+thread_local int IF_Thread = 0;                  // Hardware thread the instruction belongs to (-threads), every stage has one
+thread_local Word IMMEDIATE;             // Immediate register used for immediate addressing
 
 
 // ID/I registers
-Instruction OpCodeRegister = NOP;       // Stores the decoded OpCode that was in the CIR
-int  ALU0, ALU1, ALU_OUT;               // 2 input regsiters for the ALU
+thread_local Instruction OpCodeRegister = NOP;       // Stores the decoded OpCode that was in the CIR
+thread_local Word ALU0, ALU1, ALU_OUT;               // 2 input regsiters for the ALU
 //float ALU_FP0, ALU_FP1;                 // 2 input registers for the ALU where FP calculations are occuring
-int HI, LO;                             // High and Low parts of integer multiplication
-int ALUD;                               // Destination register for the output of the ALU
+// HI and LO (the two halves of a MULO) live in the ALU that multiplies
+thread_local Word ALUD;                              // Destination register for the output of the ALU
+thread_local Word ALUG;                              // Value of the register a predicated instruction is guarded by
+thread_local Instruction GuardCondition = NOP;       // BZ/BNE/BPO for a predicated instruction, NOP otherwise
+thread_local int ID_PC;                              // Address of the decoded instruction
+thread_local int ID_PredictedPC;                     // Where fetch went after the decoded instruction
+thread_local HardwareLoopStack ID_Loops;
+thread_local ReturnAddressStack::Checkpoint ID_ReturnAddresses;
+thread_local int ID_Thread = 0;
+
+// A memory op decode put into the same slot as the one in ID, with its operands already read - they go to LSUs 1, 2, ...
+struct GroupedOperation {
+    Instruction opCode;
+    Word dest;
+    Word in0;
+    Word in1;
+    Word immediate;
+    int PC;
+};
+thread_local std::vector<GroupedOperation> ID_Group;
 
 // I/EX registers
-int ID;
+thread_local int ID;
+thread_local int I_PC;                               // Address and op of the instruction in each stage, so writeBack() knows what it retired
+thread_local Instruction I_OpCode = NOP;
+thread_local HardwareLoopStack I_Loops;
+thread_local ReturnAddressStack::Checkpoint I_ReturnAddresses;
+thread_local int I_Thread = 0;
+thread_local int EX_PC;
+thread_local Instruction EX_OpCode = NOP;
+thread_local HardwareLoopStack EX_Loops;
+thread_local ReturnAddressStack::Checkpoint EX_ReturnAddresses;
+thread_local int EX_Thread = 0;
+thread_local int C_PC;
+thread_local Instruction C_OpCode = NOP;
+thread_local int C_Thread = 0;
 //Instruction I_EX__OpCodeRegister = NOP;
 
 // EX/C registers
-int CD;
+thread_local int CD;
 
 // C/WB registers
-int C_OUT;
+thread_local Word C_OUT;
+
+// What the rest of a memory group produced, written back after C_OUT
+struct RetiredOperation {
+    int PC;
+    Instruction opCode;
+    bool writeBack;
+    Word WBD;
+    Word OUT;
+};
+thread_local std::vector<RetiredOperation> C_Group;
 
 // MEMORY ACCESS Registers
 //int MEMD;                          // Destination address for the position in memory (STO operation) or the register in the register file (LD operation)
@@ -69,32 +180,154 @@ int C_OUT;
 
 
 // WRITE BACK registers
-int WBD;                           // Write back destination - stores the destination register for the memory in the memory output to be stored/held
+thread_local Word WBD;                          // Write back destination - stores the destination register for the memory in the memory output to be stored/held
+
+// Sub-stages (-pipeline) - latches like the IF/ID and ID/I registers above, which are the newest of them. What fetch got goes
+// through FETCH_STAGES + DECODE_STAGES - 2 of them before decode takes it, and a decoded slot through EXECUTE_STAGES - 1
+// (one more with MA) before issue takes it. There are none with the default pipeline.
+struct FetchLatch {
+    StageState state = Empty;
+    std::string inst;
+    std::string CIR;
+    int PC = 0;
+    int predictedPC = 0;
+    bool fromLoopBuffer = false;
+    DecodedInstruction decoded;
+    HardwareLoopStack loops;
+    ReturnAddressStack::Checkpoint returnAddresses;
+    int thread = -1;                // -1 = nothing was fetched into it, or what was has been taken out
+};
+
+struct DecodeLatch {
+    StageState state = Empty;
+    std::string inst;
+    int PC = 0;
+    int predictedPC = 0;
+    HardwareLoopStack loops;
+    ReturnAddressStack::Checkpoint returnAddresses;
+    int thread = -1;
+    std::vector<GroupedOperation> group;
+    Instruction opCode = NOP;       // OpCodeRegister, ALUD, ALU0, ALU1, IMMEDIATE, ALUG and GuardCondition
+    Word dest = 0;
+    Word in0 = 0;
+    Word in1 = 0;
+    Word immediate = 0;
+    Word guard = 0;
+    Instruction guardCondition = NOP;
+};
+
+thread_local std::vector<FetchLatch> frontEnd;      // Newest first
+thread_local std::vector<DecodeLatch> backEnd;      // Newest first
 
 #pragma endregion Registers
 
 
 /* System Flags */
-bool systemHaltFlag = false;            // If true, the system halts
+thread_local bool systemHaltFlag = false;            // If true, the system halts
+thread_local bool haltPendingFlag = false;           // A HALT has been decoded - stop fetching and halt once it has been written back
 
-bool memoryReadFlag = false;            // Used pass on instruction information on whether an instruction is needed to READ from memory (used in the MEMORY ACCESS stage)
-bool memoryWriteFlag = false;           // Used pass on instruction information on whether an instruction is needed to WRITE to memory (used in the MEMORY ACCESS stage)
+thread_local bool memoryReadFlag = false;            // Used pass on instruction information on whether an instruction is needed to READ from memory (used in the MEMORY ACCESS stage)
+thread_local bool memoryWriteFlag = false;           // Used pass on instruction information on whether an instruction is needed to WRITE to memory (used in the MEMORY ACCESS stage)
 
 //bool MEM_writeBackFlag = false;
-bool writeBackFlag = false;
-
-bool branchFlag = false;                // Used to tell the fetch stage that we have branched and so we do not need to increment at this point
+thread_local bool writeBackFlag = false;
 
 
 /* Memory */
-std::array<std::string, SIZE_OF_INSTRUCTION_MEMORY> instrMemory;
-std::array<int, SIZE_OF_DATA_MEMORY> dataMemory;
+thread_local std::array<std::string, SIZE_OF_INSTRUCTION_MEMORY> instrMemory;
+thread_local DataMemory dataMemory;                  // MEMORY_SIZE words
+
+/* Timing of data memory, only set with -memlat */
+thread_local MemoryModel* dataMemoryModel = nullptr;
+thread_local int memoryStallCycles = 0;              // Cycles the whole pipeline still has to wait for the LSU
+
+/* Timing of instruction memory, only set with -imemlat */
+thread_local MemoryModel* instructionMemoryModel = nullptr;
+thread_local int fetchWaitPC = -1;                   // The instruction fetch is waiting on instruction memory for ...
+thread_local int fetchArrives = 0;                   // ... and the cycle it arrives in
+
+/* Load value prediction, only with -vpred */
+// A load that would have kept memory waiting runs on a predicted value instead, and until its data arrives everything
+// after it is speculative. What that retires is held back from -cosim and the predictor, OUT writes into a buffer and
+// enough is kept to take it all back - the registers before the load was written back, HI/LO and what stores overwrote.
+struct LoadSpeculation {
+    bool active = false;
+    int PC = 0;                     // The load, fetched again if the value was wrong ...
+    HardwareLoopStack loops;        // ... with the hardware loops as they were when it was fetched
+    ReturnAddressStack::Checkpoint returnAddresses;     // ... and the return address stack
+    Word value = 0;                 // What it really read
+    Word predicted = 0;
+    int dataArrives = 0;            // Cycle the prediction is checked in
+    int hidden = 0;                 // Cycles of waiting on memory it takes off if right
+    int writeBacksToLoad = 0;       // writeBack()s before the load's own, the instruction in C when it was predicted is older
+    std::array<Word, 16> registers;
+    Word HI = 0;
+    Word LO = 0;
+    std::vector<std::pair<Word, Word>> stores;     // Address and what the store overwrote, oldest first
+    std::vector<RetiredOperation> retired;         // Written back from the load on, in order
+    long long numOfRetired = 0;                    // ... as numOfRetired counts them
+    std::ostringstream output;                     // What OUT has written since
+    std::ostream* realOutput = nullptr;
+};
+thread_local ValuePredictor* valuePredictor = nullptr;
+thread_local LoadSpeculation loadSpeculation;
+
+/* Branch prediction */
+thread_local ReturnAddressStack returnAddressStack;
+thread_local LoopBuffer* loopBuffer = nullptr;       // Only used with -loopbuffer
+thread_local FetchTargetQueue* fetchTargets = nullptr;   // Only used with -ftq
+thread_local HardwareLoopStack hardwareLoops;        // LOOPs running, fetch goes round them
+
+/* Journal of every write, only recorded under the debugger (-d) */
+thread_local Journal* journal = nullptr;
+
+/* Co-simulation, only with -cosim */
+thread_local ReferenceModel* referenceModel = nullptr;
+thread_local std::string divergenceReport;           // Set (and the machine halted) at the first instruction that differs from the reference model
+
+/* Per instruction costs, only with -annotate */
+thread_local HotspotProfile* hotspots = nullptr;
+
+/* Hardware threads, there is only more than one with -threads */
+// What each thread has to itself - the latches, EUs and memory model are shared and every stage knows whose instruction
+// it holds. The thread a stage is working on has its state in the globals above (registerFile, PC ...) and switchThread()
+// swaps that with another thread's, so the state kept here is only ever the other threads'.
+struct ThreadContext {
+    std::array<Word, 16> registers;
+    int PC = 0;
+    Word HI = 0;
+    Word LO = 0;
+    DataMemory memory;
+    ReturnAddressStack returnAddressStack;
+    HardwareLoopStack hardwareLoops;
+    LoopBuffer* loopBuffer = nullptr;
+    FetchTargetQueue* fetchTargets = nullptr;
+    ReferenceModel* referenceModel = nullptr;
+    bool haltPending = false;
+
+    // Always kept here, whichever thread is current
+    bool halted = false;
+    int parkedUntil = 0;            // Fetch leaves the thread alone before this cycle, it is waiting on memory
+    int replayPC = -1;              // The memory op it went away for, which doesn't send it away a second time
+    long long numOfRetired = 0;
+    int numOfFetches = 0;
+    int numOfFlushes = 0;
+    int numOfSwitches = 0;          // Times it gave up the pipeline to wait on memory
+    int haltedIn = 0;               // Cycle its HALT was written back in
+};
+thread_local std::vector<ThreadContext> hardwareThreads;   // NUM_OF_THREADS of them, made by createMachine()
+thread_local int currentThread = 0;                        // Whose state is in the globals
+thread_local int lastFetchedThread = 0;
+
+/* Where the stages say what they are doing every cycle, the library points it at silentLog */
+thread_local std::ostream* simulationLog = &std::cout;
+thread_local std::ostream silentLog(nullptr);
 
 /* Execution Units*/
 //std::array<ExecutionUnit, 4> EUs = {ALU(), ALU(), BU(), LSU()};
-std::array<ALU*, 2> ALUs = {new ALU(), new ALU()};
-std::array<BU*, 1> BUs = {new BU()};
-std::array<LSU*, 1> LSUs = {new LSU(&dataMemory)};
+thread_local std::array<ALU*, 2> ALUs = {};     // Made by createMachine()
+thread_local std::array<BU*, 1> BUs = {};
+thread_local std::vector<LSU*> LSUs;            // NUM_OF_LSUS of them
 //std::array<MISC, 1> MISCs = {MISC()};
 
 
@@ -104,37 +337,98 @@ void decode();
 void issue();
 void execute();
 void complete();
-void memoryAccess();
 void writeBack();
 
 /* ISA helpers */
 void flushPipeline();
+void skipIdleCycles();
+DecodedInstruction decodeInstruction(const std::string& instruction);
+void readOperands(const DecodedInstruction& instruction);
+void fuseCompareAndBranch(DecodedInstruction& instruction);
+void advanceFrontEnd();
+void advanceBackEnd();
+bool nextInstructionIs(int pc);
+void takeNextInstruction(int predictedPC);
+void refetchAfterDecode();
+void startHardwareLoop(const DecodedInstruction& instruction);
+void groupMemoryOperations();
+bool runLSUs();
+void switchThread(int thread);
+int fetchThread();
+void haltThread();
+bool switchOut(int longest);
+bool instructionArrived();
+void requestInstruction();
+bool predictLoadValue(int longest);
+void retireOperation(const RetiredOperation& retired);
+bool resolveLoadValue();
+bool waitForLoadValue();
+void checkRetirement(const RetiredOperation& retired);
+void reportDivergence(const std::string& problem, const RetiredOperation& retired, const ReferenceEffect* expected);
 
 /* Non-ISA function headers */
-void loadProgramIntoMemory();
+std::string loadProgramIntoMemory(std::string pathToProgram);
+void loadProgramFromText(const std::string& text);
+void createMachine();
+void destroyMachine();
+void resetMachine();
 std::vector<std::string> split(std::string str, char deliminator);
+bool defaultPipeline();
+void parsePipeline(const std::string& stages);
+std::vector<std::string> pipelineStages();
+std::vector<std::string> pipelineContents();
+int refillCycles();
+int readDistance();
 Register strToRegister(std::string str);
+Word strToWord(std::string str);
 bool handleProgramFlags(int count, char** arguments);
+void loadDataFile(std::string fileAndAddress);
+ReferenceModel* makeReferenceModel();
+long long readCounter(const std::string& name);
+int runIntervals(const std::string& programText, std::ostream& output);
+int recordTrace(const std::string& path, std::ostream& output);
+int replayTrace(const std::string& path);
+ResultKey resultKey();
+int printCachedResult(const std::string& key, const CachedResult& result, std::ostream& output);
+CachedResult finishedResult(const std::string& output);
 
 /* Debugging function headers*/
 void outputAllMemory(int cutOff);
 void printRegisterFile(int maxReg);
-void outputStatistics(int numOfCycles);
+void outputStatistics(int numOfCycles, std::ostream& out = std::cout);
+
+/* Debugger function headers */
+void printPipeline();
+void printMemoryRange(const DataMemory& memory, int from, int to);
+void debuggerPrompt();
+void debuggerCheck();
 
 /* Debugging/GUI for showing whch Instruction is in which stage */
-string IF_inst = "EMPTY";
-string ID_inst = "EMPTY";
-string I_inst = "EMPTY";
-string EX_inst = "EMPTY";
-string C_inst = "EMPTY";
-string MA_inst = "EMPTY";
-string WB_inst = "EMPTY";
+thread_local string IF_inst = "EMPTY";
+thread_local string ID_inst = "EMPTY";
+thread_local string I_inst = "EMPTY";
+thread_local string EX_inst = "EMPTY";
+thread_local string C_inst = "EMPTY";
+thread_local string WB_inst = "EMPTY";
 
 
 /* Stats variables */
-int numOfCycles = 1;        // Counts the number of cycles (stats at cycle 1 not cycle 0)
-int numOfBranches = 0;
-int numOfStalls = 0;        // Counts the number of times the pipeline stalls
+thread_local int numOfCycles = 1;        // Counts the number of cycles (stats at cycle 1 not cycle 0)
+thread_local long long numOfRetired = 0; // Instructions written back, NOPs and both halves of a fused op included
+thread_local int numOfBranches = 0;
+thread_local int numOfStalls = 0;        // Counts the number of times the pipeline stalls
+thread_local int numOfFlushes = 0;       // Counts the number of times instructions behind a branch were thrown away
+thread_local int numOfRASHits = 0;       // RETs that went where the return address stack said
+thread_local int numOfRASMisses = 0;     // RETs that had to be redirected by the BU
+thread_local int numOfCompares = 0;      // CMPs issued
+thread_local int numOfFusions = 0;       // ... of which were fused with the branch after them
+thread_local long long numOfSkippedCycles = 0;   // Cycles -event jumped over instead of simulating
+thread_local int numOfPredicated = 0;    // Predicated instructions (CMOVs and guarded ALU ops) executed
+thread_local int numOfPredicatedOff = 0; // ... of which did nothing because their guard was false
+thread_local int numOfGroupedMemoryOps = 0;      // Memory ops that went into the slot of the one in front of them
+thread_local int numOfGroupedAccesses = 0;       // Data memory accesses made in a cycle with more than one
+thread_local int numOfBankConflicts = 0;         // ... that had to wait for another one to the same bank
+thread_local long long numOfFetchStallCycles = 0; // Cycles fetch got nothing because instruction memory hadn't answered (-imemlat)
 
 #pragma region debugging
 
@@ -143,11 +437,11 @@ void outputAllMemory(int cutOff){
 
     //std::cout << "\tInstruction Memory" << "              \t\t\t" << "Data Memory\n" << std::endl;
     std::cout << "\tInstruction Memory" << "              \t" << "Data Memory\n" << std::endl;
-    for (int i = 0; i < SIZE_OF_INSTRUCTION_MEMORY || i < SIZE_OF_DATA_MEMORY; i++){
+    for (int i = 0; i < SIZE_OF_INSTRUCTION_MEMORY || i < (int) dataMemory.size(); i++){
         if (i > cutOff) break;
         
         std::cout << i << "\t";
-        if (i < instrMemory.size()){
+        if (i < (int) instrMemory.size()){
             if (instrMemory.at(i).empty()){
                 std::cout << emptyLine;
             } else {
@@ -157,7 +451,7 @@ void outputAllMemory(int cutOff){
             }
         }
         std::cout << "\t";
-        if (i < dataMemory.size()){
+        if (i < (int) dataMemory.size()){
             std::cout << dataMemory.at(i);
         }
         std::cout << std::endl;
@@ -187,84 +481,530 @@ void printRegisterFile(int maxReg){
 
 
 // Outputs all stats here
-void outputStatistics(int numOfCycles){
-    if (!PRINT_STATS_FLAG) return;
-
-    cout << "\n\n---------- STATISTICS ----------\n" << endl;
-    cout << "Total number of cycles:\t\t" << numOfCycles << endl;
-    cout << "Total number of branches:\t\t" << numOfBranches << endl;
-    cout << "Total number of stalls:\t\t" << numOfStalls << endl;
-    cout << "Total number of successfully predicted branches:\t\t" << "Not implemented " << endl;
-    cout << "Percent of successfully predicted branches:\t\t" << "Not implemented " << endl;   
+void outputStatistics(int numOfCycles, std::ostream& out){
+    out << "\n\n---------- STATISTICS ----------\n" << endl;
+    out << "Total number of cycles:\t\t" << numOfCycles << endl;
+    out << "Total number of branches:\t\t" << numOfBranches << endl;
+    out << "Total number of stalls:\t\t" << numOfStalls << endl;
+    out << "Total number of pipeline flushes:\t\t" << numOfFlushes << endl;
+    out << "Return address stack hits/misses:\t\t" << numOfRASHits << "/" << numOfRASMisses << endl;
+    out << "Return address stack overflows/underflows:\t\t" << returnAddressStack.numOfOverflows << "/" << returnAddressStack.numOfUnderflows << endl;
+    out << "Fused CMP + branch pairs:\t\t" << numOfFusions << "/" << numOfCompares << " CMPs (" << (numOfCompares ? 100.0 * numOfFusions / numOfCompares : 0) << "%)" << endl;
+    if (loopBuffer) {
+        int fetches = loopBuffer->numOfHits + loopBuffer->numOfMisses;
+        out << "Loop buffer hits/misses:\t\t" << loopBuffer->numOfHits << "/" << loopBuffer->numOfMisses << endl;
+        out << "Loop buffer hit rate:\t\t" << (fetches ? 100.0 * loopBuffer->numOfHits / fetches : 0) << "%" << endl;
+        out << "Loops captured:\t\t" << loopBuffer->numOfLoopsCaptured << endl;
+    }
+    if (dataMemoryModel) {
+        MemoryModel* m = dataMemoryModel;
+        out << "Data memory accesses/hits/misses:\t\t" << m->numOfAccesses << "/" << m->numOfHits << "/" << m->numOfMisses << endl;
+        out << "Cycles waiting on memory:\t\t" << m->numOfStallCycles << endl;
+    }
+    if (dataMemoryModel && dataMemoryModel->prefetcher) {
+        MemoryModel* m = dataMemoryModel;
+        int useful = m->numOfUsefulPrefetches;
+        out << "Prefetcher:\t\t" << m->prefetcher->name << endl;
+        out << "Prefetches issued/dropped:\t\t" << m->numOfPrefetches << "/" << m->numOfDroppedPrefetches << endl;
+        out << "Prefetches useful/late/useless:\t\t" << useful << "/" << m->numOfLatePrefetches << "/" << m->numOfUselessPrefetches << endl;
+        out << "Prefetch accuracy (useful/issued):\t\t" << (m->numOfPrefetches ? 100.0 * useful / m->numOfPrefetches : 0) << "%" << endl;
+        out << "Prefetch coverage (useful/(useful+misses)):\t\t" << ((useful + m->numOfMisses) ? 100.0 * useful / (useful + m->numOfMisses) : 0) << "%" << endl;
+        out << "Prefetch timeliness (on time/useful):\t\t" << (useful ? 100.0 * (useful - m->numOfLatePrefetches) / useful : 0) << "%" << endl;
+    }
+    if (valuePredictor) {
+        ValuePredictor* v = valuePredictor;
+        long long right = v->numOfPredictions - v->numOfMispredictions;
+        out << "Value predictor:\t\t" << v->name << endl;
+        out << "Loads value predicted/kept waiting on memory:\t\t" << v->numOfPredictions << "/" << v->numOfLoads
+             << " (" << (v->numOfLoads ? 100.0 * v->numOfPredictions / v->numOfLoads : 0) << "%)" << endl;
+        out << "Value predictions right/wrong:\t\t" << right << "/" << v->numOfMispredictions
+             << " (" << (v->numOfPredictions ? 100.0 * right / v->numOfPredictions : 0) << "% right)" << endl;
+        out << "Cycles of waiting on memory hidden by value prediction:\t\t" << v->numOfHiddenCycles << endl;
+    }
+    if (instructionMemoryModel) {
+        MemoryModel* m = instructionMemoryModel;
+        out << "Instruction memory accesses/hits/misses:\t\t" << m->numOfAccesses << "/" << m->numOfHits << "/" << m->numOfMisses << endl;
+        out << "Cycles fetch waited on instruction memory:\t\t" << numOfFetchStallCycles << endl;
+    }
+    if (fetchTargets) {
+        MemoryModel* m = instructionMemoryModel;
+        out << "Fetch target queue blocks queued/resteers:\t\t" << fetchTargets->numOfBlocks << "/" << fetchTargets->numOfResteers << endl;
+        out << "Instruction prefetches issued/dropped:\t\t" << m->numOfPrefetches << "/" << m->numOfDroppedPrefetches << endl;
+        out << "Instruction prefetches useful/late/useless:\t\t" << m->numOfUsefulPrefetches << "/" << m->numOfLatePrefetches << "/" << m->numOfUselessPrefetches << endl;
+    }
+    if (LSUs.size() > 1) {
+        out << "Memory ops sharing a slot with the one in front:\t\t" << numOfGroupedMemoryOps << endl;
+        out << "Bank conflicts/accesses in cycles with more than one:\t\t" << numOfBankConflicts << "/" << numOfGroupedAccesses
+             << " (" << (numOfGroupedAccesses ? 100.0 * numOfBankConflicts / numOfGroupedAccesses : 0) << "%)" << endl;
+    }
+    if (numOfPredicated) out << "Predicated instructions ran/predicated off:\t\t" << numOfPredicated << "/" << numOfPredicatedOff << endl;
+    if (hardwareLoops.numOfLoops) out << "Hardware loops ran/times fetch went back round one:\t\t" << hardwareLoops.numOfLoops << "/" << hardwareLoops.numOfBackEdges << endl;
+    if (EVENT_DRIVEN_FLAG) out << "Cycles skipped by -event:\t\t" << numOfSkippedCycles << endl;
+    if (referenceModel) out << "Instructions checked by -cosim:\t\t" << referenceModel->numOfInstructions << endl;
+    if (!defaultPipeline()) {
+        std::vector<std::string> stages = pipelineStages();
+        out << "Pipeline (" << stages.size() << " stages):\t\t";
+        for (const std::string& stage : stages) out << stage << " ";
+        out << endl;
+        out << "Cycles a mispredict costs/instructions from a register write to a read:\t\t" << refillCycles() << "/" << readDistance() << endl;
+    }
+    if (hardwareThreads.size() > 1) {
+        out << "Hardware threads (" << FETCH_POLICY << " fetch):\t\t" << hardwareThreads.size() << endl;
+        out << "Instructions per cycle, all threads:\t\t" << (double) numOfRetired / numOfCycles << endl;
+        for (size_t t = 0; t < hardwareThreads.size(); t++){
+            const ThreadContext& thread = hardwareThreads.at(t);
+            out << "Thread " << t << " instructions/halted in cycle/IPC:\t\t" << thread.numOfRetired << "/" << thread.haltedIn << "/"
+                << (thread.haltedIn ? (double) thread.numOfRetired / thread.haltedIn : 0) << endl;
+            out << "Thread " << t << " fetches/flushes/switches out on memory:\t\t" << thread.numOfFetches << "/" << thread.numOfFlushes << "/" << thread.numOfSwitches << endl;
+        }
+    }
+    out << "Total number of successfully predicted branches:\t\t" << "Not implemented " << endl;
+    out << "Percent of successfully predicted branches:\t\t" << "Not implemented " << endl;   
 }
 
 #pragma endregion debugging
 
+#pragma region debugger
+
+/* Debugger state - only ever touched by the debug specialisation of cycle() */
+std::set<int> breakpoints;                  // PCs that pause the program when the instruction at that address is fetched
+std::map<int, Word> memoryWatchpoints;      // Data memory address -> last seen value
+std::map<int, Word> registerWatches;        // Register index -> last seen value
+
+/* Time travel - when historyCycle isn't -1 the debugger is showing the state rebuilt from the journal instead of the live one */
+int historyCycle = -1;
+std::array<Word, 16> historyRegisters;
+DataMemory historyMemory;
+int historyPC;
+
+int debuggerCyclesToStep = 0;               // Pause once this many cycles have run (0 = not stepping by cycle)
+int debuggerInstructionsToStep = 0;         // Pause once this many instructions have been written back (0 = not stepping by instruction)
+long long debuggerRetiredAtStep = 0;        // numOfRetired when the instructions to step were last counted down
+bool debuggerDetached = false;              // Set once stdin runs out, the program then runs to completion
+
+
+// Shows which instruction is in each stage of the pipeline
+void printPipeline(){
+    std::vector<std::string> stages = pipelineStages();
+    std::vector<std::string> contents = pipelineContents();
+    size_t width = 0;
+    for (const std::string& stage : stages) width = std::max(width, stage.size());
+
+    for (size_t s = 0; s < stages.size(); s++){
+        std::string label = stages.at(s) + ":";
+        label.resize(width + 2, ' ');
+        std::cout << label << contents.at(s) << std::endl;
+    }
+}
+
+// Prints data memory between the 2 addresses (inclusive)
+void printMemoryRange(const DataMemory& memory, int from, int to){
+    if (from < 0) from = 0;
+    if (to >= (int) memory.size()) to = memory.size() - 1;
+
+    for (int i = from; i <= to; i++){
+        std::cout << i << "\t" << memory.at(i) << std::endl;
+    }
+}
+
+// Moves the debugger's view to the end of an earlier cycle by replaying the journal
+void travelTo(int cycle){
+    if (!journal) throw std::logic_error("No journal is being recorded");
+    if (cycle >= journal->latestCycle()) {
+        historyCycle = -1;
+        std::cout << "At the present (cycle " << journal->latestCycle() << ")" << std::endl;
+        return;
+    }
+    if (cycle < journal->oldestCycle() && journal->oldestCycle() > 0) {
+        std::cout << "History before cycle " << journal->oldestCycle() << " has been dropped" << std::endl;
+        cycle = journal->oldestCycle();
+    }
+
+    journal->reconstruct(cycle, historyRegisters, historyMemory, historyPC);
+    historyCycle = cycle;
+    std::cout << "Viewing the end of cycle " << cycle << " (read only, 'present' to go back)" << std::endl;
+}
+
+// Reads a register ("r3") or a plain number from a debugger command
+int debuggerArgument(std::string str){
+    if (!str.empty() && (str[0] == 'r' || str[0] == 'R')) return strToRegister(str);
+    return stoi(str);
+}
+
+void printDebuggerHelp(){
+    std::cout << "Debugger commands:" << std::endl;
+    std::cout << "  c                 continue until a breakpoint/watchpoint is hit" << std::endl;
+    std::cout << "  s [n]             step n cycles (default 1)" << std::endl;
+    std::cout << "  back [n]          view the state n cycles earlier (default 1)" << std::endl;
+    std::cout << "  goto <cycle>      view the state at the end of an earlier cycle" << std::endl;
+    std::cout << "  present           go back to the live state" << std::endl;
+    std::cout << "  journal           show how much history has been recorded" << std::endl;
+    std::cout << "  si [n]            step until n instructions have been written back (default 1)" << std::endl;
+    std::cout << "  b <pc>            set a breakpoint on the instruction at pc" << std::endl;
+    std::cout << "  db <pc>           delete a breakpoint" << std::endl;
+    std::cout << "  w <addr>          watch a data memory address" << std::endl;
+    std::cout << "  dw <addr>         delete a memory watchpoint" << std::endl;
+    std::cout << "  wr <rN>           watch a register" << std::endl;
+    std::cout << "  dwr <rN>          delete a register watch" << std::endl;
+    std::cout << "  info              list breakpoints and watchpoints" << std::endl;
+    std::cout << "  r                 print the register file" << std::endl;
+    std::cout << "  m [from] [to]     print data memory" << std::endl;
+    std::cout << "  p                 print the pipeline" << std::endl;
+    std::cout << "  q                 quit the program" << std::endl;
+}
+
+// Reads commands from stdin until one of them resumes execution
+void debuggerPrompt(){
+    debuggerCyclesToStep = 0;
+    debuggerInstructionsToStep = 0;
+
+    std::string line;
+    while (true){
+        if (historyCycle == -1) std::cout << "(isa-dbg cycle " << numOfCycles - 1 << ", PC " << PC << ") " << std::flush;
+        else                    std::cout << "(isa-dbg history cycle " << historyCycle << ", PC " << historyPC << ") " << std::flush;
+        if (!std::getline(std::cin, line)) {
+            // No more commands, let the program run to the end
+            debuggerDetached = true;
+            std::cout << std::endl;
+            return;
+        }
+
+        std::vector<std::string> command = split(line, ' ');
+        if (command.empty() || command.at(0).empty()) continue;
+
+        try {
+            std::string c = command.at(0);
+            int n = (command.size() > 1) ? debuggerArgument(command.at(1)) : 1;
+
+            // Running again always carries on from the present
+            if (historyCycle != -1 && (c == "c" || c == "continue" || c == "s" || c == "step" || c == "si" || c == "stepi")){
+                historyCycle = -1;
+                std::cout << "Back to the present (cycle " << numOfCycles - 1 << ")" << std::endl;
+            }
+
+                 if (c == "c" || c == "continue") return;
+            else if (c == "s" || c == "step")  { debuggerCyclesToStep = n; return; }
+            else if (c == "si" || c == "stepi"){ debuggerInstructionsToStep = n; debuggerRetiredAtStep = numOfRetired; return; }
+            else if (c == "back")              travelTo(((historyCycle == -1) ? numOfCycles - 1 : historyCycle) - n);
+            else if (c == "goto")              travelTo(n);
+            else if (c == "present")           travelTo(numOfCycles - 1);
+            else if (c == "journal") {
+                std::cout << "Cycles " << journal->oldestCycle() << " to " << journal->latestCycle() << " recorded using " << journal->bytesUsed() << " bytes";
+                if (journal->oldestCycle() > 0) std::cout << " (older history has been dropped)";
+                std::cout << std::endl;
+            }
+            else if (c == "b" || c == "break") { breakpoints.insert(n); std::cout << "Breakpoint set at PC " << n << std::endl; }
+            else if (c == "db")                { breakpoints.erase(n); }
+            else if (c == "w" || c == "watch") { memoryWatchpoints[n] = dataMemory.at(n); std::cout << "Watching address " << n << std::endl; }
+            else if (c == "dw")                { memoryWatchpoints.erase(n); }
+            else if (c == "wr")                { registerWatches[n] = registerFile.at(n); std::cout << "Watching R" << n << std::endl; }
+            else if (c == "dwr")               { registerWatches.erase(n); }
+            else if (c == "info") {
+                for (int b : breakpoints) std::cout << "Breakpoint at PC " << b << "\t" << instrMemory.at(b) << std::endl;
+                for (auto& w : memoryWatchpoints) std::cout << "Watchpoint on address " << w.first << " = " << w.second << std::endl;
+                for (auto& w : registerWatches)   std::cout << "Watch on R" << w.first << " = " << w.second << std::endl;
+            }
+            else if (c == "r" || c == "regs") {
+                if (historyCycle == -1) printRegisterFile(16);
+                else {
+                    std::cout << "PC: " << historyPC << std::endl;
+                    for (int i = 0; i < 16; i++) std::cout << "R" << i << ": " << historyRegisters.at(i) << std::endl;
+                }
+            }
+            else if (c == "m" || c == "mem") {
+                int from = (command.size() > 1) ? n : 0;
+                int to   = (command.size() > 2) ? stoi(command.at(2)) : from + amount_of_instruction_memory_to_output;
+                printMemoryRange((historyCycle == -1) ? dataMemory : historyMemory, from, to);
+            }
+            else if (c == "p" || c == "pipe")  printPipeline();
+            else if (c == "q" || c == "quit")  { systemHaltFlag = true; return; }
+            else printDebuggerHelp();
+        } catch (std::exception& e) {
+            std::cout << "Invalid command: " << line << std::endl;
+        }
+    }
+}
+
+// Called at the end of every cycle in debug mode, drops into the prompt if anything has been hit
+void debuggerCheck(){
+    if (debuggerDetached) return;
+
+    bool stop = false;
+
+    if (IF_State == Next && breakpoints.count(IF_PC)){
+        std::cout << "Breakpoint hit: PC " << IF_PC << " (" << CIR << ") fetched" << std::endl;
+        stop = true;
+    }
+
+    for (auto& w : memoryWatchpoints){
+        Word value = dataMemory.at(w.first);
+        if (value != w.second){
+            std::cout << "Watchpoint: address " << w.first << " changed from " << w.second << " to " << value << std::endl;
+            w.second = value;
+            stop = true;
+        }
+    }
+
+    for (auto& w : registerWatches){
+        Word value = registerFile.at(w.first);
+        if (value != w.second){
+            std::cout << "Watch: R" << w.first << " changed from " << w.second << " to " << value << std::endl;
+            w.second = value;
+            stop = true;
+        }
+    }
+
+    if (debuggerCyclesToStep > 0 && --debuggerCyclesToStep == 0) stop = true;
+    // Counted off numOfRetired so bubbles don't count and a fused pair or a run of skipped NOPs counts as what it retired
+    if (debuggerInstructionsToStep > 0) {
+        debuggerInstructionsToStep -= (int) std::min<long long>(numOfRetired - debuggerRetiredAtStep, debuggerInstructionsToStep);
+        debuggerRetiredAtStep = numOfRetired;
+        if (debuggerInstructionsToStep == 0) stop = true;
+    }
+
+    if (stop) debuggerPrompt();
+}
+
+#pragma endregion debugger
+
 #pragma region F/D/E/M/W/
 
-void fushPipeline(){
-    IF_State = Empty;
-    IF_inst = "";
+// Throws away every instruction of the current thread that is younger than the one in the C stage - called when the BU
+// sends fetch somewhere else (and by switchOut()). Has to run before execute(), issue() and decode() do in the cycle so
+// that none of them pick the instructions up. The other threads' instructions stay where they are.
+void flushPipeline(){
+    int thread = currentThread;
+
+    // Fetch may have gone round a hardware loop (or decode started one) or pushed and popped the return address stack for
+    // what is thrown away, both go back to how they were before the oldest of it was fetched
+    const HardwareLoopStack* loops = nullptr;
+    const ReturnAddressStack::Checkpoint* returnAddresses = nullptr;
+    if (I_State == Next && I_Thread == thread) { loops = &I_Loops; returnAddresses = &I_ReturnAddresses; }
+    for (auto l = backEnd.rbegin(); !loops && l != backEnd.rend(); ++l) if (l->state == Next && l->thread == thread) { loops = &l->loops; returnAddresses = &l->returnAddresses; }
+    if (!loops && ID_State == Next && ID_Thread == thread) { loops = &ID_Loops; returnAddresses = &ID_ReturnAddresses; }
+    for (auto l = frontEnd.rbegin(); !loops && l != frontEnd.rend(); ++l) if (l->thread == thread) { loops = &l->loops; returnAddresses = &l->returnAddresses; }
+    if (!loops && IF_Thread == thread) { loops = &IF_Loops; returnAddresses = &IF_ReturnAddresses; }
+    if (loops) {
+        hardwareLoops = *loops;
+        returnAddressStack.restore(*returnAddresses);
+    }
+
+    if (IF_Thread == thread) {
+        IF_State = Empty;
+        IF_inst = "";
+    }
+
+    for (FetchLatch& l : frontEnd) if (l.thread == thread) {
+        l.state = Empty;
+        l.inst = "";
+        l.thread = -1;
+    }
+
+    if (ID_Thread == thread) {
+        ID_State = Empty;
+        ID_inst = "";
+    }
+
+    for (DecodeLatch& l : backEnd) if (l.thread == thread) {
+        l.state = Empty;
+        l.inst = "";
+        l.thread = -1;
+    }
+
+    // Issued but not yet executed
+    if (I_Thread == thread) {
+        I_State = Empty;
+        I_inst = "";
+        for (ALU* a : ALUs) if (a->state == READY) a->state = IDLE;
+        for (BU*  b : BUs ) if (b->state == READY) b->state = IDLE;
+        for (LSU* l : LSUs) if (l->state == READY) l->state = IDLE;
+    }
 
-    ID_State = Empty;
-    ID_inst = "";
+    // Any HALT in flight was behind the branch
+    haltPendingFlag = false;
 }
 
-// The main cycle of the processor
-void cycle(){
-    // Print memory before running the program
-    if (PRINT_MEMORY_FLAG) outputAllMemory(amount_of_instruction_memory_to_output);
+// Moves the clock straight past cycles in which nothing but the cycle count would change - the stats come out
+// the same as simulating them one at a time
+void skipIdleCycles(){
+    // The whole pipeline is frozen until memory answers - or until a predicted load (-vpred) is checked, which can end the wait
+    if (memoryStallCycles > 0) {
+        int skip = memoryStallCycles;
+        if (loadSpeculation.active && loadSpeculation.writeBacksToLoad == 0) skip = std::min(skip, std::max(0, loadSpeculation.dataArrives - numOfCycles));
+        // The prediction stage of a decoupled front end (-ftq) keeps going, the cycles can only be skipped once it has filled its queue
+        if (fetchTargets && !fetchTargets->full()) skip = 0;
+        numOfCycles += skip;
+        numOfSkippedCycles += skip;
+        memoryStallCycles -= skip;
+        return;
+    }
 
-    while (!systemHaltFlag) {
+    // If every stage holds a NOP, fetching more NOPs only moves them along. The loop buffer counts every fetch so it has to see them,
+    // and a hardware loop could end in the middle of the NOPs. -annotate has to see which NOPs ran. Where the latches end up
+    // is only worked out for the default pipeline, and NOPs written back on a predicted load value might have to be taken back.
+    // With -imemlat every NOP has to be fetched from instruction memory.
+    if (loopBuffer || haltPendingFlag || hardwareLoops.depth > 0 || hotspots || !defaultPipeline() || loadSpeculation.active || instructionMemoryModel) return;
+    if (IF_State != Next || ID_State != Next || I_State != Next || EX_State != Next || C_State != Next || WB_State != Next) return;
+    if (IF_inst != "NOP" || ID_inst != "NOP" || I_inst != "NOP" || EX_inst != "NOP" || C_inst != "NOP" || WB_inst != "NOP") return;
+    for (ALU* a : ALUs) if (a->state == READY || a->outputFlag) return;
+    for (BU*  b : BUs ) if (b->state == READY || b->outputFlag) return;
+    for (LSU* l : LSUs) if (l->state == READY || l->outputFlag) return;
+
+    int run = 0;
+    while (PC + run < SIZE_OF_INSTRUCTION_MEMORY && instrMemory.at(PC + run) == "NOP") run++;
+    if (run == 0) return;
+
+    // Where the latches would be after fetching the last NOP of the run
+    PC += run;
+    IF_PC = PC - 1;
+    IF_PredictedPC = PC;
+    ID_PC = PC - 2;
+    ID_PredictedPC = PC - 1;
+
+    numOfCycles += run;
+    numOfSkippedCycles += run;
+    numOfRetired += run;            // Every NOP skipped over would have been written back in one of those cycles
+}
 
-        //if (numOfCycles == 26) outputAllMemory(amount_of_instruction_memory_to_output);
-        std::cout << "---------- Cycle " << numOfCycles << " starting ----------"<< std::endl;
-        //std::cout << "PC has current value: " << PC << std::endl;
+// One clock cycle of the processor
+// DEBUG_MODE selects the debugger/-r specialisation, the normal run loop is compiled without any of those per-cycle checks
+template <bool DEBUG_MODE>
+void step(){
+    // The debugger has to see every cycle so it never skips
+    if (!DEBUG_MODE && EVENT_DRIVEN_FLAG) skipIdleCycles();
 
+    //if (numOfCycles == 26) outputAllMemory(amount_of_instruction_memory_to_output);
+    *simulationLog << "---------- Cycle " << numOfCycles << " starting ----------"<< std::endl;
+    //std::cout << "PC has current value: " << PC << std::endl;
 
-        // Non-pipelined 
-        //fetch(); decode(); issue(); execute(); complete(); writeBack();
 
-        // Pipelined
-        writeBack(); /*memoryAccess();*/ complete(); execute(); issue(); decode(); fetch();
+    // Non-pipelined 
+    //fetch(); decode(); issue(); execute(); complete(); writeBack();
 
-        cout << "\nCurrent instruction in the IF: " << IF_inst << endl;
-        cout << "Current instruction in the ID: " << ID_inst << endl;
-        cout << "Current instruction in the I:  " << I_inst << endl;
-        cout << "Current instruction in the EX: " << EX_inst << endl;
-        cout << "Current instruciton in the C:  " << C_inst << endl;
-        //cout << "Current instruction in the MA: " << MA_inst << endl;   //
-        cout << "Current instruction in the WB: " << WB_inst << endl;
-                
+    // -vpred: the data of the predicted load has arrived
+    if (loadSpeculation.active && loadSpeculation.writeBacksToLoad == 0 && numOfCycles >= loadSpeculation.dataArrives) resolveLoadValue();
 
-        if (PRINT_REGISTERS_FLAG) printRegisterFile(16);
+    // Pipelined - nothing moves while the LSU is waiting on memory
+    if (memoryStallCycles > 0) {
+        memoryStallCycles--;
+        *simulationLog << "Waiting on memory" << std::endl;
+    } else {
+        writeBack(); complete(); execute(); advanceBackEnd(); issue(); advanceFrontEnd(); decode(); fetch();
+    }
+
+    // -ftq: the branch prediction stage runs ahead of fetch, even while the rest of the pipeline is waiting on memory
+    if (fetchTargets) fetchTargets->predict();
+
+    if (defaultPipeline()) {
+        *simulationLog << "\nCurrent instruction in the IF: " << IF_inst << endl;
+        *simulationLog << "Current instruction in the ID: " << ID_inst << endl;
+        *simulationLog << "Current instruction in the I:  " << I_inst << endl;
+        *simulationLog << "Current instruction in the EX: " << EX_inst << endl;
+        *simulationLog << "Current instruciton in the C:  " << C_inst << endl;
+        *simulationLog << "Current instruction in the WB: " << WB_inst << endl;
+    } else {
+        // -pipeline
+        std::vector<std::string> stages = pipelineStages();
+        std::vector<std::string> contents = pipelineContents();
+        *simulationLog << endl;
+        for (size_t s = 0; s < stages.size(); s++) *simulationLog << "Current instruction in the " << stages.at(s) << ": " << contents.at(s) << endl;
+    }
+            
+
+    *simulationLog << "---------- Cycle " << numOfCycles << " completed. ----------\n"<< std::endl;
+    numOfCycles++;
 
-        std::cout << "---------- Cycle " << numOfCycles << " completed. ----------\n"<< std::endl;
-        numOfCycles++;
+    if (DEBUG_MODE) {
+        if (journal) journal->endCycle();
+        if (PRINT_REGISTERS_FLAG) printRegisterFile(16);
+        if (DEBUG_MODE_FLAG) debuggerCheck();
     }
-    std::cout << "Program has been halted\n" << std::endl;
+}
+
+// Runs the loaded program until it halts
+template <bool DEBUG_MODE>
+void cycle(){
+    // Print memory before running the program
+    if (PRINT_MEMORY_FLAG) outputAllMemory(amount_of_instruction_memory_to_output);
+
+    // Let breakpoints be set before anything has ran
+    if (DEBUG_MODE && DEBUG_MODE_FLAG) debuggerPrompt();
+
+    while (!systemHaltFlag) step<DEBUG_MODE>();
+    *simulationLog << "Program has been halted\n" << std::endl;
+    if (!divergenceReport.empty()) std::cout << divergenceReport << std::endl;
+
+    // With -threads what is printed from here on is thread 0's
+    switchThread(0);
 
     // Print the memory after the program has been ran
     if (PRINT_MEMORY_FLAG) outputAllMemory(amount_of_instruction_memory_to_output);
     if (PRINT_STATS_FLAG) outputStatistics(numOfCycles);
+    if (hotspots) hotspots->print(std::cout, std::vector<std::string>(instrMemory.begin(), instrMemory.end()), amount_of_instruction_memory_to_output + 1, numOfCycles);
 }
 
 
 // Fetches the next instruction that is to be ran, this instruction is fetched by taking the PCs index 
 void fetch(){
+    PROFILE(PROFILE_FETCH);
+
+    // With -threads fetch first picks whose instruction it gets
+    if (hardwareThreads.size() > 1) {
+        int thread = fetchThread();
+        if (thread < 0) {
+            IF_State = Empty;
+            IF_inst = string("");
+            IF_Thread = -1;
+            return;
+        }
+        switchThread(thread);
+        hardwareThreads.at(thread).numOfFetches++;
+    }
+    IF_Thread = currentThread;
+
     // Change the state of the IF such that it is "currently running"
     IF_State = Current;
+    IF_Loops = hardwareLoops;
+    IF_ReturnAddresses = returnAddressStack.checkpoint();
     
+    // Nothing after a HALT gets fetched
+    if (haltPendingFlag) {
+        IF_State = Empty;
+        IF_inst = string("");
+        return;
+    }
+
+    // With -imemlat fetch gets nothing until the instruction's line has come back
+    if (instructionMemoryModel && !instructionArrived()) {
+        numOfFetchStallCycles++;
+        IF_State = Empty;
+        IF_inst = string("");
+        IF_Thread = -1;
+        return;
+    }
+
     // Load the memory address that is in the instruction memory address that is pointed to by the PC
     CIR = instrMemory.at(PC);
-
-    // Increment PC or don't (depending on whether we are on a branch or not)
-    if (branchFlag){
-        branchFlag = false;
-    } else {
-        PC++;
+    IF_PC = PC;
+    IF_PredictedPC = PC + 1;
+
+    // Instructions of a loop that has already been decoded don't need decoding again
+    IF_FromLoopBuffer = loopBuffer && loopBuffer->lookup(PC, IF_Decoded, IF_PredictedPC);
+
+    // CALLs jump straight away and RETs go wherever the return address stack says, the BU fixes it if they were wrong
+    if (CIR.compare(0, 4, "CALL") == 0) {
+        returnAddressStack.push(PC + 1);
+        IF_PredictedPC = stoi(split(CIR, ' ').at(1));
+    } else if (CIR.compare(0, 3, "RET") == 0) {
+        int returnAddress;
+        if (returnAddressStack.pop(returnAddress)) IF_PredictedPC = returnAddress;
     }
 
+    // The last instruction of a hardware loop's body is followed by its first (decode makes sure it isn't a branch)
+    hardwareLoops.next(PC, IF_PredictedPC);
+
+    PC = IF_PredictedPC;
+
     // Debugging/GUI to show the current instr in the processor
     IF_inst = CIR;
 
@@ -279,7 +1019,7 @@ void fetch(){
     // Increment PC
     //pc++;
 
-    std::cout << "CIR has current value: " << CIR << std::endl;
+    *simulationLog << "CIR has current value: " << CIR << std::endl;
     //std::cout << "Fetched... ";
     
     // IF has ran and now we are ready to move to the next stage
@@ -287,9 +1027,33 @@ void fetch(){
 }
 
 
+// -imemlat. Whether the instruction at PC can be fetched this cycle - the first time fetch asks for it instruction memory
+// says how long it takes, and fetch waits that long unless it goes somewhere else first (a flush). With -threads the thread
+// is left alone until then and fetch takes another's instruction instead.
+bool instructionArrived(){
+    requestInstruction();
+    if (numOfCycles < fetchArrives) {
+        if (hardwareThreads.size() > 1) hardwareThreads.at(currentThread).parkedUntil = fetchArrives;
+        return false;
+    }
+    fetchWaitPC = -1;
+    return true;
+}
+
+// Asks instruction memory for the instruction at PC, unless fetch is already waiting on it
+void requestInstruction(){
+    if (fetchWaitPC == PC) return;
+    if (fetchTargets) fetchTargets->follow(PC, returnAddressStack, hardwareLoops);
+    fetchWaitPC = PC;
+    fetchArrives = numOfCycles + instructionMemoryModel->access(PC, PC) - 1;
+}
+
+
 // Takes current instruction that is being used and decodes it so that it can be understood by the computer (not a massively important part)
 // Updates PC
 void decode(){
+    PROFILE(PROFILE_DECODE);
+
     #pragma region State Setup
     // State change for ID
     #pragma region StageStates
@@ -309,26 +1073,67 @@ void decode(){
 
         // Debugging/GUI to show the current instr in the processor
         ID_inst = IF_inst;
+        ID_PC = IF_PC;
+        ID_PredictedPC = IF_PredictedPC;
+        ID_Loops = IF_Loops;
+        ID_ReturnAddresses = IF_ReturnAddresses;
+        ID_Thread = IF_Thread;
     }
     #pragma endregion State Setup
 
-    std::vector<std::string> splitCIR = split(CIR, ' '); // split the instruction based on ' ' and decode instruction like that
+    switchThread(ID_Thread);
+    ID_Group.clear();
+
+    DecodedInstruction instruction;
+    if (IF_FromLoopBuffer) instruction = IF_Decoded;
+    else {
+        instruction = decodeInstruction(CIR);
+        if (loopBuffer) loopBuffer->capture(ID_PC, instruction);
+    }
+
+    // A CMP followed by a branch on its result goes to the BU as a single op
+    if (instruction.opCode == CMP && FUSION_FLAG) fuseCompareAndBranch(instruction);
+
+    readOperands(instruction);
+
+    if (instruction.opCode == LOOP) startHardwareLoop(instruction);
+    if (instruction.opCode >= LD && instruction.opCode <= OUT && instruction.opCode != LID && LSUs.size() > 1) groupMemoryOperations();
+
+    ID_State = Next;
+}
+
+
+// Parses an instruction - only works out which registers it uses, readOperands() reads them
+DecodedInstruction decodeInstruction(const std::string& instruction){
+    DecodedInstruction d;
+    std::vector<std::string> splitCIR = split(instruction, ' '); // split the instruction based on ' ' and decode instruction like that
     
     // Throws error if there isn't any instruction to be loaded
     if (splitCIR.size() == 0) throw std::invalid_argument("No instruction loaded");
+
+    // A predicated ALU op ends with ?Z/?NE/?PO and the register it is guarded by
+    if (splitCIR.size() > 2 && splitCIR.at(splitCIR.size() - 2).compare(0, 1, "?") == 0) {
+        std::string condition = splitCIR.at(splitCIR.size() - 2);
+             if (condition == "?Z")  d.guardCondition = BZ;
+        else if (condition == "?NE") d.guardCondition = BNE;
+        else if (condition == "?PO") d.guardCondition = BPO;
+        else throw std::invalid_argument("Unidentified guard: " + condition);
+        d.guard = strToRegister(splitCIR.back());
+        splitCIR.resize(splitCIR.size() - 2);
+    }
     
-    // Load the register values into the ALU's input
+    // Find the registers the instruction uses
     if (splitCIR.size() > 1) {
         // Get set first/destination register
-        if      (splitCIR.at(1).substr(0 ,1).compare("r")  == 0 ) ALUD = strToRegister(splitCIR.at(1));
+        if      (splitCIR.at(1).substr(0 ,1).compare("r")  == 0 ) d.dest = strToRegister(splitCIR.at(1));
         //else if (splitCIR.at(1).substr(0, 2).compare("FP") == 0)  ALUD = (FP_Register) stoi(splitCIR.at(1).substr(1, splitCIR.at(1).length()));
 
         if (splitCIR.size() > 2) {
-            if      (splitCIR.at(2).substr(0, 1).compare("r")  == 0 ) ALU0 = registerFile.at(strToRegister(splitCIR.at(2)));
+            if      (splitCIR.at(2).substr(0, 1).compare("r")  == 0 ) d.src0 = strToRegister(splitCIR.at(2));
             //else if (splitCIR.at(2).substr(0, 2).compare("FP") == 0)  ALU_FP0 = (FP_Register) stoi(splitCIR.at(2).substr(1, splitCIR.at(2).length()));
             
             if (splitCIR.size() > 3) {
-                if      (splitCIR.at(3).substr(0,1).compare("r")  == 0 ) ALU1 = registerFile.at(strToRegister(splitCIR.at(3)));
+                if      (splitCIR.at(3).substr(0,1).compare("r")  == 0 ) d.src1 = strToRegister(splitCIR.at(3));
                 //else if (splitCIR.at(3).substr(0,1).compare("FP") == 0 ) ALU_FP1 = (FP_Register) stoi(splitCIR.at(3).substr(1, splitCIR.at(3).length()));
 
             }
@@ -336,54 +1141,186 @@ void decode(){
     }
 
     // if statement for decoding all instructions
-         if (splitCIR.at(0).compare("ADD")  == 0) OpCodeRegister = ADD;
-    else if (splitCIR.at(0).compare("ADDI") == 0) { OpCodeRegister = ADDI; IMMEDIATE = stoi(splitCIR.at(3)); }
-    else if (splitCIR.at(0).compare("ADDF") == 0) OpCodeRegister = ADDF;
-    else if (splitCIR.at(0).compare("SUB")  == 0) OpCodeRegister = SUB;
-    else if (splitCIR.at(0).compare("SUBF") == 0) OpCodeRegister = SUBF;
-    else if (splitCIR.at(0).compare("MUL")  == 0) OpCodeRegister = MUL;
-    else if (splitCIR.at(0).compare("MULO") == 0) OpCodeRegister = MULO;
-    else if (splitCIR.at(0).compare("MULFO")== 0) OpCodeRegister = MULFO;
-    else if (splitCIR.at(0).compare("DIV")  == 0) OpCodeRegister = DIV;
-    else if (splitCIR.at(0).compare("DIVF") == 0) OpCodeRegister = DIVF;
-    else if (splitCIR.at(0).compare("CMP")  == 0) OpCodeRegister = CMP;
-
-    else if (splitCIR.at(0).compare("LD")   == 0) OpCodeRegister = LD;
-    else if (splitCIR.at(0).compare("LDD")  == 0) { OpCodeRegister = LDD; IMMEDIATE = stoi(splitCIR.at(2)); } 
-    else if (splitCIR.at(0).compare("LDI")  == 0) { OpCodeRegister = LDI; IMMEDIATE = stoi(splitCIR.at(2)); }
-    else if (splitCIR.at(0).compare("LID")  == 0) OpCodeRegister = LID;
-    else if (splitCIR.at(0).compare("LDA")  == 0) OpCodeRegister = LDA;
+         if (splitCIR.at(0).compare("ADD")  == 0) d.opCode = ADD;
+    else if (splitCIR.at(0).compare("ADDI") == 0) { d.opCode = ADDI; d.immediate = strToWord(splitCIR.at(3)); d.hasImmediate = true; }
+    else if (splitCIR.at(0).compare("ADDF") == 0) d.opCode = ADDF;
+    else if (splitCIR.at(0).compare("SUB")  == 0) d.opCode = SUB;
+    else if (splitCIR.at(0).compare("SUBF") == 0) d.opCode = SUBF;
+    else if (splitCIR.at(0).compare("MUL")  == 0) d.opCode = MUL;
+    else if (splitCIR.at(0).compare("MULO") == 0) d.opCode = MULO;
+    else if (splitCIR.at(0).compare("MULFO")== 0) d.opCode = MULFO;
+    else if (splitCIR.at(0).compare("DIV")  == 0) d.opCode = DIV;
+    else if (splitCIR.at(0).compare("DIVF") == 0) d.opCode = DIVF;
+    else if (splitCIR.at(0).compare("CMP")  == 0) d.opCode = CMP;
+
+    else if (splitCIR.at(0).compare("LD")   == 0) d.opCode = LD;
+    else if (splitCIR.at(0).compare("LDD")  == 0) { d.opCode = LDD; d.immediate = strToWord(splitCIR.at(2)); d.hasImmediate = true; } 
+    else if (splitCIR.at(0).compare("LDI")  == 0) { d.opCode = LDI; d.immediate = strToWord(splitCIR.at(2)); d.hasImmediate = true; }
+    else if (splitCIR.at(0).compare("LID")  == 0) d.opCode = LID;
+    else if (splitCIR.at(0).compare("LDA")  == 0) d.opCode = LDA;
     
-    else if (splitCIR.at(0).compare("STO")  == 0) { OpCodeRegister = STO; ALUD = registerFile.at(strToRegister(splitCIR.at(1)));}
-    else if (splitCIR.at(0).compare("STOI") == 0) { OpCodeRegister = STOI; IMMEDIATE = stoi(splitCIR.at(1)); }
-
-    else if (splitCIR.at(0).compare("AND")  == 0) OpCodeRegister = AND;
-    else if (splitCIR.at(0).compare("OR")   == 0) OpCodeRegister = OR;
-    else if (splitCIR.at(0).compare("NOT")  == 0) OpCodeRegister = NOT;
-    else if (splitCIR.at(0).compare("LSHFT")== 0) OpCodeRegister = LSHFT;       // IMMEDIATE = stoi(splitCIR.at(3)); }
-    else if (splitCIR.at(0).compare("RSHFT")== 0) OpCodeRegister = RSHFT;       // IMMEDIATE = stoi(splitCIR.at(3)); }
-
-    else if (splitCIR.at(0).compare("JMP")  == 0) { OpCodeRegister = JMP; ALUD = registerFile.at(strToRegister(splitCIR.at(1))); }
-    else if (splitCIR.at(0).compare("JMPI") == 0) {OpCodeRegister = JMPI; ALUD = registerFile.at(strToRegister(splitCIR.at(1))); }
-    else if (splitCIR.at(0).compare("BNE")  == 0) {OpCodeRegister = BNE; ALUD = registerFile.at(strToRegister(splitCIR.at(1))); }
-    else if (splitCIR.at(0).compare("BPO")  == 0) {OpCodeRegister = BPO; ALUD = registerFile.at(strToRegister(splitCIR.at(1))); }
-    else if (splitCIR.at(0).compare("BZ")   == 0) {OpCodeRegister = BZ; ALUD = registerFile.at(strToRegister(splitCIR.at(1))); }
-
-    else if (splitCIR.at(0).compare("HALT") == 0) {OpCodeRegister = HALT; systemHaltFlag = true;}
-    else if (splitCIR.at(0).compare("NOP")  == 0) OpCodeRegister = NOP;
-    else if (splitCIR.at(0).compare("MV")   == 0) OpCodeRegister = MV;
-    else if (splitCIR.at(0).compare("MVHI") == 0) OpCodeRegister = MVHI;
-    else if (splitCIR.at(0).compare("MVLO") == 0) OpCodeRegister = MVLO;
+    else if (splitCIR.at(0).compare("STO")  == 0) d.opCode = STO;
+    else if (splitCIR.at(0).compare("STOI") == 0) { d.opCode = STOI; d.immediate = strToWord(splitCIR.at(1)); d.hasImmediate = true; }
+    else if (splitCIR.at(0).compare("OUT")  == 0) d.opCode = OUT;
+
+    else if (splitCIR.at(0).compare("AND")  == 0) d.opCode = AND;
+    else if (splitCIR.at(0).compare("OR")   == 0) d.opCode = OR;
+    else if (splitCIR.at(0).compare("NOT")  == 0) d.opCode = NOT;
+    else if (splitCIR.at(0).compare("LSHFT")== 0) d.opCode = LSHFT;       // IMMEDIATE = stoi(splitCIR.at(3)); }
+    else if (splitCIR.at(0).compare("RSHFT")== 0) d.opCode = RSHFT;       // IMMEDIATE = stoi(splitCIR.at(3)); }
+    else if (splitCIR.at(0).compare("CMOVZ")  == 0) { d.opCode = CMOV; d.guardCondition = BZ;  }
+    else if (splitCIR.at(0).compare("CMOVNE") == 0) { d.opCode = CMOV; d.guardCondition = BNE; }
+    else if (splitCIR.at(0).compare("CMOVPO") == 0) { d.opCode = CMOV; d.guardCondition = BPO; }
+
+    else if (splitCIR.at(0).compare("JMP")  == 0) d.opCode = JMP;
+    else if (splitCIR.at(0).compare("JMPI") == 0) d.opCode = JMPI;
+    else if (splitCIR.at(0).compare("BNE")  == 0) d.opCode = BNE;
+    else if (splitCIR.at(0).compare("BPO")  == 0) d.opCode = BPO;
+    else if (splitCIR.at(0).compare("BZ")   == 0) d.opCode = BZ;
+    else if (splitCIR.at(0).compare("CALL") == 0) { d.opCode = CALL; d.immediate = strToWord(splitCIR.at(1)); d.hasImmediate = true; }
+    else if (splitCIR.at(0).compare("RET")  == 0) d.opCode = RET;
+
+    else if (splitCIR.at(0).compare("HALT") == 0) d.opCode = HALT;
+    else if (splitCIR.at(0).compare("NOP")  == 0) d.opCode = NOP;
+    else if (splitCIR.at(0).compare("LOOP") == 0) { d.opCode = LOOP; d.immediate = strToWord(splitCIR.at(2)); d.hasImmediate = true; }
+    else if (splitCIR.at(0).compare("MV")   == 0) d.opCode = MV;
+    else if (splitCIR.at(0).compare("MVHI") == 0) d.opCode = MVHI;
+    else if (splitCIR.at(0).compare("MVLO") == 0) d.opCode = MVLO;
 
     else throw std::invalid_argument("Unidentified Instruction: " + splitCIR.at(0));
 
+    // CMOV rd rs rc is MV rd rs guarded by rc, the guard only fits ops the ALUs run
+    if (d.opCode == CMOV) {
+        if (d.guard >= 0) throw std::invalid_argument("A CMOV cannot have a guard as well: " + instruction);
+        d.guard = d.src1;
+    } else if (d.guard >= 0 && !((d.opCode >= ADD && d.opCode <= CMP) || (d.opCode >= AND && d.opCode <= RSHFT) || d.opCode == MVHI || d.opCode == MVLO)) {
+        throw std::invalid_argument("Only ALU instructions can be predicated: " + instruction);
+    }
 
-    ID_State = Next;
+    return d;
+}
+
+
+// Turns a CMP into a fused CMP + branch when the next instruction is BZ/BNE/BPO on the CMP's result.
+// Only done if the branch is the thread's next instruction, fetch then goes wherever it would have after the branch.
+void fuseCompareAndBranch(DecodedInstruction& d){
+    int branchPC = ID_PC + 1;
+    if (d.guard >= 0) return;           // The BU doesn't do guards
+    if (!nextInstructionIs(branchPC) || branchPC >= SIZE_OF_INSTRUCTION_MEMORY || instrMemory.at(branchPC).empty()) return;
+
+    DecodedInstruction branch = decodeInstruction(instrMemory.at(branchPC));
+    if (branch.dest < 0 || branch.src0 != d.dest) return;
+
+         if (branch.opCode == BZ)  d.opCode = CMPBZ;
+    else if (branch.opCode == BNE) d.opCode = CMPBNE;
+    else if (branch.opCode == BPO) d.opCode = CMPBPO;
+    else return;
+    d.target = branch.dest;
+
+    takeNextInstruction(loopBuffer ? loopBuffer->predict(branchPC) : branchPC + 1);
+
+    // Debugging/GUI to show both halves
+    ID_inst += " + " + instrMemory.at(branchPC);
+}
+
+
+// LOOP rs end - runs the instructions from the one after the LOOP up to end (not included) rs times, or skips them if
+// rs isn't positive. Unless -pipeline gives fetch more than one stage in front of decode, fetch hasn't gone past the LOOP
+// yet so neither throws anything away.
+void startHardwareLoop(const DecodedInstruction& d){
+    refetchAfterDecode();
+
+    int start = ID_PC + 1;
+    int end = (int) d.immediate - 1;        // Last instruction of the body
+
+    // Fetch can't go back round if the last instruction wants to go somewhere else
+    if (start <= end && end < SIZE_OF_INSTRUCTION_MEMORY) {
+        Instruction last = decodeInstruction(instrMemory.at(end)).opCode;
+        if ((last >= JMP && last <= CMPBPO) || last == LOOP) throw std::invalid_argument("A LOOP body cannot end with a branch or a LOOP: " + ID_inst);
+    } else if (end >= SIZE_OF_INSTRUCTION_MEMORY) throw std::invalid_argument("LOOP ends outside of instruction memory: " + ID_inst);
+
+    if (!hardwareLoops.start(start, end, ALUD)) {
+        ID_PredictedPC = end + 1;
+        PC = ID_PredictedPC;
+    }
+}
+
+
+// With more than one LSU the memory ops straight after a memory op go into its slot, one per LSU. Like fusion this is
+// only done while they are the thread's next instructions. The last instruction of a hardware loop is left for fetch so
+// that it goes back round.
+void groupMemoryOperations(){
+    while (ID_Group.size() + 1 < LSUs.size()){
+        int next = ID_PC + 1 + ID_Group.size();
+        if (!nextInstructionIs(next) || next >= SIZE_OF_INSTRUCTION_MEMORY || instrMemory.at(next).empty() || hardwareLoops.isEnd(next)) return;
+
+        DecodedInstruction d = decodeInstruction(instrMemory.at(next));
+        if (d.opCode < LD || d.opCode > OUT || d.opCode == LID) return;
+
+        GroupedOperation g;
+        g.opCode = d.opCode;
+        g.dest = (d.opCode == STO || d.opCode == OUT) ? registerFile.at(d.dest) : d.dest;     // As in readOperands()
+        g.in0 = d.src0 >= 0 ? registerFile.at(d.src0) : 0;
+        g.in1 = d.src1 >= 0 ? registerFile.at(d.src1) : 0;
+        g.immediate = d.immediate;
+        g.PC = next;
+        ID_Group.push_back(g);
+
+        takeNextInstruction(next + 1);
+
+        // Debugging/GUI to show the whole group
+        ID_inst += " + " + instrMemory.at(next);
+    }
+}
+
+
+// Reads the registers a decoded instruction uses into the ID/I registers
+void readOperands(const DecodedInstruction& d){
+    OpCodeRegister = d.opCode;
+
+    if (d.dest >= 0) ALUD = d.dest;
+    if (d.src0 >= 0) ALU0 = registerFile.at(d.src0);
+    if (d.src1 >= 0) ALU1 = registerFile.at(d.src1);
+    if (d.hasImmediate) IMMEDIATE = d.immediate;
+    if (d.guard >= 0) ALUG = registerFile.at(d.guard);
+    GuardCondition = d.guard >= 0 ? d.guardCondition : NOP;
+
+    switch (d.opCode){
+        // The first operand is read rather than written
+        case STO: case OUT: case JMP: case JMPI: case BNE: case BPO: case BZ: case LOOP:
+            ALUD = registerFile.at(d.dest);
+            break;
+
+        case CALL:
+            ALUD = LINK_REGISTER;
+            ALU0 = ID_PC + 1;
+            break;
+
+        case RET:
+            ALU0 = registerFile.at(LINK_REGISTER);
+            break;
+
+        // The CMP's destination goes to the BU in IMMEDIATE, the branch target in ALUD as for the other branches
+        case CMPBZ: case CMPBNE: case CMPBPO:
+            IMMEDIATE = d.dest;
+            ALUD = registerFile.at(d.target);
+            break;
+
+        case HALT:
+            haltPendingFlag = true;
+            refetchAfterDecode();
+            break;
+
+        default:
+            break;
+    }
 }
 
 
 // Issues the current instruction to it's repsective EU
 void issue(){
+    PROFILE(PROFILE_ISSUE);
+
     #pragma region State Setup
     // State change for I
     if (ID_State != Next) {
@@ -402,51 +1339,83 @@ void issue(){
 
         // Debugging/GUI to show the current instr in the processor
         I_inst = ID_inst;
+        I_PC = ID_PC;
+        I_OpCode = OpCodeRegister;
+        I_Loops = ID_Loops;
+        I_ReturnAddresses = ID_ReturnAddresses;
+        I_Thread = ID_Thread;
     }
     #pragma endregion State Setup
 
+    switchThread(I_Thread);
+
+    // Counted once the CMP has left ID - decode() also sees the ones thrown away before they get here
+    if (OpCodeRegister >= CMPBZ && OpCodeRegister <= CMPBPO) numOfFusions++;
+    if (OpCodeRegister == CMP || (OpCodeRegister >= CMPBZ && OpCodeRegister <= CMPBPO)) numOfCompares++;
+
     //ID = ALUD;
 
-    // ALUs
-    if (OpCodeRegister >= ADD && OpCodeRegister <= CMP){
+    // ALUs - the first one multiplies so it has HI/LO
+    if ((OpCodeRegister >= ADD && OpCodeRegister <= CMP) || OpCodeRegister == MVHI || OpCodeRegister == MVLO){
         ALUs.at(0)->OpCodeRegister = OpCodeRegister;
         ALUs.at(0)->DEST = ALUD;
         ALUs.at(0)->IN0 = ALU0;
         ALUs.at(0)->IN1 = ALU1;
         ALUs.at(0)->IMMEDIATE = IMMEDIATE;
+        ALUs.at(0)->GUARD = ALUG;
+        ALUs.at(0)->GUARD_CONDITION = GuardCondition;
+        ALUs.at(0)->PC = ID_PC;
         ALUs.at(0)->state = READY;
     }
     // ALU
-    else if (OpCodeRegister >= AND && OpCodeRegister <= RSHFT) {
+    else if (OpCodeRegister >= AND && OpCodeRegister <= CMOV) {
         ALUs.at(1)->OpCodeRegister = OpCodeRegister;
         ALUs.at(1)->DEST = ALUD;
         ALUs.at(1)->IN0 = ALU0;
         ALUs.at(1)->IN1 = ALU1;
         ALUs.at(1)->IMMEDIATE = IMMEDIATE;
+        ALUs.at(1)->GUARD = ALUG;
+        ALUs.at(1)->GUARD_CONDITION = GuardCondition;
+        ALUs.at(1)->PC = ID_PC;
         ALUs.at(1)->state = READY;
     }
     // BU
-    else if (OpCodeRegister >= JMP && OpCodeRegister <= BZ) {
+    else if (OpCodeRegister >= JMP && OpCodeRegister <= CMPBPO) {
         BUs.at(0)->OpCodeRegister = OpCodeRegister;
         BUs.at(0)->DEST = ALUD;
         BUs.at(0)->IN0 = ALU0;
         BUs.at(0)->IN1 = ALU1;
         BUs.at(0)->IMMEDIATE = IMMEDIATE;
-        BUs.at(0)->OUT = PC;         // USED FOR PC INCREMENTING
+        BUs.at(0)->PC = (OpCodeRegister >= CMPBZ && OpCodeRegister <= CMPBPO) ? ID_PC + 1 : ID_PC;    // A fused op branches from where the branch was
+        BUs.at(0)->PREDICTED = ID_PredictedPC;
 
         BUs.at(0)->state = READY;
     }
     // LSU
-    else if (OpCodeRegister >= LD && OpCodeRegister <= STOI) {
+    else if (OpCodeRegister >= LD && OpCodeRegister <= OUT) {
         LSUs.at(0)->OpCodeRegister = OpCodeRegister;
         LSUs.at(0)->DEST = ALUD;
         LSUs.at(0)->IN0 = ALU0;
         LSUs.at(0)->IN1 = ALU1;
         LSUs.at(0)->IMMEDIATE = IMMEDIATE;
+        LSUs.at(0)->PC = ID_PC;
 
-        std::cout << "LOADED INTO LSU" << std::endl;
+        *simulationLog << "LOADED INTO LSU" << std::endl;
 
         LSUs.at(0)->state = READY;
+
+        // The rest of the group goes to the other LSUs
+        for (size_t k = 0; k < ID_Group.size(); k++){
+            const GroupedOperation& g = ID_Group.at(k);
+            LSU* l = LSUs.at(k + 1);
+            l->OpCodeRegister = g.opCode;
+            l->DEST = g.dest;
+            l->IN0 = g.in0;
+            l->IN1 = g.in1;
+            l->IMMEDIATE = g.immediate;
+            l->PC = g.PC;
+            l->state = READY;
+        }
     }
     // MISC
     else if (OpCodeRegister >= HALT && OpCodeRegister <= MVLO) {
@@ -463,6 +1432,8 @@ void issue(){
 
 // Executes the current instruction
 void execute(){
+    PROFILE(PROFILE_EXECUTE);
+
     #pragma region State Setup
     // Prepare state for EX
     if (I_State != Next) {
@@ -481,29 +1452,117 @@ void execute(){
 
         // Debugging/GUI to show the current instr in the processor
         EX_inst = I_inst;
+        EX_PC = I_PC;
+        EX_OpCode = I_OpCode;
+        EX_Loops = I_Loops;
+        EX_ReturnAddresses = I_ReturnAddresses;
+        EX_Thread = I_Thread;
     }
     #pragma endregion State Setup
 
+    switchThread(EX_Thread);
+
     // Passes the instruction destination register or address along
     //CD = ID; 
 
-    // Set flags to false
-    writeBackFlag= false;
+    // Set flags to false (writeBackFlag belongs to complete() now - clearing it here lost every write back)
     memoryReadFlag = false;
     memoryWriteFlag = false;
 
     // Run all EUs
     for (ALU* a : ALUs) if (a->state == READY) a->cycle();
     for (BU*  b : BUs ) if (b->state == READY) b->cycle();
-    for (LSU* l : LSUs) if (l->state == READY) l->cycle();
+
+    // Nothing goes on to C if the slot's thread went away to wait on memory
+    if (runLSUs()) {
+        EX_State = Empty;
+        EX_inst = string("");
+        return;
+    }
 
   
     EX_State = Next;
 }
 
 
+int bankOf(Word address){
+    return (int) ((address / BANK_INTERLEAVE) % NUM_OF_BANKS);
+}
+
+// Runs every LSU that has been issued to. The accesses of a memory group go to their banks at the same time, ones to the
+// same bank take turns - the pipeline waits for the bank that takes longest. Returns true if the slot's thread switched
+// out instead (-threads).
+bool runLSUs(){
+    std::array<int, MAX_LSUS> banks;            // Banks used this cycle ...
+    std::array<int, MAX_LSUS> bankCycles;       // ... and the cycles each is busy for
+    std::array<LSU*, MAX_LSUS> accessed;        // LSUs that went to memory this cycle, in program order
+    int banksUsed = 0;
+    int accesses = 0;
+
+    for (LSU* l : LSUs){
+        if (l->state != READY) continue;
+        l->cycle();
+        if (!l->accessedMemory) continue;
+
+        // Stores that ran on a predicted load value are put back if it was wrong
+        if (loadSpeculation.active && (l->OPCODE_OUT == STO || l->OPCODE_OUT == STOI)) loadSpeculation.stores.push_back({l->accessAddress, l->overwritten});
+
+        int bank = bankOf(l->accessAddress);
+        int b = 0;
+        while (b < banksUsed && banks[b] != bank) b++;
+        if (b == banksUsed) {
+            banks[banksUsed] = bank;
+            bankCycles[banksUsed] = 0;
+            banksUsed++;
+        }
+        bankCycles[b] += 1 + l->stallCycles;
+        accessed[accesses++] = l;
+    }
+
+    int longest = 0;
+    int slowest = 0;
+    for (int b = 0; b < banksUsed; b++) if (bankCycles[b] > longest) { longest = bankCycles[b]; slowest = b; }
+
+    // -annotate: the accesses to the bank the pipeline waited for are what it waited for - any time they spent on memory
+    // itself, and a cycle for each that had to queue behind another
+    if (hotspots) {
+        bool queued = false;
+        for (int a = 0; a < accesses; a++){
+            LSU* l = accessed[a];
+            HotspotCounters& c = hotspots->at(l->PC);
+            c.misses += l->misses;
+            if (bankOf(l->accessAddress) != banks[slowest]) continue;
+            c.memoryStallCycles += l->stallCycles;
+            if (queued) c.bankConflictCycles++;
+            queued = true;
+        }
+    }
+
+    if (accesses > 1) {
+        numOfGroupedAccesses += accesses;
+        numOfBankConflicts += accesses - banksUsed;
+    }
+
+    // -vpred: a load that would keep memory waiting can run on a predicted value instead
+    if (valuePredictor && longest > 1 && predictLoadValue(longest)) return false;
+
+    // -threads: a long wait sends the thread away rather than holding up the others, unless it is back for the same op
+    if (hardwareThreads.size() > 1) {
+        ThreadContext& thread = hardwareThreads.at(currentThread);
+        bool again = thread.replayPC == EX_PC;
+        thread.replayPC = -1;
+        if (!again && longest - 1 > SMT_SWITCH_LATENCY && switchOut(longest)) return true;
+    }
+
+    if (longest > 1) memoryStallCycles += longest - 1;
+    return false;
+}
+
+
 // Multiplexes the output of the EUs into a single line that the can then be written back
 void complete(){
+    PROFILE(PROFILE_COMPLETE);
+
     #pragma region State Setup
     // Prepare state for EX
     if (EX_State != Next) {
@@ -522,20 +1581,32 @@ void complete(){
 
         // Debugging/GUI to show the current instr in the processor
         C_inst = EX_inst;
+        C_PC = EX_PC;
+        C_OpCode = EX_OpCode;
+        C_Thread = EX_Thread;
     }
     #pragma endregion State Setup
 
+    switchThread(C_Thread);
+
     bool foundOutputFlag = false;
     writeBackFlag = false;
+    C_Group.clear();
 
     // ALU
     for (ALU* a : ALUs){
-        if (a->state == DONE){
+        if (a->outputFlag){
             C_OUT = a->OUT;
-            writeBackFlag = true;
+            writeBackFlag = a->writeBackFlag;      // Not for MULO (that only sets HI/LO) or anything predicated off
             WBD = a->DEST_OUT;
 
-            a->state = IDLE;
+            if (a->GUARD_CONDITION != NOP) {
+                numOfPredicated++;
+                if (a->predicatedOff) numOfPredicatedOff++;
+            }
+
+            a->outputFlag = false;
+            if (a->state == DONE) a->state = IDLE;
             
             foundOutputFlag = true;
             break;
@@ -543,76 +1614,71 @@ void complete(){
     }
     // BU
     if (!foundOutputFlag) for (BU* b : BUs){
-        if (b->state == DONE){
+        if (b->outputFlag){
+            // CALL writes the return address into the link register
+            if (b->writeBackFlag){
+                C_OUT = b->LINK;
+                WBD = b->DEST_OUT;
+                writeBackFlag = true;
+            }
+
+            if (b->OPCODE_OUT == RET){
+                if (b->branchFlag) numOfRASMisses++;
+                else               numOfRASHits++;
+            }
+
+            // Taken backward branches are what the loop buffer looks for
+            if (loopBuffer && b->taken && b->OUT <= b->PC_OUT) loopBuffer->backwardBranch(b->PC_OUT, b->OUT);
+
             if (b->branchFlag){
-                PC = b->OUT;
-                branchFlag = true;
+                PC = (int) b->OUT;
+                flushPipeline();
+                numOfFlushes++;
+                hardwareThreads.at(currentThread).numOfFlushes++;
+
+                // The new path is every stage in front of EX behind where the next instruction would have been
+                if (hotspots) {
+                    hotspots->at(b->PC_OUT).mispredicts++;
+                    hotspots->at(b->PC_OUT).flushCycles += refillCycles();
+                }
             }
-            b->state = IDLE;            
+            b->outputFlag = false;
+            if (b->state == DONE) b->state = IDLE;
             
             foundOutputFlag = true;
             break;
         }
     }
-    // LSU
+    // LSU - a memory group finishes together, the first one in it goes through C_OUT
     if (!foundOutputFlag) for (LSU* l : LSUs){
-        if (l->state == DONE){
-            C_OUT = l->OUT;
-            WBD = l->DEST_OUT;
+        if (l->outputFlag){
+            if (!foundOutputFlag) {
+                C_OUT = l->OUT;
+                WBD = l->DEST_OUT;
+                writeBackFlag = l->writeBackFlag;
+            } else {
+                C_Group.push_back({l->PC_OUT, l->OPCODE_OUT, l->writeBackFlag, l->DEST_OUT, l->OUT});
+                numOfGroupedMemoryOps++;
+            }
 
-            writeBackFlag = l->writeBackFlag;
-            l->state = IDLE;
+            l->outputFlag = false;
+            if (l->state == DONE) l->state = IDLE;
             
             foundOutputFlag = true;
-            break;
         }
     }
 
     C_State = Next;
 }
-/*
-// Memory access part of the pipeline: LD and STO operations access the memory here. Branches set the PC here
-void memoryAccess(){
-    #pragma region State Setup
-    // Prepare State for MA
-    if (EX_State != Next) {
-        // If IF is not ready to move on, then ID cannot progress (i.e. it is empty)
-        MA_State = Empty;
-
-        // Debugging/GUI to show that the current instruction is empty
-        MA_inst = string("");
-
-        // increments stall count
-        numOfStalls += 1;
-        return;
-    } else {
-        // Else it can run
-        MA_State = Current;
-
-        // Debugging/GUI to show the current instr in the processor
-        MA_inst = EX_inst;
-    }
-    #pragma endregion State Setup
-
-    // IF BRANCH RETURN
-    // Passes the instruction destination register or address along
-    WBD = MEMD; 
 
-    // We also need to pass along the writeBackFlag
-    writeBackFlag = MEM_writeBackFlag;
-
-    // Check if this instruction needs to access memory
-         if (memoryReadFlag == true)  MEM_OUT = dataMemory[ALU_OUT];
-    else if (memoryWriteFlag == true) dataMemory[MEMD] = ALU_OUT; 
-    else                      MEM_OUT = ALU_OUT;            // Not really needed, just ensures that all instructions have a regular 5-stage pipeline. HERE we could drop it down ot 4 to speed tings up but that might cause some issues with the line.
-    
-    //std::cout << "Memory Accessed... ";
-    MA_State = Next;
-}
-*/
 
 // Data written back into register file: Write backs don't occur on STO or HALT (or NOP)
 void writeBack(){
+    PROFILE(PROFILE_WRITE_BACK);
+
+    // -vpred: the load's own write back is the first that can be taken back, everything before it stands
+    if (loadSpeculation.active && loadSpeculation.writeBacksToLoad > 0 && --loadSpeculation.writeBacksToLoad == 0) loadSpeculation.registers = registerFile;
+
     #pragma region State Setup
     // Prepare State for WB
     if (C_State != Next) {
@@ -634,16 +1700,528 @@ void writeBack(){
     }
     #pragma endregion State Setup
 
-    cout << "WRITE BACK" << endl;
+    switchThread(C_Thread);
+
+    // The HALT is its thread's last instruction in the pipeline, so once nothing of the thread is in front of WB it has been written back
+    auto holdsThread = [](StageState state, int thread){ return state != Empty && thread == currentThread; };
+    bool inFlight = holdsThread(ID_State, ID_Thread) || holdsThread(I_State, I_Thread) || holdsThread(EX_State, EX_Thread);
+    for (const DecodeLatch& l : backEnd) inFlight = inFlight || holdsThread(l.state, l.thread);
+    if (haltPendingFlag && !inFlight) {
+        // Nothing halts on a load value that could still be wrong
+        if (loadSpeculation.active && !waitForLoadValue()) return;
+        haltThread();
+    }
+
+    *simulationLog << "WRITE BACK" << endl;
     if (writeBackFlag) {
-        std::cout << "Write back to index: " << WBD << " with value: " << C_OUT << std::endl;
+        *simulationLog << "Write back to index: " << WBD << " with value: " << C_OUT << std::endl;
         registerFile[WBD] = C_OUT;
+        if (journal) journal->recordRegister(WBD, C_OUT);
     }
-    
-    WB_State = Next;
-}
 
-#pragma endregion F/D/E/M/W/
+    retireOperation({C_PC, C_OpCode, writeBackFlag, WBD, C_OUT});
+
+    int retired = 1 + (C_OpCode >= CMPBZ && C_OpCode <= CMPBPO) + C_Group.size();
+    numOfRetired += retired;
+    hardwareThreads.at(currentThread).numOfRetired += retired;
+    if (loadSpeculation.active && loadSpeculation.writeBacksToLoad == 0) loadSpeculation.numOfRetired += retired;
+
+    if (hotspots) {
+        hotspots->at(C_PC).runs++;
+        hotspots->at(C_PC).slots++;
+        if (C_OpCode >= CMPBZ && C_OpCode <= CMPBPO) hotspots->at(C_PC + 1).runs++;
+        for (const RetiredOperation& g : C_Group) hotspots->at(g.PC).runs++;
+    }
+
+    // The rest of a memory group, in program order
+    for (const RetiredOperation& g : C_Group){
+        if (g.writeBack) {
+            *simulationLog << "Write back to index: " << g.WBD << " with value: " << g.OUT << std::endl;
+            registerFile[g.WBD] = g.OUT;
+            if (journal) journal->recordRegister(g.WBD, g.OUT);
+        }
+        retireOperation(g);
+    }
+    
+    WB_State = Next;
+}
+
+// -cosim: checks what the instruction writeBack() has just retired did against the reference model
+void checkRetirement(const RetiredOperation& retired){
+    ReferenceModel& reference = *referenceModel;
+
+    // NOPs do nothing, so -event moving the clock past them without retiring them is fine
+    while (!reference.halted && reference.PC != retired.PC && reference.opCodeAt(reference.PC) == NOP) reference.step();
+
+    if (reference.halted) {
+        reportDivergence("the reference model has already halted", retired, nullptr);
+        return;
+    }
+    if (reference.PC != retired.PC) {
+        reportDivergence("the reference model went to " + std::to_string(reference.PC) + " instead", retired, nullptr);
+        return;
+    }
+
+    ReferenceEffect expected;
+
+    try {
+        expected = reference.step();
+        // A fused op is the CMP and the branch after it, only the CMP writes anything
+        if (retired.opCode >= CMPBZ && retired.opCode <= CMPBPO) reference.step();
+    } catch (const std::exception& e) {
+        reportDivergence(e.what(), retired, nullptr);
+        return;
+    }
+
+    // Stores and OUT aren't written back but complete() still passes on the address/value
+    bool isStore = retired.opCode == STO || retired.opCode == STOI;
+    bool isOutput = retired.opCode == Instruction::OUT;
+
+    if (retired.writeBack != (expected.reg >= 0) || (retired.writeBack && (retired.WBD != expected.reg || retired.OUT != expected.regValue)))
+        reportDivergence("the register write differs", retired, &expected);
+    else if (isStore != (expected.address >= 0) || (isStore && (retired.WBD != expected.address || retired.OUT != expected.memValue)))
+        reportDivergence("the store differs", retired, &expected);
+    else if (isOutput && retired.OUT != expected.outValue)
+        reportDivergence("the value sent to OUT differs", retired, &expected);
+}
+
+// Halts the machine with everything needed to find out why the pipeline went wrong, expected is null if the reference
+// model never ran the instruction
+void reportDivergence(const std::string& problem, const RetiredOperation& retired, const ReferenceEffect* expected){
+    const ReferenceModel& reference = *referenceModel;
+    std::ostringstream report;
+
+    report << "\n---------- CO-SIMULATION DIVERGENCE ----------\n" << std::endl;
+    report << "Cycle " << numOfCycles << ": ";
+    if (hardwareThreads.size() > 1) report << "thread " << currentThread << " ";
+    report << "instruction " << retired.PC << " (" << WB_inst << ") retired, " << problem << std::endl;
+
+    report << "Pipeline wrote:        ";
+    if      (retired.writeBack)                                 report << "r" << retired.WBD << " = " << retired.OUT;
+    else if (retired.opCode == STO || retired.opCode == STOI)   report << "memory[" << retired.WBD << "] = " << retired.OUT;
+    else if (retired.opCode == Instruction::OUT)                report << "OUT " << retired.OUT;
+    else                                                        report << "nothing";
+    report << std::endl;
+
+    if (expected) {
+        report << "Reference model wrote: ";
+        if      (expected->reg >= 0)     report << "r" << expected->reg << " = " << expected->regValue;
+        else if (expected->address >= 0) report << "memory[" << expected->address << "] = " << expected->memValue;
+        else if (expected->output)       report << "OUT " << expected->outValue;
+        else                             report << "nothing";
+        report << std::endl;
+    }
+
+    report << "\nLast instructions the reference model ran (oldest first):" << std::endl;
+    for (int pc : reference.recentPCs()) {
+        if (pc >= 0) report << "  " << pc << "\t" << instrMemory.at(pc) << std::endl;
+    }
+
+    report << "\nRegister\tPipeline\tReference" << std::endl;
+    for (int i = 0; i < 16; i++) {
+        report << "R" << i << "\t\t" << registerFile.at(i) << "\t\t" << reference.registers.at(i);
+        if (registerFile.at(i) != reference.registers.at(i)) report << "\t<--";
+        report << std::endl;
+    }
+    report << "Checked " << reference.numOfInstructions << " instructions" << std::endl;
+
+    divergenceReport = report.str();
+    systemHaltFlag = true;
+}
+
+#pragma endregion F/D/E/M/W/
+
+
+#pragma region pipeline depth
+
+// -pipeline IF,IF,ID,I,EX,EX,MA,C,WB lists the stages an instruction goes through - IF, ID and EX can be split into
+// sub-stages, and an MA stage can go between EX and C. fetch() works in the first IF stage and decode() in the last ID
+// stage, the stages in between only hold what fetch got (frontEnd). The EUs finish an instruction in the last stage
+// before C - MA when there is one, which is where memory is accessed - so a slot goes through the other EX stages
+// (backEnd) between decode() and issue(). Every extra stage makes a mispredict cost a cycle more, and the ones after ID
+// also put WB a stage further from where registers are read, so programs need more instructions between a write and a read.
+
+void swapFetchLatch(FetchLatch& l){
+    std::swap(IF_State, l.state);
+    std::swap(IF_inst, l.inst);
+    std::swap(CIR, l.CIR);
+    std::swap(IF_PC, l.PC);
+    std::swap(IF_PredictedPC, l.predictedPC);
+    std::swap(IF_FromLoopBuffer, l.fromLoopBuffer);
+    std::swap(IF_Decoded, l.decoded);
+    std::swap(IF_Loops, l.loops);
+    std::swap(IF_ReturnAddresses, l.returnAddresses);
+    std::swap(IF_Thread, l.thread);
+}
+
+void swapDecodeLatch(DecodeLatch& l){
+    std::swap(ID_State, l.state);
+    std::swap(ID_inst, l.inst);
+    std::swap(ID_PC, l.PC);
+    std::swap(ID_PredictedPC, l.predictedPC);
+    std::swap(ID_Loops, l.loops);
+    std::swap(ID_ReturnAddresses, l.returnAddresses);
+    std::swap(ID_Thread, l.thread);
+    std::swap(ID_Group, l.group);
+    std::swap(OpCodeRegister, l.opCode);
+    std::swap(ALUD, l.dest);
+    std::swap(ALU0, l.in0);
+    std::swap(ALU1, l.in1);
+    std::swap(IMMEDIATE, l.immediate);
+    std::swap(ALUG, l.guard);
+    std::swap(GuardCondition, l.guardCondition);
+}
+
+// Moves everything in the IF/ID sub-stages on a stage - what fetch got last cycle goes in, and what comes out of the last
+// one goes into the IF/ID registers for decode()
+void advanceFrontEnd(){
+    if (frontEnd.empty()) return;
+    swapFetchLatch(frontEnd.back());
+    std::rotate(frontEnd.begin(), frontEnd.end() - 1, frontEnd.end());
+}
+
+// The same for the slots between decode() and issue()
+void advanceBackEnd(){
+    if (backEnd.empty()) return;
+    swapDecodeLatch(backEnd.back());
+    std::rotate(backEnd.begin(), backEnd.end() - 1, backEnd.end());
+}
+
+// The oldest instruction of the current thread fetch has got that decode hasn't seen yet, nullptr if there isn't one
+FetchLatch* fetchedNext(){
+    for (auto l = frontEnd.rbegin(); l != frontEnd.rend(); ++l) if (l->thread == currentThread) return &*l;
+    return nullptr;
+}
+
+// Fusion and memory groups take instructions after the one in decode into its slot, but only the thread's next one -
+// fetch has either got it already or is about to
+bool nextInstructionIs(int pc){
+    FetchLatch* next = fetchedNext();
+    return next ? next->state == Next && next->PC == pc : PC == pc;
+}
+
+// Takes the thread's next instruction into the slot in ID. If fetch has got it, it is taken out of its stage and fetch
+// carries on from where it already went after it. Otherwise fetch skips it and goes to predictedPC.
+void takeNextInstruction(int predictedPC){
+    FetchLatch* next = fetchedNext();
+    if (next) {
+        ID_PredictedPC = next->predictedPC;
+        next->state = Empty;
+        next->inst = "";
+        next->thread = -1;
+    } else {
+        ID_PredictedPC = predictedPC;
+
+        // With -imemlat it still has to come from instruction memory, fetch gets nothing after it until it has
+        int arrives = 0;
+        if (instructionMemoryModel) {
+            requestInstruction();
+            arrives = fetchArrives;
+        }
+        PC = predictedPC;
+        if (instructionMemoryModel) {
+            requestInstruction();
+            fetchArrives = std::max(fetchArrives, arrives);
+        }
+    }
+}
+
+// A LOOP or HALT in decode changes where the thread goes after it, which fetch only finds out now. Whatever of the thread
+// fetch has got since is thrown away and fetch starts again after the instruction, as it would have with one IF and ID stage.
+void refetchAfterDecode(){
+    bool found = false;
+    for (auto l = frontEnd.rbegin(); l != frontEnd.rend(); ++l){
+        if (l->thread != currentThread) continue;
+        if (!found) {
+            hardwareLoops = l->loops;
+            returnAddressStack.restore(l->returnAddresses);
+        }
+        found = true;
+        l->state = Empty;
+        l->inst = "";
+        l->thread = -1;
+    }
+    if (found) PC = ID_PredictedPC;
+}
+
+// IF, ID, I, EX, C and WB, as without -pipeline
+bool defaultPipeline(){
+    return FETCH_STAGES == 1 && DECODE_STAGES == 1 && EXECUTE_STAGES == 1 && !MEMORY_STAGE_FLAG;
+}
+
+// Sets the stage counts from a -pipeline list, a stage given more than once is split into that many
+void parsePipeline(const std::string& stages){
+    const std::vector<std::string> order = {"IF", "ID", "I", "EX", "MA", "C", "WB"};
+    const std::vector<int> most = {MAX_SUB_STAGES, MAX_SUB_STAGES, 1, MAX_SUB_STAGES, 1, 1, 1};
+    std::vector<int> counts(order.size(), 0);
+    std::string problem = "-pipeline needs IF, ID, I, EX, C and WB in that order, optionally MA before C, and only IF, ID and EX more than once (up to "
+        + std::to_string(MAX_SUB_STAGES) + " times): " + stages;
+
+    size_t k = 0;
+    for (const std::string& stage : split(stages, ',')){
+        while (k < order.size() && order.at(k) != stage) k++;
+        if (k == order.size()) throw std::invalid_argument(problem);
+        counts.at(k)++;
+    }
+    for (size_t s = 0; s < order.size(); s++){
+        if (counts.at(s) > most.at(s) || (counts.at(s) == 0 && order.at(s) != "MA")) throw std::invalid_argument(problem);
+    }
+
+    FETCH_STAGES = counts.at(0);
+    DECODE_STAGES = counts.at(1);
+    EXECUTE_STAGES = counts.at(3);
+    MEMORY_STAGE_FLAG = counts.at(4) > 0;
+}
+
+// The stages in order, numbered where one is split
+std::vector<std::string> pipelineStages(){
+    std::vector<std::string> stages;
+    auto add = [&stages](const std::string& name, int count){
+        for (int i = 1; i <= count; i++) stages.push_back(count > 1 ? name + std::to_string(i) : name);
+    };
+    add("IF", FETCH_STAGES);
+    add("ID", DECODE_STAGES);
+    add("I", 1);
+    add("EX", EXECUTE_STAGES);
+    add("MA", MEMORY_STAGE_FLAG);
+    add("C", 1);
+    add("WB", 1);
+    return stages;
+}
+
+// What is in each of pipelineStages()
+std::vector<std::string> pipelineContents(){
+    std::vector<std::string> contents = {IF_inst};
+    for (const FetchLatch& l : frontEnd) contents.push_back(l.inst);
+    contents.push_back(ID_inst);
+    for (const DecodeLatch& l : backEnd) contents.push_back(l.inst);
+    contents.insert(contents.end(), {I_inst, EX_inst, C_inst, WB_inst});
+    return contents;
+}
+
+// Cycles a mispredict costs - the new path is fetched as the branch goes into C, so it is as far behind as there are
+// stages in front of the one the branch was in (3 with the default pipeline)
+int refillCycles(){
+    return FETCH_STAGES + DECODE_STAGES + 1 + EXECUTE_STAGES + MEMORY_STAGE_FLAG - 1;
+}
+
+// How many instructions after one that writes a register an instruction can read it - the stages from ID to WB
+int readDistance(){
+    return 1 + EXECUTE_STAGES + MEMORY_STAGE_FLAG + 2;
+}
+
+#pragma endregion pipeline depth
+
+
+#pragma region hardware threads
+
+// -threads n runs n copies of the program on the one pipeline, each with its own registers, PC, data memory, return
+// address stack, hardware loops and loop buffer. Fetch takes one instruction a cycle from whichever thread the fetch
+// policy picks and the instructions of all the threads go down the pipeline together. A thread whose branch went the
+// wrong way only throws away its own instructions, and one that would keep memory waiting goes away for a while instead
+// of stalling everyone (switchOut()).
+
+void swapThreadState(ThreadContext& thread){
+    std::swap(registerFile, thread.registers);
+    std::swap(PC, thread.PC);
+    std::swap(ALUs.at(0)->HI, thread.HI);
+    std::swap(ALUs.at(0)->LO, thread.LO);
+    dataMemory.swap(thread.memory);
+    std::swap(returnAddressStack, thread.returnAddressStack);
+    std::swap(hardwareLoops, thread.hardwareLoops);
+    std::swap(loopBuffer, thread.loopBuffer);
+    std::swap(fetchTargets, thread.fetchTargets);
+    std::swap(referenceModel, thread.referenceModel);
+    std::swap(haltPendingFlag, thread.haltPending);
+}
+
+// Puts the current thread's state away and brings out another's, every stage calls it for the thread its instruction belongs to
+void switchThread(int thread){
+    if (thread == currentThread) return;
+    swapThreadState(hardwareThreads.at(currentThread));
+    swapThreadState(hardwareThreads.at(thread));
+    currentThread = thread;
+
+    // Threads don't share lines in the memory model, each has its own stretch of it
+    int span = (MEMORY_SIZE + DATA_CACHE_LINE_SIZE - 1) / DATA_CACHE_LINE_SIZE * DATA_CACHE_LINE_SIZE;
+    for (LSU* l : LSUs) l->addressSpace = thread * span;
+}
+
+// The thread fetch takes an instruction from this cycle, -1 if none can have one. Round robin goes through the threads
+// in turn, ICOUNT picks the one with the fewest instructions not yet executed (round robin between equals).
+int fetchThread(){
+    int n = hardwareThreads.size();
+    int best = -1;
+    int bestCount = 0;
+
+    for (int i = 1; i <= n; i++){
+        int t = (lastFetchedThread + i) % n;
+        const ThreadContext& thread = hardwareThreads.at(t);
+        bool haltPending = (t == currentThread) ? haltPendingFlag : thread.haltPending;
+        if (thread.halted || haltPending || thread.parkedUntil > numOfCycles) continue;
+
+        if (FETCH_POLICY == "roundrobin") {
+            best = t;
+            break;
+        }
+
+        // Fetch runs last, so what is between it and EX now is what hasn't been executed yet
+        int count = (ID_State == Next && ID_Thread == t) + (I_State == Next && I_Thread == t);
+        for (const FetchLatch& l : frontEnd)  count += l.state == Next && l.thread == t;
+        for (const DecodeLatch& l : backEnd) count += l.state == Next && l.thread == t;
+        if (best < 0 || count < bestCount) {
+            best = t;
+            bestCount = count;
+        }
+    }
+
+    if (best >= 0) lastFetchedThread = best;
+    return best;
+}
+
+// The current thread's HALT has been written back, the machine halts once every thread's has
+void haltThread(){
+    ThreadContext& thread = hardwareThreads.at(currentThread);
+    thread.halted = true;
+    thread.haltedIn = numOfCycles;
+    for (const ThreadContext& t : hardwareThreads) if (!t.halted) return;
+    systemHaltFlag = true;
+}
+
+// The memory slot in EX would keep memory waiting for longest cycles. Rather than freeze the pipeline for it, takes back
+// what the slot did, throws away the thread's younger instructions and lets fetch start the thread again from the slot
+// once the data is nearly there - the line is in the memory model by then so the second time round it hits. Returns
+// false if the slot has to stall as usual because it wrote to OUT, which can't be taken back.
+bool switchOut(int longest){
+    for (LSU* l : LSUs) if (l->outputFlag && l->OPCODE_OUT == Instruction::OUT) return false;
+
+    // Stores are put back newest first
+    for (auto l = LSUs.rbegin(); l != LSUs.rend(); ++l){
+        LSU* lsu = *l;
+        if (!lsu->outputFlag) continue;
+        if (lsu->accessedMemory && (lsu->OPCODE_OUT == STO || lsu->OPCODE_OUT == STOI)) dataMemory.at(lsu->accessAddress) = lsu->overwritten;
+        lsu->outputFlag = false;
+        lsu->state = IDLE;
+    }
+
+    flushPipeline();
+    PC = EX_PC;
+    hardwareLoops = EX_Loops;
+    returnAddressStack.restore(EX_ReturnAddresses);
+
+    // The stages in front of EX take refillCycles(), so the slot gets back to EX as the data arrives
+    ThreadContext& thread = hardwareThreads.at(currentThread);
+    thread.parkedUntil = numOfCycles + longest - 1 - refillCycles();
+    thread.replayPC = EX_PC;
+    thread.numOfSwitches++;
+    return true;
+}
+
+#pragma endregion hardware threads
+
+
+#pragma region load value prediction
+
+// -vpred. The memory slot in EX is a single load that would keep memory waiting for longest cycles. If the predictor is
+// sure of what it will read, the load writes that back instead and the pipeline carries on, the real value is checked
+// once the data would have arrived. Only one prediction is ever waiting to be checked. Returns true if it was predicted.
+bool predictLoadValue(int longest){
+    LSU* load = nullptr;
+    int ran = 0;
+    for (LSU* l : LSUs) if (l->outputFlag) { load = l; ran++; }
+    if (ran != 1 || (load->OPCODE_OUT != LD && load->OPCODE_OUT != LDD && load->OPCODE_OUT != LDA)) return false;
+
+    valuePredictor->numOfLoads++;
+    Word predicted;
+    if (loadSpeculation.active || !valuePredictor->predict(load->PC_OUT, predicted)) return false;
+    valuePredictor->numOfPredictions++;
+
+    LoadSpeculation& s = loadSpeculation;
+    s.active = true;
+    s.PC = load->PC_OUT;
+    s.loops = EX_Loops;
+    s.returnAddresses = EX_ReturnAddresses;
+    s.value = load->OUT;
+    s.predicted = predicted;
+    s.dataArrives = numOfCycles + longest - 1;
+    s.hidden = longest - 1;
+    s.writeBacksToLoad = 2;
+    s.HI = ALUs.at(0)->HI;
+    s.LO = ALUs.at(0)->LO;
+    s.stores.clear();
+    s.retired.clear();
+    s.numOfRetired = 0;
+    s.output.str("");
+    s.realOutput = load->output;
+    for (LSU* l : LSUs) l->output = &s.output;
+
+    load->OUT = predicted;
+    return true;
+}
+
+// What happens to an instruction once it has been written back, held back while it may have ran on a wrong load value
+void retireOperation(const RetiredOperation& retired){
+    if (loadSpeculation.active && loadSpeculation.writeBacksToLoad == 0) {
+        loadSpeculation.retired.push_back(retired);
+        return;
+    }
+
+    bool load = retired.opCode == LD || retired.opCode == LDD || retired.opCode == LDA;
+    if (valuePredictor && load && retired.writeBack) valuePredictor->train(retired.PC, retired.OUT);
+    if (referenceModel && divergenceReport.empty()) checkRetirement(retired);
+}
+
+// The predicted load's data has arrived. If the prediction was right everything that ran on it stands, if it was wrong
+// all of it is taken back and the load is fetched again - its line is in the memory model by now so it hits.
+// Returns true if it was right.
+bool resolveLoadValue(){
+    LoadSpeculation& s = loadSpeculation;
+    s.active = false;
+    for (LSU* l : LSUs) l->output = s.realOutput;
+
+    if (s.value == s.predicted) {
+        valuePredictor->numOfHiddenCycles += s.hidden;
+        *s.realOutput << s.output.str();
+        for (const RetiredOperation& r : s.retired) retireOperation(r);
+        return true;
+    }
+
+    valuePredictor->numOfMispredictions++;
+    valuePredictor->mispredicted(s.PC);
+
+    // Stores are put back newest first
+    for (auto st = s.stores.rbegin(); st != s.stores.rend(); ++st) dataMemory.at(st->first) = st->second;
+    registerFile = s.registers;
+    ALUs.at(0)->HI = s.HI;
+    ALUs.at(0)->LO = s.LO;
+    numOfRetired -= s.numOfRetired;
+    hardwareThreads.at(currentThread).numOfRetired -= s.numOfRetired;
+
+    // Everything still in the pipeline is younger than the load
+    flushPipeline();
+    EX_State = C_State = WB_State = Empty;
+    EX_inst = C_inst = WB_inst = "";
+    for (ALU* a : ALUs) { a->outputFlag = false; a->state = IDLE; }
+    for (BU*  b : BUs ) { b->outputFlag = false; b->state = IDLE; }
+    for (LSU* l : LSUs) { l->outputFlag = false; l->state = IDLE; }
+    C_Group.clear();
+    writeBackFlag = false;
+    memoryStallCycles = 0;
+
+    PC = s.PC;
+    hardwareLoops = s.loops;
+    returnAddressStack.restore(s.returnAddresses);
+    return false;
+}
+
+// A HALT can't be written back while the prediction might still be wrong, so the pipeline waits for the data there and
+// then. Returns true if the prediction was right.
+bool waitForLoadValue(){
+    if (numOfCycles < loadSpeculation.dataArrives) numOfCycles = loadSpeculation.dataArrives;
+    return resolveLoadValue();
+}
+
+#pragma endregion load value prediction
 
 
 #pragma region helperFunctions
@@ -656,26 +2234,207 @@ Register strToRegister(std::string str){
     return temp;
 }
 
+// Convert std::string to a Word, throws if it doesn't fit in one
+Word strToWord(std::string str){
+    long long value = stoll(str);
+    if (value != (Word) value) throw std::out_of_range("Value does not fit in a word: " + str);
+    return (Word) value;
+}
+
 // Not part of the ISA, loads an I/O program stored in a text file into 
-void loadProgramIntoMemory(std::string pathToProgram){
+// instruction memory and gives back the text (-intervals loads it again on every thread)
+std::string loadProgramIntoMemory(std::string pathToProgram){
     std::ifstream program(pathToProgram);
+    if (!program) throw std::invalid_argument("Cannot open program: " + pathToProgram);
+
+    std::stringstream text;
+    text << program.rdbuf();
+    loadProgramFromText(text.str());
+    return text.str();
+}
+
+// Loads a program that is already in memory, one instruction per line (CRLF or LF) - blank lines and // comments are skipped
+void loadProgramFromText(const std::string& text){
+    std::istringstream program(text);
     std::string line;
     int counter = 0;
 
-    while (!program.eof()){
-        if (counter >= 256){
+    while (std::getline(program, line)){
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line.compare(0, 2, "//") == 0) continue;
+
+        if (counter >= SIZE_OF_INSTRUCTION_MEMORY){
             throw std::invalid_argument("Program is too large for the memory space. Solution: inscrease memory space or run a smaller program");
-            break;
-        }
-        std::getline(program, line);
-        if (( !line.substr(0, line.length() - 1).empty() ) && ( line.substr(0,2).compare("//") != 0) ) {
-            instrMemory.at(counter) = line.substr(0, line.length() - 1);
-            counter++;
         }
+        instrMemory.at(counter) = line;
+        counter++;
     }
     amount_of_instruction_memory_to_output = counter - 1;
 }
 
+// Makes the EUs and whatever the flags ask for, once the program and its data are in memory
+void createMachine(){
+    for (ALU*& a : ALUs) a = new ALU();
+    for (BU*&  b : BUs)  b = new BU();
+    LSUs.assign(NUM_OF_LSUS, nullptr);
+    for (LSU*& l : LSUs) l = new LSU(&dataMemory);
+
+    // Data memory only takes time when there is a latency to model
+    if (MEMORY_LATENCY > 0) {
+        // With -threads it holds every thread's data memory one after the other, each starting on a line
+        int span = (MEMORY_SIZE + DATA_CACHE_LINE_SIZE - 1) / DATA_CACHE_LINE_SIZE * DATA_CACHE_LINE_SIZE;
+        dataMemoryModel = new MemoryModel(&numOfCycles, MEMORY_LATENCY, NUM_OF_THREADS == 1 ? MEMORY_SIZE : span * NUM_OF_THREADS);
+        dataMemoryModel->prefetcher = makePrefetcher(PREFETCHER_NAME);
+        for (LSU* l : LSUs) l->memoryModel = dataMemoryModel;
+    }
+
+    // Instruction memory the same, with lines of instructions, and a queue of fetch targets in front of it
+    if (INSTRUCTION_MEMORY_LATENCY > 0) {
+        instructionMemoryModel = new MemoryModel(&numOfCycles, INSTRUCTION_MEMORY_LATENCY, SIZE_OF_INSTRUCTION_MEMORY, INSTRUCTION_CACHE_LINE_SIZE, INSTRUCTION_CACHE_LINES);
+        if (FETCH_TARGET_QUEUE_SIZE > 0) fetchTargets = new FetchTargetQueue(FETCH_TARGET_QUEUE_SIZE, &instrMemory, instructionMemoryModel);
+    }
+
+    if (LOOP_BUFFER_FLAG) loopBuffer = new LoopBuffer();
+    valuePredictor = makeValuePredictor(VALUE_PREDICTOR_NAME);
+
+    // The debugger keeps a journal of every write so that it can go back in time
+    if (DEBUG_MODE_FLAG) {
+        journal = new Journal(&registerFile, &dataMemory, &PC);
+        for (LSU* l : LSUs) l->journal = journal;
+    }
+
+    // The reference model starts from the same program and data memory
+    if (ANNOTATE_FLAG) hotspots = new HotspotProfile(SIZE_OF_INSTRUCTION_MEMORY);
+
+    if (COSIM_FLAG) referenceModel = makeReferenceModel();
+
+    for (ALU* a : ALUs) a->logStream = simulationLog;
+    for (BU*  b : BUs)  b->logStream = simulationLog;
+    for (LSU* l : LSUs) l->logStream = simulationLog;
+
+    // -pipeline's extra stages, empty to start with
+    frontEnd.assign(FETCH_STAGES + DECODE_STAGES - 2, FetchLatch());
+    backEnd.assign(EXECUTE_STAGES + MEMORY_STAGE_FLAG - 1, DecodeLatch());
+
+    // Every thread starts the program from the beginning with its own registers and its own copy of data memory,
+    // thread 0's state is the one already in the globals
+    hardwareThreads.assign(NUM_OF_THREADS, ThreadContext());
+    currentThread = 0;
+    lastFetchedThread = NUM_OF_THREADS - 1;
+    for (size_t t = 1; t < hardwareThreads.size(); t++){
+        ThreadContext& thread = hardwareThreads.at(t);
+        thread.registers.fill(0);
+        thread.memory = dataMemory;
+        if (LOOP_BUFFER_FLAG) thread.loopBuffer = new LoopBuffer();
+        if (fetchTargets) thread.fetchTargets = new FetchTargetQueue(FETCH_TARGET_QUEUE_SIZE, &instrMemory, instructionMemoryModel);
+        if (COSIM_FLAG) thread.referenceModel = makeReferenceModel();
+    }
+}
+
+// A functional model of the program in instruction memory, starting from what is in data memory now
+ReferenceModel* makeReferenceModel(){
+    std::vector<DecodedInstruction> program;
+    std::vector<bool> valid;
+    for (const std::string& line : instrMemory) {
+        DecodedInstruction d;
+        bool ok = !line.empty();
+        if (ok) {
+            try { d = decodeInstruction(line); }
+            catch (const std::exception&) { ok = false; }
+        }
+        program.push_back(d);
+        valid.push_back(ok);
+    }
+    return new ReferenceModel(program, valid, dataMemory);
+}
+
+void destroyMachine(){
+    // The threads that aren't current have their own (the current one's are in the globals)
+    for (ThreadContext& thread : hardwareThreads) {
+        delete thread.loopBuffer;
+        delete thread.fetchTargets;
+        delete thread.referenceModel;
+    }
+    hardwareThreads.clear();
+    currentThread = 0;
+    frontEnd.clear();
+    backEnd.clear();
+
+    for (ALU*& a : ALUs) { delete a; a = nullptr; }
+    for (BU*&  b : BUs)  { delete b; b = nullptr; }
+    for (LSU*& l : LSUs) delete l;
+    LSUs.clear();
+    delete journal;
+    delete dataMemoryModel;
+    delete instructionMemoryModel;
+    delete fetchTargets;
+    delete loopBuffer;
+    delete referenceModel;
+    delete hotspots;
+    delete valuePredictor;
+    journal = nullptr;
+    referenceModel = nullptr;
+    hotspots = nullptr;
+    dataMemoryModel = nullptr;
+    instructionMemoryModel = nullptr;
+    fetchTargets = nullptr;
+    loopBuffer = nullptr;
+    valuePredictor = nullptr;
+    loadSpeculation.active = false;
+}
+
+// Puts every register, latch, memory and stat back to how it is when the simulator starts so another program can be ran
+// in the same process. The flags are kept, call createMachine() once the new program is loaded.
+void resetMachine(){
+    destroyMachine();
+
+    IF_State = ID_State = I_State = EX_State = C_State = WB_State = Empty;
+
+    registerFile.fill(0);
+    floatingPointRegisterFile.fill(0);
+    PC = 0;
+    CIR = "";
+    IF_PC = IF_PredictedPC = 0;
+    IF_FromLoopBuffer = false;
+    IF_Decoded = DecodedInstruction();
+    hardwareLoops = IF_Loops = ID_Loops = I_Loops = EX_Loops = HardwareLoopStack();
+    IF_ReturnAddresses = ID_ReturnAddresses = I_ReturnAddresses = EX_ReturnAddresses = ReturnAddressStack::Checkpoint();
+    IMMEDIATE = 0;
+    OpCodeRegister = NOP;
+    ALU0 = ALU1 = ALU_OUT = ALUD = ALUG = 0;
+    GuardCondition = NOP;
+    ID_PC = ID_PredictedPC = ID = CD = C_OUT = WBD = 0;
+    I_PC = EX_PC = C_PC = 0;
+    I_OpCode = EX_OpCode = C_OpCode = NOP;
+    IF_Thread = ID_Thread = I_Thread = EX_Thread = C_Thread = 0;
+
+    systemHaltFlag = haltPendingFlag = false;
+    memoryReadFlag = memoryWriteFlag = writeBackFlag = false;
+
+    instrMemory.fill("");
+    dataMemory.assign(MEMORY_SIZE, 0);
+    memoryStallCycles = 0;
+    fetchWaitPC = -1;
+    fetchArrives = 0;
+    returnAddressStack = ReturnAddressStack();
+    amount_of_instruction_memory_to_output = 8;
+
+    IF_inst = ID_inst = I_inst = EX_inst = C_inst = WB_inst = "EMPTY";
+
+    numOfCycles = 1;
+    numOfRetired = 0;
+    numOfBranches = numOfStalls = numOfFlushes = 0;
+    numOfRASHits = numOfRASMisses = 0;
+    numOfCompares = numOfFusions = 0;
+    numOfSkippedCycles = 0;
+    numOfPredicated = numOfPredicatedOff = 0;
+    numOfGroupedMemoryOps = numOfGroupedAccesses = numOfBankConflicts = 0;
+    numOfFetchStallCycles = 0;
+    ID_Group.clear();
+    C_Group.clear();
+    divergenceReport = "";
+}
+
 
 // Splits a string by a delminiter and returns it as a std::vector<std::string>
 std::vector<std::string> split(std::string str, char deliminator){
@@ -685,7 +2444,7 @@ std::vector<std::string> split(std::string str, char deliminator){
 
         if (str.length() == 0) return out;
 
-        for (int i = 0; i < str.length(); i++){
+        for (int i = 0; i < (int) str.length(); i++){
                 if ((str[i] == deliminator) && (oldIndex != i)){
                         out.push_back(str.substr(oldIndex, i - oldIndex));
                         oldIndex = i + 1;
@@ -699,6 +2458,9 @@ std::vector<std::string> split(std::string str, char deliminator){
 
 // Returns true if the syntax was successfully handled
 bool handleProgramFlags(int c, char** arguments){
+    // Nothing to run without a program
+    if (c < 2) return false;
+
     vector<string> args;
     // Makes the arguments memory safe and easier to handle
     for (int i = 0; i < c; i++){
@@ -707,27 +2469,1200 @@ bool handleProgramFlags(int c, char** arguments){
     if (count(args.begin(), args.end(), "-r") == 1 ) PRINT_REGISTERS_FLAG = true;
     if (count(args.begin(), args.end(), "-m") == 1 ) PRINT_MEMORY_FLAG = true;
     if (count(args.begin(), args.end(), "-s") == 1 ) PRINT_STATS_FLAG = true;
+    if (count(args.begin(), args.end(), "-d") == 1 ) DEBUG_MODE_FLAG = true;
+    if (count(args.begin(), args.end(), "-loopbuffer") == 1 ) LOOP_BUFFER_FLAG = true;
+    if (count(args.begin(), args.end(), "-nofuse") == 1 ) FUSION_FLAG = false;
+    if (count(args.begin(), args.end(), "-event") == 1 ) EVENT_DRIVEN_FLAG = true;
+    if (count(args.begin(), args.end(), "-cosim") == 1 ) COSIM_FLAG = true;
+    if (count(args.begin(), args.end(), "-annotate") == 1 ) ANNOTATE_FLAG = true;
+    if (count(args.begin(), args.end(), "-replay") == 1 ) REPLAY_FLAG = true;
+    if (count(args.begin(), args.end(), "-nocache") == 1 ) BYPASS_CACHE_FLAG = true;
+
+    // A flag's value has to be all number - stoll on its own takes 12abc as 12, and its errors don't say which flag it was
+    auto number = [&args](int i, long long largest){
+        size_t end = 0;
+        long long value = 0;
+        try { value = stoll(args.at(i + 1), &end); } catch (const std::logic_error&) { end = 0; }
+        if (end == 0 || end != args.at(i + 1).size() || value > largest || value < -largest)
+            throw std::invalid_argument(args.at(i) + " needs a number, not " + args.at(i + 1));
+        return value;
+    };
+
+    // Flags that take a value
+    for (int i = 2; i + 1 < c; i++){
+        if (args.at(i) == "-memlat")   MEMORY_LATENCY = (int) number(i, INT_MAX);
+        if (args.at(i) == "-memsize")  MEMORY_SIZE = (int) number(i, INT_MAX);
+        if (args.at(i) == "-prefetch") PREFETCHER_NAME = args.at(i + 1);
+        if (args.at(i) == "-vpred")    VALUE_PREDICTOR_NAME = args.at(i + 1);
+        if (args.at(i) == "-imemlat")  INSTRUCTION_MEMORY_LATENCY = (int) number(i, INT_MAX);
+        if (args.at(i) == "-ftq")      FETCH_TARGET_QUEUE_SIZE = (int) number(i, INT_MAX);
+        if (args.at(i) == "-load")     DATA_FILES.push_back(args.at(i + 1));
+        if (args.at(i) == "-out")      OUTPUT_FILE = args.at(i + 1);
+        if (args.at(i) == "-lsus")     NUM_OF_LSUS = (int) number(i, INT_MAX);
+        if (args.at(i) == "-banks")    NUM_OF_BANKS = (int) number(i, INT_MAX);
+        if (args.at(i) == "-interleave") BANK_INTERLEAVE = (int) number(i, INT_MAX);
+        if (args.at(i) == "-intervals") NUM_OF_INTERVALS = (int) number(i, INT_MAX);
+        if (args.at(i) == "-warmup")   WARMUP_INSTRUCTIONS = number(i, LLONG_MAX);
+        if (args.at(i) == "-record")   RECORD_FILE = args.at(i + 1);
+        if (args.at(i) == "-cache")    CACHE_DIRECTORY = args.at(i + 1);
+        if (args.at(i) == "-cachelimit") CACHE_LIMIT = number(i, LLONG_MAX);
+        if (args.at(i) == "-threads")  NUM_OF_THREADS = (int) number(i, INT_MAX);
+        if (args.at(i) == "-smtfetch") FETCH_POLICY = args.at(i + 1);
+        if (args.at(i) == "-pipeline") parsePipeline(args.at(i + 1));
+    }
 
+    if (MEMORY_SIZE <= 0) throw std::invalid_argument("-memsize needs at least one word");
+    if (NUM_OF_LSUS < 1 || NUM_OF_LSUS > MAX_LSUS) throw std::invalid_argument("-lsus needs between 1 and " + std::to_string(MAX_LSUS) + " LSUs");
+    if (NUM_OF_BANKS < 1) throw std::invalid_argument("-banks needs at least one bank");
+    if (BANK_INTERLEAVE < 1) throw std::invalid_argument("-interleave needs at least one word per bank");
+    if (NUM_OF_INTERVALS < 0 || WARMUP_INSTRUCTIONS < 0) throw std::invalid_argument("-intervals and -warmup can't be negative");
+    if (NUM_OF_INTERVALS > 0 && (DEBUG_MODE_FLAG || PRINT_REGISTERS_FLAG || ANNOTATE_FLAG))
+        throw std::invalid_argument("-intervals can't be used with -d, -r or -annotate");
+    if ((REPLAY_FLAG || !RECORD_FILE.empty()) && (DEBUG_MODE_FLAG || PRINT_REGISTERS_FLAG || ANNOTATE_FLAG || COSIM_FLAG || NUM_OF_INTERVALS > 0))
+        throw std::invalid_argument("-record and -replay can't be used with -d, -r, -annotate, -cosim or -intervals");
+    if (REPLAY_FLAG && (!RECORD_FILE.empty() || PRINT_MEMORY_FLAG || !DATA_FILES.empty()))
+        throw std::invalid_argument("-replay only times a trace, it can't be used with -record, -m or -load");
+    if (CACHE_LIMIT < 0) throw std::invalid_argument("-cachelimit can't be negative");
+    if (!CACHE_DIRECTORY.empty() && (DEBUG_MODE_FLAG || PRINT_REGISTERS_FLAG || ANNOTATE_FLAG || NUM_OF_INTERVALS > 0 || REPLAY_FLAG || !RECORD_FILE.empty()))
+        throw std::invalid_argument("-cache only keeps whole runs, it can't be used with -d, -r, -annotate, -intervals, -record or -replay");
+    if (NUM_OF_THREADS < 1 || NUM_OF_THREADS > MAX_THREADS) throw std::invalid_argument("-threads needs between 1 and " + std::to_string(MAX_THREADS) + " threads");
+    if (FETCH_POLICY != "roundrobin" && FETCH_POLICY != "icount") throw std::invalid_argument("Unknown fetch policy: " + FETCH_POLICY);
+    if (NUM_OF_THREADS > 1 && (DEBUG_MODE_FLAG || PRINT_REGISTERS_FLAG || ANNOTATE_FLAG || EVENT_DRIVEN_FLAG || NUM_OF_INTERVALS > 0 || REPLAY_FLAG || !RECORD_FILE.empty()))
+        throw std::invalid_argument("-threads can't be used with -d, -r, -annotate, -event, -intervals, -record or -replay");
+    if (REPLAY_FLAG && !defaultPipeline())
+        throw std::invalid_argument("-replay only times the default pipeline, it can't be used with -pipeline");
+    if (VALUE_PREDICTOR_NAME != "none" && (DEBUG_MODE_FLAG || ANNOTATE_FLAG || NUM_OF_THREADS > 1 || REPLAY_FLAG))
+        throw std::invalid_argument("-vpred can't be used with -d, -annotate, -threads or -replay");
+    if (INSTRUCTION_MEMORY_LATENCY < 0 || FETCH_TARGET_QUEUE_SIZE < 0) throw std::invalid_argument("-imemlat and -ftq can't be negative");
+    if (FETCH_TARGET_QUEUE_SIZE > 0 && INSTRUCTION_MEMORY_LATENCY == 0) throw std::invalid_argument("-ftq only prefetches instructions, it needs -imemlat");
+    if (INSTRUCTION_MEMORY_LATENCY > 0 && REPLAY_FLAG) throw std::invalid_argument("-replay fetches from the trace, it can't be used with -imemlat");
+    if (MEMORY_LATENCY < 0) throw std::invalid_argument("-memlat can't be negative");
+    if (PREFETCHER_NAME != "none" && MEMORY_LATENCY == 0) throw std::invalid_argument("-prefetch only prefetches into the data cache, it needs -memlat");
+
+    // Names are checked by building what they name, rather than finding out once the program has loaded
+    delete makePrefetcher(PREFETCHER_NAME);
+    delete makeValuePredictor(VALUE_PREDICTOR_NAME);
     return true;
 }
 
+// Maps a binary file of Words (host byte order, 4 or 8 bytes each depending on the build) and puts it into data memory starting at the address after the '@'
+void loadDataFile(std::string fileAndAddress){
+    size_t at = fileAndAddress.rfind('@');
+    if (at == std::string::npos) throw std::invalid_argument("-load needs file@address, not " + fileAndAddress);
+    std::string path = fileAndAddress.substr(0, at);
+
+    // As the flags' numbers - all of it has to be the address
+    std::string addressText = fileAndAddress.substr(at + 1);
+    size_t end = 0;
+    long long address = -1;
+    try { address = stoll(addressText, &end); } catch (const std::logic_error&) { end = 0; }
+    if (end == 0 || end != addressText.size() || address < 0)
+        throw std::invalid_argument("-load needs file@address, not " + fileAndAddress);
+
+    int file = open(path.c_str(), O_RDONLY);
+    if (file < 0) throw std::invalid_argument("Cannot open data file: " + path);
+
+    struct stat info;
+    if (fstat(file, &info) != 0) {
+        close(file);
+        throw std::invalid_argument("Cannot read the size of data file: " + path);
+    }
+    if (info.st_size % sizeof(Word) != 0) {
+        close(file);
+        throw std::invalid_argument("Data file is not a whole number of " + std::to_string(sizeof(Word)) + " byte words: " + path);
+    }
+    size_t words = info.st_size / sizeof(Word);
+    if ((size_t) address + words > dataMemory.size()) {
+        close(file);
+        throw std::invalid_argument("Data file does not fit in data memory: " + path);
+    }
+
+    // Data memory is allocated up front so the mapping is copied once rather than read through a stream
+    if (words > 0) {
+        void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (mapping == MAP_FAILED) {
+            close(file);
+            throw std::invalid_argument("Cannot map data file: " + path);
+        }
+        std::memcpy(&dataMemory.at(address), mapping, words * sizeof(Word));
+        munmap(mapping, info.st_size);
+    }
+    close(file);
+}
+
+// The numbers -s prints by the names isa_counter() takes, -1 if the name is unknown
+long long readCounter(const std::string& counter){
+    if (counter == "instructions")   return numOfRetired;
+    if (counter == "cycles")         return numOfCycles;
+    if (counter == "branches")       return numOfBranches;
+    if (counter == "stalls")         return numOfStalls;
+    if (counter == "flushes")        return numOfFlushes;
+    if (counter == "ras_hits")       return numOfRASHits;
+    if (counter == "ras_misses")     return numOfRASMisses;
+    if (counter == "compares")       return numOfCompares;
+    if (counter == "fusions")        return numOfFusions;
+    if (counter == "skipped_cycles") return numOfSkippedCycles;
+    if (counter == "predicated")     return numOfPredicated;
+    if (counter == "predicated_off") return numOfPredicatedOff;
+    if (counter == "grouped_memory_ops") return numOfGroupedMemoryOps;
+    if (counter == "bank_conflicts") return numOfBankConflicts;
+    if (counter == "hardware_loops") return hardwareLoops.numOfLoops;
+    if (counter == "hardware_loop_back_edges") return hardwareLoops.numOfBackEdges;
+    if (counter == "checked_instructions") return referenceModel ? referenceModel->numOfInstructions : 0;
+
+    // Parts that aren't there count nothing
+    if (counter == "loop_buffer_hits")    return loopBuffer ? loopBuffer->numOfHits : 0;
+    if (counter == "loop_buffer_misses")  return loopBuffer ? loopBuffer->numOfMisses : 0;
+    if (counter == "memory_accesses")     return dataMemoryModel ? dataMemoryModel->numOfAccesses : 0;
+    if (counter == "memory_misses")       return dataMemoryModel ? dataMemoryModel->numOfMisses : 0;
+    if (counter == "memory_stall_cycles") return dataMemoryModel ? dataMemoryModel->numOfStallCycles : 0;
+    if (counter == "prefetches")          return dataMemoryModel ? dataMemoryModel->numOfPrefetches : 0;
+    if (counter == "useful_prefetches")   return dataMemoryModel ? dataMemoryModel->numOfUsefulPrefetches : 0;
+    if (counter == "value_predictions")   return valuePredictor ? valuePredictor->numOfPredictions : 0;
+    if (counter == "value_mispredictions") return valuePredictor ? valuePredictor->numOfMispredictions : 0;
+    if (counter == "instruction_misses")  return instructionMemoryModel ? instructionMemoryModel->numOfMisses : 0;
+    if (counter == "fetch_stall_cycles")  return numOfFetchStallCycles;
+    if (counter == "instruction_prefetches") return instructionMemoryModel ? instructionMemoryModel->numOfPrefetches : 0;
+    if (counter == "fetch_resteers")      return fetchTargets ? fetchTargets->numOfResteers : 0;
+    return -1;
+}
+
 #pragma endregion helperFunctions
 
 
-int main(int argc, char** argv){    
-    if (!handleProgramFlags(argc, argv)) {
-        std::cout << "Usage: ./isa <program_name> -r|m" << std::endl;
-        return 0;
+#pragma region interval simulation
+
+// -intervals n runs the program functionally twice on this thread - once to find out how many instructions it is, once
+// to take a checkpoint in front of every interval - then simulates the n intervals in detail at the same time, one thread
+// each. A thread starts WARMUP_INSTRUCTIONS before its interval so the caches, prefetcher, RAS and loop buffer aren't cold
+// when it starts counting, and the counters it gives back are the difference between the start and the end of the interval.
+
+// Stitched together for the whole run - the same names as isa_counter()
+const std::vector<std::string> STITCHED_COUNTERS = {
+    "instructions", "cycles", "branches", "stalls", "flushes", "ras_hits", "ras_misses", "compares", "fusions",
+    "skipped_cycles", "predicated", "predicated_off", "grouped_memory_ops", "bank_conflicts", "hardware_loops",
+    "hardware_loop_back_edges", "checked_instructions", "loop_buffer_hits", "loop_buffer_misses", "memory_accesses",
+    "memory_misses", "memory_stall_cycles", "prefetches", "useful_prefetches", "value_predictions", "value_mispredictions",
+    "instruction_misses", "fetch_stall_cycles", "instruction_prefetches", "fetch_resteers"
+};
+
+// The flags are thread_local, so every thread needs its own copy of the ones the machine is built from
+struct MachineSettings {
+    int memorySize = MEMORY_SIZE;
+    int memoryLatency = MEMORY_LATENCY;
+    std::string prefetcher = PREFETCHER_NAME;
+    std::string valuePredictor = VALUE_PREDICTOR_NAME;
+    int instructionMemoryLatency = INSTRUCTION_MEMORY_LATENCY;
+    int fetchTargetQueue = FETCH_TARGET_QUEUE_SIZE;
+    int lsus = NUM_OF_LSUS;
+    int banks = NUM_OF_BANKS;
+    int interleave = BANK_INTERLEAVE;
+    bool eventDriven = EVENT_DRIVEN_FLAG;
+    bool loopBuffer = LOOP_BUFFER_FLAG;
+    bool fusion = FUSION_FLAG;
+    bool cosim = COSIM_FLAG;
+    int fetchStages = FETCH_STAGES;
+    int decodeStages = DECODE_STAGES;
+    int executeStages = EXECUTE_STAGES;
+    bool memoryStage = MEMORY_STAGE_FLAG;
+
+    void apply() const {
+        MEMORY_SIZE = memorySize;
+        MEMORY_LATENCY = memoryLatency;
+        PREFETCHER_NAME = prefetcher;
+        VALUE_PREDICTOR_NAME = valuePredictor;
+        INSTRUCTION_MEMORY_LATENCY = instructionMemoryLatency;
+        FETCH_TARGET_QUEUE_SIZE = fetchTargetQueue;
+        NUM_OF_LSUS = lsus;
+        NUM_OF_BANKS = banks;
+        BANK_INTERLEAVE = interleave;
+        EVENT_DRIVEN_FLAG = eventDriven;
+        LOOP_BUFFER_FLAG = loopBuffer;
+        FUSION_FLAG = fusion;
+        COSIM_FLAG = cosim;
+        FETCH_STAGES = fetchStages;
+        DECODE_STAGES = decodeStages;
+        EXECUTE_STAGES = executeStages;
+        MEMORY_STAGE_FLAG = memoryStage;
+    }
+};
+
+struct Interval {
+    Checkpoint from;                // Where the thread starts, `warmup` instructions before the interval
+    long long start = 0;            // First instruction of the interval
+    long long length = 0;           // Instructions in it, the last interval is whatever is left up to the HALT
+    long long warmup = 0;
+
+    // The warm-up error is measured on the instructions just before the interval: the thread before has ran them warm
+    // at the end of its interval, this one runs them at the end of its warm-up
+    long long overlap = 0;          // Instructions at the end of the warm-up the interval before also ran
+    long long nextOverlap = 0;      // ... and at the end of the interval, for the next one
+    long long overlapCycles = 0;    // Cycles this thread took for its `overlap`
+    long long tailCycles = 0;       // ... and for its `nextOverlap`
+
+    std::vector<long long> atStart; // STITCHED_COUNTERS when the interval starts ...
+    std::vector<long long> atEnd;   // ... and when it ends
+    double hostMilliseconds = 0;
+    std::string error;              // What went wrong, or the divergence report
+};
+
+// Runs one interval on the thread it is called from
+void simulateInterval(const std::string& programText, const MachineSettings& settings, Interval& interval){
+    auto hostStart = std::chrono::steady_clock::now();
+
+    try {
+        settings.apply();
+        simulationLog = &silentLog;
+        resetMachine();
+        loadProgramFromText(programText);
+        dataMemory = interval.from.memory;
+        createMachine();
+
+        // The fast-forward has already written what OUT gives
+        for (LSU* l : LSUs) l->output = &silentLog;
+
+        registerFile = interval.from.registers;
+        ALUs.at(0)->HI = interval.from.HI;
+        ALUs.at(0)->LO = interval.from.LO;
+        hardwareLoops = interval.from.loops;
+        PC = interval.from.PC;
+        if (referenceModel) referenceModel->restore(interval.from);
+
+        auto runTo = [](long long instructions){
+            while (!systemHaltFlag && numOfRetired < instructions) step<false>();
+        };
+        auto snapshot = [](std::vector<long long>& counters){
+            for (const std::string& name : STITCHED_COUNTERS) counters.push_back(readCounter(name));
+        };
+
+        runTo(interval.warmup - interval.overlap);
+        long long overlapStart = numOfCycles;
+        runTo(interval.warmup);
+        interval.overlapCycles = numOfCycles - overlapStart;
+        snapshot(interval.atStart);
+
+        runTo(interval.warmup + interval.length - interval.nextOverlap);
+        long long tailStart = numOfCycles;
+        runTo(interval.warmup + interval.length);
+        interval.tailCycles = numOfCycles - tailStart;
+        snapshot(interval.atEnd);
+
+        if (!divergenceReport.empty()) interval.error = divergenceReport;
+        destroyMachine();
+    } catch (const std::exception& e) {
+        interval.error = e.what();
+    }
+
+    interval.hostMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - hostStart).count();
+}
+
+// -intervals, with the program and its data already loaded. Returns the exit status like main() does.
+int runIntervals(const std::string& programText, std::ostream& output){
+    if (PRINT_MEMORY_FLAG) outputAllMemory(amount_of_instruction_memory_to_output);
+    auto fastForwardStart = std::chrono::steady_clock::now();
+
+    // How long the program is - OUT is written here, the intervals don't write anything
+    ReferenceModel* functional = makeReferenceModel();
+    while (!functional->halted) {
+        ReferenceEffect effect = functional->step();
+        if (effect.output) output << effect.outValue << "\n";
+    }
+    output.flush();
+    long long total = functional->numOfInstructions;
+    Checkpoint finalState = functional->checkpoint();
+    delete functional;
+
+    // Equal intervals, each warmed up on the instructions in front of it if there are that many
+    int count = (int) std::min<long long>(NUM_OF_INTERVALS, total);
+    std::vector<Interval> intervals(count);
+    for (int i = 0; i < count; i++) {
+        Interval& interval = intervals.at(i);
+        interval.start = total * i / count;
+        interval.length = total * (i + 1) / count - interval.start;
+        interval.warmup = std::min(WARMUP_INSTRUCTIONS, interval.start);
+        if (i > 0) {
+            interval.overlap = std::min(interval.warmup, intervals.at(i - 1).length);
+            intervals.at(i - 1).nextOverlap = interval.overlap;
+        }
+    }
+
+    // Checkpoints, in order since the warm-ups start in order
+    functional = makeReferenceModel();
+    for (Interval& interval : intervals) {
+        while (functional->numOfInstructions < interval.start - interval.warmup) functional->step();
+        interval.from = functional->checkpoint();
+    }
+    delete functional;
+
+    double fastForwardMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - fastForwardStart).count();
+    auto detailedStart = std::chrono::steady_clock::now();
+
+    // No more threads than the host has cores, each takes the next interval nobody has started until they are all done
+    MachineSettings settings;
+    int workers = (int) std::min<unsigned>(std::max(1u, std::thread::hardware_concurrency()), count);
+    std::atomic<int> nextInterval(0);
+    std::vector<std::thread> threads;
+    for (int w = 0; w < workers; w++) threads.emplace_back([&](){
+        for (int i = nextInterval++; i < count; i = nextInterval++) simulateInterval(programText, settings, intervals.at(i));
+    });
+    for (std::thread& t : threads) t.join();
+
+    double detailedMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - detailedStart).count();
+
+    for (int i = 0; i < count; i++) {
+        if (intervals.at(i).error.empty()) continue;
+        std::cout << "Interval " << i << ": " << intervals.at(i).error << std::endl;
+        return 1;
+    }
+
+    // The counters start where the first interval did (cycle 1) and every interval adds what it counted
+    std::vector<long long> totals = intervals.at(0).atStart;
+    for (const Interval& interval : intervals)
+        for (size_t c = 0; c < totals.size(); c++) totals.at(c) += interval.atEnd.at(c) - interval.atStart.at(c);
+
+    // Cold = the overlaps at the end of the warm-ups, warm = the same instructions at the end of the interval before
+    long long coldCycles = 0, warmCycles = 0;
+    for (int i = 1; i < count; i++) {
+        coldCycles += intervals.at(i).overlapCycles;
+        warmCycles += intervals.at(i - 1).tailCycles;
+    }
+
+    // The machine is left how the program left it, for -m
+    dataMemory = finalState.memory;
+    registerFile = finalState.registers;
+    if (PRINT_MEMORY_FLAG) outputAllMemory(amount_of_instruction_memory_to_output);
+
+    cout << "\n\n---------- INTERVAL SIMULATION ----------\n" << endl;
+    cout << "Fast-forwarded " << total << " instructions in:\t\t" << fastForwardMilliseconds << " ms" << endl;
+    cout << "Simulated " << count << " intervals on " << workers << " threads in:\t\t" << detailedMilliseconds << " ms\n" << endl;
+
+    cout << std::right << std::setw(9) << "Interval" << std::setw(12) << "Start" << std::setw(14) << "Instructions"
+         << std::setw(10) << "Warm-up" << std::setw(12) << "Cycles" << std::setw(8) << "IPC" << std::setw(10) << "Host ms" << endl;
+    for (int i = 0; i < count; i++) {
+        const Interval& interval = intervals.at(i);
+        long long cycles = interval.atEnd.at(1) - interval.atStart.at(1);
+        cout << std::setw(9) << i << std::setw(12) << interval.start << std::setw(14) << interval.length << std::setw(10) << interval.warmup
+             << std::setw(12) << cycles << std::fixed << std::setprecision(3) << std::setw(8) << (cycles ? (double) interval.length / cycles : 0)
+             << std::setprecision(1) << std::setw(10) << interval.hostMilliseconds << endl;
+        cout.unsetf(std::ios::fixed);
+        cout << std::setprecision(6);
+    }
+
+    if (count > 1) {
+        cout << "\nWarm-up error (cycles cold/warm for the last instructions of each warm-up):\t\t" << coldCycles << "/" << warmCycles
+             << " (" << (warmCycles ? 100.0 * (coldCycles - warmCycles) / warmCycles : 0) << "%)" << endl;
+    }
+
+    cout << "\nTotal number of cycles:\t\t" << totals.at(1) << endl;
+    cout << "Total number of instructions:\t\t" << totals.at(0) << endl;
+    if (PRINT_STATS_FLAG) {
+        cout << "\nStitched counters:" << endl;
+        for (size_t c = 2; c < totals.size(); c++) cout << "  " << STITCHED_COUNTERS.at(c) << ":\t\t" << totals.at(c) << endl;
+    }
+
+    // Only prints anything when built with -DISA_PROFILE - the interval threads have all exited, warm-ups included
+    long long simulatedCycles = 0;
+    for (const Interval& interval : intervals) simulatedCycles += interval.atEnd.at(1);
+    printProfile(simulatedCycles);
+
+    return 0;
+}
+
+#pragma endregion interval simulation
+
+
+#pragma region trace replay
+
+// -record runs the program on the reference model and writes down what each instruction did (Trace.hpp). -replay then
+// times that trace without running anything - the stages below are the ones above cut down to what decides how long
+// things take. A slot carries its trace records instead of operand values and text, so nothing is parsed per instruction
+// and no EU runs. Fetch still follows its own predictions, down the wrong path until the branch that sent it there
+// completes, so the RAS, loop buffer, flushes and memory model see what they would in a normal run.
+
+// A line of the program, decoded once
+struct ReplayInstruction {
+    DecodedInstruction decoded;
+    bool valid = false;                 // Empty, or nothing decode would take
+};
+
+// What is in a stage of the replayed pipeline
+struct ReplaySlot {
+    bool valid = false;                 // false = the stage is Empty
+    int PC = 0;
+    Instruction opCode = NOP;           // CMPBZ/CMPBNE/CMPBPO once fused
+    bool fromLoopBuffer = false;
+    bool wrongPath = false;             // Fetched behind a branch fetch got wrong - thrown away before it runs
+    bool mispredicted = false;          // Fetch went somewhere else after it, complete() sends it to nextPC
+    int nextPC = -1;                    // Where the program went after it
+    int retired = 0;                    // Trace records in it (both halves of a fused op, the whole of a memory group)
+    int memoryOps = 0;                  // LSU ops in it ...
+    int accesses = 0;                   // ... and the ones that go to data memory
+    std::array<int, MAX_LSUS> accessPCs;
+    std::array<Word, MAX_LSUS> accessAddresses;
+    Word loopCount = 0;
+    bool guarded = false;
+    bool predicatedOff = false;
+    HardwareLoopStack loops;            // From before it was fetched, like IF_Loops
+    ReturnAddressStack::Checkpoint returnAddresses;
+};
+
+thread_local TraceReader* traceReader = nullptr;
+thread_local std::vector<ReplayInstruction> replayProgram;
+thread_local ReplaySlot replayIF, replayID, replayI, replayEX, replayC;
+thread_local bool replayWrongPath = false;          // Fetch has gone past a branch it got wrong
+
+TraceKind traceKindOf(const DecodedInstruction& d){
+    if (d.guard >= 0) return TRACE_GUARDED;
+    switch (d.opCode){
+        case LD: case LDD: case LDA: case STO: case STOI: return TRACE_ACCESS;
+        case LOOP: return TRACE_LOOP;
+        default:   return TRACE_PLAIN;
+    }
+}
+
+// -record: runs the program in instruction memory on the reference model and writes its trace to path
+int recordTrace(const std::string& path, std::ostream& output){
+    auto hostStart = std::chrono::steady_clock::now();
+
+    int lines = SIZE_OF_INSTRUCTION_MEMORY;
+    while (lines > 0 && instrMemory.at(lines - 1).empty()) lines--;
+
+    std::vector<std::string> program(instrMemory.begin(), instrMemory.begin() + lines);
+    std::vector<TraceKind> kinds;
+    for (const std::string& line : program) {
+        TraceKind kind = TRACE_PLAIN;
+        if (!line.empty()) {
+            try { kind = traceKindOf(decodeInstruction(line)); }
+            catch (const std::exception&) {}
+        }
+        kinds.push_back(kind);
+    }
+
+    if (PRINT_MEMORY_FLAG) outputAllMemory(amount_of_instruction_memory_to_output);
+
+    ReferenceModel* functional = makeReferenceModel();
+    TraceWriter writer(path, program, kinds);
+    while (!functional->halted) {
+        TraceRecord r;
+        r.PC = functional->PC;
+        ReferenceEffect effect = functional->step();
+        if (effect.output) output << effect.outValue << "\n";
+
+        switch (kinds.at(r.PC)){
+            case TRACE_ACCESS:  r.value = effect.address >= 0 ? effect.address : effect.loaded; break;
+            case TRACE_LOOP:    r.value = effect.loopCount; break;
+            case TRACE_GUARDED: r.predicatedOff = effect.predicatedOff; break;
+            default: break;
+        }
+        writer.write(r);
+    }
+    writer.close();
+    output.flush();
+
+    dataMemory = functional->memory;
+    registerFile = functional->registers;
+    delete functional;
+
+    double hostMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - hostStart).count();
+    if (PRINT_MEMORY_FLAG) outputAllMemory(amount_of_instruction_memory_to_output);
+
+    cout << "\nRecorded " << writer.numOfRecords << " instructions into " << path << " in " << hostMilliseconds << " ms" << endl;
+    cout << "Trace size:\t\t" << writer.numOfBytes << " bytes (" << (writer.numOfRecords ? 8.0 * writer.numOfBytes / writer.numOfRecords : 0) << " bits per instruction)" << endl;
+    return 0;
+}
+
+// Hands the next trace record to the slot that the instruction at pc went into
+void takeRecord(ReplaySlot& slot, int pc){
+    if (!traceReader->more() || traceReader->peek().PC != pc)
+        throw std::invalid_argument("Trace doesn't follow its program at PC " + std::to_string(pc));
+
+    TraceRecord r = traceReader->next();
+    switch (traceReader->kinds.at(pc)){
+        case TRACE_ACCESS:
+            slot.accessPCs[slot.accesses] = pc;
+            slot.accessAddresses[slot.accesses] = r.value;
+            slot.accesses++;
+            break;
+        case TRACE_LOOP:    slot.loopCount = r.value; break;
+        case TRACE_GUARDED: slot.predicatedOff = r.predicatedOff; break;
+        default: break;
+    }
+
+    slot.retired++;
+    slot.nextPC = traceReader->more() ? traceReader->peek().PC : -1;
+}
+
+// As flushPipeline()
+void replayFlush(){
+    const ReplaySlot& oldest = replayI.valid ? replayI : replayID.valid ? replayID : replayIF;
+    hardwareLoops = oldest.loops;
+    returnAddressStack.restore(oldest.returnAddresses);
+
+    replayIF.valid = replayID.valid = replayI.valid = false;
+    haltPendingFlag = false;
+    replayWrongPath = false;
+
+    numOfFlushes++;
+}
+
+void replayWriteBack(){
+    if (!replayC.valid) {
+        numOfStalls++;
+        return;
+    }
+
+    if (haltPendingFlag && !replayID.valid && !replayI.valid && !replayEX.valid) systemHaltFlag = true;
+    numOfRetired += replayC.retired;
+}
+
+void replayComplete(){
+    if (!replayEX.valid) {
+        replayC.valid = false;
+        numOfStalls++;
+        return;
+    }
+    replayC = replayEX;
+    const ReplaySlot& slot = replayC;
+
+    if (slot.guarded) {
+        numOfPredicated++;
+        if (slot.predicatedOff) numOfPredicatedOff++;
+    }
+    if (slot.memoryOps > 1) numOfGroupedMemoryOps += slot.memoryOps - 1;
+
+    bool fused = slot.opCode >= CMPBZ && slot.opCode <= CMPBPO;
+    bool branch = (slot.opCode >= JMP && slot.opCode <= BZ) || fused;
+    int branchPC = fused ? slot.PC + 1 : slot.PC;
+
+    if (slot.opCode == RET) {
+        if (slot.mispredicted) numOfRASMisses++;
+        else                   numOfRASHits++;
+    }
+    if (loopBuffer && branch && slot.nextPC <= branchPC) loopBuffer->backwardBranch(branchPC, slot.nextPC);
+
+    if (slot.mispredicted) {
+        // Only the BU can send fetch somewhere else
+        if (!branch && slot.opCode != CALL && slot.opCode != RET)
+            throw std::invalid_argument("Trace went somewhere the pipeline can't follow after PC " + std::to_string(slot.PC));
+        PC = slot.nextPC;
+        replayFlush();
+    }
+}
+
+// As runLSUs() - the accesses of a memory group go to their banks together
+void replayExecute(){
+    if (!replayI.valid) {
+        replayEX.valid = false;
+        numOfStalls++;
+        return;
+    }
+    replayEX = replayI;
+    const ReplaySlot& slot = replayEX;
+
+    std::array<int, MAX_LSUS> banks;
+    std::array<int, MAX_LSUS> bankCycles;
+    int banksUsed = 0;
+    for (int a = 0; a < slot.accesses; a++){
+        int bank = bankOf(slot.accessAddresses[a]);
+        int b = 0;
+        while (b < banksUsed && banks[b] != bank) b++;
+        if (b == banksUsed) {
+            banks[banksUsed] = bank;
+            bankCycles[banksUsed] = 0;
+            banksUsed++;
+        }
+        bankCycles[b] += dataMemoryModel ? dataMemoryModel->access(slot.accessPCs[a], slot.accessAddresses[a]) : 1;
+    }
+
+    int longest = 0;
+    for (int b = 0; b < banksUsed; b++) longest = std::max(longest, bankCycles[b]);
+    if (longest > 1) memoryStallCycles += longest - 1;
+
+    if (slot.accesses > 1) {
+        numOfGroupedAccesses += slot.accesses;
+        numOfBankConflicts += slot.accesses - banksUsed;
+    }
+}
+
+void replayIssue(){
+    if (!replayID.valid) {
+        replayI.valid = false;
+        numOfStalls++;
+        return;
+    }
+    replayI = replayID;
+
+    if (replayI.opCode >= CMPBZ && replayI.opCode <= CMPBPO) numOfFusions++;
+    if (replayI.opCode == CMP || (replayI.opCode >= CMPBZ && replayI.opCode <= CMPBPO)) numOfCompares++;
+}
+
+// As fuseCompareAndBranch()
+void replayFuse(ReplaySlot& slot, const DecodedInstruction& d){
+    int branchPC = slot.PC + 1;
+    if (d.guard >= 0) return;
+    if (PC != branchPC || branchPC >= SIZE_OF_INSTRUCTION_MEMORY || !replayProgram.at(branchPC).valid) return;
+
+    const DecodedInstruction& branch = replayProgram.at(branchPC).decoded;
+    if (branch.dest < 0 || branch.src0 != d.dest) return;
+
+         if (branch.opCode == BZ)  slot.opCode = CMPBZ;
+    else if (branch.opCode == BNE) slot.opCode = CMPBNE;
+    else if (branch.opCode == BPO) slot.opCode = CMPBPO;
+    else return;
+
+    if (!slot.wrongPath) takeRecord(slot, branchPC);
+    PC = loopBuffer ? loopBuffer->predict(branchPC) : branchPC + 1;
+}
+
+// As startHardwareLoop() - what the count register held is only known on the path the program took
+void replayLoop(ReplaySlot& slot, const DecodedInstruction& d){
+    int end = (int) d.immediate - 1;
+    if (slot.wrongPath) return;
+    if (end >= SIZE_OF_INSTRUCTION_MEMORY) throw std::invalid_argument("LOOP ends outside of instruction memory at PC " + std::to_string(slot.PC));
+    if (!hardwareLoops.start(slot.PC + 1, end, slot.loopCount)) PC = end + 1;
+}
+
+// As groupMemoryOperations()
+void replayGroup(ReplaySlot& slot){
+    while (slot.memoryOps < (int) LSUs.size()){
+        int next = slot.PC + slot.memoryOps;
+        if (PC != next || next >= SIZE_OF_INSTRUCTION_MEMORY || !replayProgram.at(next).valid || hardwareLoops.isEnd(next)) return;
+
+        Instruction op = replayProgram.at(next).decoded.opCode;
+        if (op < LD || op > OUT || op == LID) return;
+
+        if (!slot.wrongPath) takeRecord(slot, next);
+        slot.memoryOps++;
+        PC = next + 1;
     }
+}
+
+void replayDecode(){
+    if (!replayIF.valid) {
+        replayID.valid = false;
+        numOfStalls++;
+        return;
+    }
+    replayID = replayIF;
+    ReplaySlot& slot = replayID;
+    const DecodedInstruction& d = replayProgram.at(slot.PC).decoded;
+
+    if (loopBuffer && !slot.fromLoopBuffer) loopBuffer->capture(slot.PC, d);
+
+    if (d.opCode == CMP && FUSION_FLAG) replayFuse(slot, d);
+    if (d.opCode == HALT) haltPendingFlag = true;
+    if (d.opCode == LOOP) replayLoop(slot, d);
+    if (d.opCode >= LD && d.opCode <= OUT && d.opCode != LID && LSUs.size() > 1) replayGroup(slot);
+}
+
+void replayFetch(){
+    ReplaySlot slot;
+    slot.loops = hardwareLoops;
+    slot.returnAddresses = returnAddressStack.checkpoint();
+    if (haltPendingFlag) {
+        replayIF = slot;
+        return;
+    }
+
+    const ReplayInstruction& line = replayProgram.at(PC);
+    slot.PC = PC;
+    int predictedPC = PC + 1;
 
-    //ALU foo = ALU();
-    loadProgramIntoMemory(argv[1]);
-    cycle();
+    DecodedInstruction buffered;
+    slot.fromLoopBuffer = loopBuffer && loopBuffer->lookup(PC, buffered, predictedPC);
 
-    // Clean up some pointers
-    for (ALU* a : ALUs) delete a;
-    for (BU*  b : BUs)  delete b;
-    for (LSU* l : LSUs) delete l;
+    if (line.valid && line.decoded.opCode == CALL) {
+        returnAddressStack.push(PC + 1);
+        predictedPC = (int) line.decoded.immediate;
+    } else if (line.valid && line.decoded.opCode == RET) {
+        int returnAddress;
+        if (returnAddressStack.pop(returnAddress)) predictedPC = returnAddress;
+    }
 
+    hardwareLoops.next(PC, predictedPC);
+    PC = predictedPC;
+
+    if (!line.valid) {
+        replayIF = slot;
+        return;
+    }
+
+    slot.valid = true;
+    slot.opCode = line.decoded.opCode;
+    slot.guarded = line.decoded.guard >= 0;
+    if (slot.opCode >= LD && slot.opCode <= OUT) slot.memoryOps = 1;
+
+    // The first instruction the program didn't run means the one in front of it was mispredicted
+    if (!replayWrongPath && (!traceReader->more() || traceReader->peek().PC != slot.PC)) {
+        if (!replayID.valid || replayID.wrongPath) throw std::invalid_argument("Trace doesn't follow its program at PC " + std::to_string(slot.PC));
+        replayID.mispredicted = true;
+        replayWrongPath = true;
+    }
+    slot.wrongPath = replayWrongPath;
+    if (!slot.wrongPath) takeRecord(slot, slot.PC);
+
+    replayIF = slot;
+}
+
+// One cycle, in the same order as step() - memory waits are jumped over in one go as -event does
+void replayStep(){
+    if (memoryStallCycles > 0) {
+        numOfCycles += memoryStallCycles;
+        memoryStallCycles = 0;
+    }
+
+    replayWriteBack(); replayComplete(); replayExecute(); replayIssue(); replayDecode(); replayFetch();
+    numOfCycles++;
+}
+
+// -replay: times the trace at path with the flags given. Returns the exit status like main() does.
+int replayTrace(const std::string& path){
+    auto hostStart = std::chrono::steady_clock::now();
+
+    resetMachine();
+    traceReader = new TraceReader(path);
+
+    replayProgram.assign(SIZE_OF_INSTRUCTION_MEMORY, ReplayInstruction());
+    for (size_t i = 0; i < traceReader->program.size(); i++){
+        instrMemory.at(i) = traceReader->program.at(i);
+        if (instrMemory.at(i).empty()) continue;
+        try {
+            replayProgram.at(i).decoded = decodeInstruction(instrMemory.at(i));
+            replayProgram.at(i).valid = true;
+        } catch (const std::exception&) {}
+    }
+
+    createMachine();
+    replayIF = replayID = replayI = replayEX = replayC = ReplaySlot();
+    replayWrongPath = false;
+
+    while (!systemHaltFlag) replayStep();
+    if (traceReader->more()) throw std::invalid_argument("Trace goes on after the HALT");
+
+    double hostMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - hostStart).count();
+    cout << "Replayed " << traceReader->numOfRecords << " instructions from " << path << " in " << hostMilliseconds << " ms" << endl;
+    if (PRINT_STATS_FLAG) outputStatistics(numOfCycles);
+    else                  cout << "Total number of cycles:\t\t" << numOfCycles << endl;
+
+    delete traceReader;
+    traceReader = nullptr;
+    destroyMachine();
     return 0;
-}
\ No newline at end of file
+}
+
+#pragma endregion trace replay
+
+
+#pragma region result cache
+
+// -cache dir: a run that has been done before with the same program, data memory, flags and build of the simulator
+// prints the result it got last time instead of running again. Only the cycle by cycle log isn't kept.
+
+// Results from a simulator that times or counts anything differently aren't trusted - bump this with any change that
+// gives the same run a different result
+const long long RESULT_VERSION = 2;
+
+// Everything the result of a run depends on, with the program and its data already loaded
+ResultKey resultKey(){
+    ResultKey key;
+    key.add(RESULT_VERSION);
+    key.add(WORD_BITS);
+
+    for (const std::string& line : instrMemory) key.add(line);
+    key.add(dataMemory.data(), dataMemory.size() * sizeof(Word));
+
+    key.add(MEMORY_SIZE);
+    key.add(MEMORY_LATENCY);
+    key.add(PREFETCHER_NAME);
+    key.add(VALUE_PREDICTOR_NAME);
+    key.add(INSTRUCTION_MEMORY_LATENCY);
+    key.add(FETCH_TARGET_QUEUE_SIZE);
+    key.add(NUM_OF_LSUS);
+    key.add(NUM_OF_BANKS);
+    key.add(BANK_INTERLEAVE);
+    key.add(EVENT_DRIVEN_FLAG);
+    key.add(LOOP_BUFFER_FLAG);
+    key.add(FUSION_FLAG);
+    key.add(COSIM_FLAG);
+    key.add(NUM_OF_THREADS);
+    key.add(FETCH_POLICY);
+    key.add(FETCH_STAGES);
+    key.add(DECODE_STAGES);
+    key.add(EXECUTE_STAGES);
+    key.add(MEMORY_STAGE_FLAG);
+    return key;
+}
+
+// What cycle() would have printed, from the cache. Returns the exit status the run had.
+int printCachedResult(const std::string& key, const CachedResult& result, std::ostream& output){
+    if (PRINT_MEMORY_FLAG) outputAllMemory(amount_of_instruction_memory_to_output);
+
+    output << result.output;
+    output.flush();
+    std::cout << "Program has been halted (result " << key << " from the cache)\n" << std::endl;
+    if (!result.report.empty()) std::cout << result.report << std::endl;
+
+    PC = result.PC;
+    registerFile = result.registers;
+    dataMemory = result.memory;
+
+    if (PRINT_MEMORY_FLAG) outputAllMemory(amount_of_instruction_memory_to_output);
+    if (PRINT_STATS_FLAG) std::cout << result.statistics;
+    return result.status;
+}
+
+// The machine as the run left it, before destroyMachine()
+CachedResult finishedResult(const std::string& output){
+    CachedResult result;
+    result.status = divergenceReport.empty() ? 0 : 1;
+    result.output = output;
+    result.report = divergenceReport;
+    result.PC = PC;
+    result.registers = registerFile;
+    result.memory = dataMemory;
+
+    std::ostringstream statistics;
+    outputStatistics(numOfCycles, statistics);
+    result.statistics = statistics.str();
+    return result;
+}
+
+#pragma endregion result cache
+
+
+#pragma region C API
+
+// One per thread - the machine is the thread_local state above, this only holds what the API needs on top of it
+struct isa_machine {
+    std::string prefetcher;
+    std::string valuePredictor;
+    std::string fetchPolicy;
+    bool trace = false;
+    bool loaded = false;
+    std::ostringstream output;      // What OUT writes
+    std::string outputText;         // ... copied out for isa_output()
+    std::string annotationText;     // Kept for isa_annotation()
+};
+
+thread_local isa_machine* currentMachine = nullptr;
+thread_local std::string lastError;
+
+// Nothing may be thrown back into C, so every entry point runs its body through this
+template <typename F>
+int guarded(const isa_machine* machine, F body){
+    if (machine == nullptr || machine != currentMachine) {
+        lastError = "Not a machine created on this thread";
+        return -1;
+    }
+    try {
+        body();
+        return 0;
+    } catch (const std::exception& e) {
+        lastError = e.what();
+        return -1;
+    }
+}
+
+// createMachine() plus pointing the output of the LSUs at the machine
+void buildMachine(isa_machine* machine){
+    simulationLog = machine->trace ? &std::cout : &silentLog;
+    createMachine();
+    for (LSU* l : LSUs) l->output = &machine->output;
+}
+
+extern "C" {
+
+void isa_default_config(isa_config* config){
+    config->memory_size = SIZE_OF_DATA_MEMORY;
+    config->memory_latency = 0;
+    config->prefetcher = "none";
+    config->value_predictor = "none";
+    config->instruction_memory_latency = 0;
+    config->fetch_target_queue = 0;
+    config->loop_buffer = 0;
+    config->fusion = 1;
+    config->event_driven = 0;
+    config->cosim = 0;
+    config->trace = 0;
+    config->lsus = 1;
+    config->banks = 1;
+    config->bank_interleave = 1;
+    config->annotate = 0;
+    config->pipeline = "IF,ID,I,EX,C,WB";
+    config->threads = 1;
+    config->smtfetch = "roundrobin";
+}
+
+isa_machine* isa_create(const isa_config* config){
+    if (currentMachine) {
+        lastError = "This thread already has a machine";
+        return nullptr;
+    }
+
+    isa_config defaults;
+    isa_default_config(&defaults);
+    if (config == nullptr) config = &defaults;
+
+    isa_machine* machine = new isa_machine();
+    machine->prefetcher = config->prefetcher ? config->prefetcher : "none";
+    machine->valuePredictor = config->value_predictor ? config->value_predictor : "none";
+    machine->fetchPolicy = config->smtfetch ? config->smtfetch : "roundrobin";
+    machine->trace = config->trace != 0;
+
+    try {
+        delete makePrefetcher(machine->prefetcher);     // Throws if there is no such prefetcher
+        delete makeValuePredictor(machine->valuePredictor);
+        parsePipeline(config->pipeline ? config->pipeline : "IF,ID,I,EX,C,WB");
+    } catch (const std::exception& e) {
+        lastError = e.what();
+        delete machine;
+        return nullptr;
+    }
+
+    if (config->memory_size <= 0) {
+        lastError = "Data memory needs at least one word";
+        delete machine;
+        return nullptr;
+    }
+    if (config->lsus < 1 || config->lsus > MAX_LSUS || config->banks < 1 || config->bank_interleave < 1) {
+        lastError = "Needs 1 to " + std::to_string(MAX_LSUS) + " LSUs and at least one bank of at least one word";
+        delete machine;
+        return nullptr;
+    }
+    if (config->instruction_memory_latency < 0 || config->fetch_target_queue < 0 || (config->fetch_target_queue > 0 && config->instruction_memory_latency == 0)) {
+        lastError = "A fetch target queue needs an instruction memory latency, and neither can be negative";
+        delete machine;
+        return nullptr;
+    }
+    if (config->annotate && machine->valuePredictor != "none") {
+        lastError = "A value predictor can't be used with annotate";
+        delete machine;
+        return nullptr;
+    }
+    int threads = config->threads ? config->threads : 1;
+    if (threads < 1 || threads > MAX_THREADS || (machine->fetchPolicy != "roundrobin" && machine->fetchPolicy != "icount")) {
+        lastError = "Needs 1 to " + std::to_string(MAX_THREADS) + " threads and a fetch policy of roundrobin or icount";
+        delete machine;
+        return nullptr;
+    }
+    if (threads > 1 && (config->annotate || config->event_driven || machine->valuePredictor != "none")) {
+        lastError = "More than one thread can't be used with annotate, event_driven or a value predictor";
+        delete machine;
+        return nullptr;
+    }
+    MEMORY_SIZE = config->memory_size;
+    MEMORY_LATENCY = config->memory_latency;
+    PREFETCHER_NAME = machine->prefetcher;
+    VALUE_PREDICTOR_NAME = machine->valuePredictor;
+    INSTRUCTION_MEMORY_LATENCY = config->instruction_memory_latency;
+    FETCH_TARGET_QUEUE_SIZE = config->fetch_target_queue;
+    LOOP_BUFFER_FLAG = config->loop_buffer != 0;
+    FUSION_FLAG = config->fusion != 0;
+    EVENT_DRIVEN_FLAG = config->event_driven != 0;
+    COSIM_FLAG = config->cosim != 0;
+    NUM_OF_LSUS = config->lsus;
+    NUM_OF_BANKS = config->banks;
+    BANK_INTERLEAVE = config->bank_interleave;
+    ANNOTATE_FLAG = config->annotate != 0;
+    NUM_OF_THREADS = threads;
+    FETCH_POLICY = machine->fetchPolicy;
+
+    currentMachine = machine;
+    resetMachine();
+    buildMachine(machine);
+    return machine;
+}
+
+void isa_destroy(isa_machine* machine){
+    if (machine == nullptr || machine != currentMachine) return;
+    resetMachine();
+    simulationLog = &std::cout;
+    currentMachine = nullptr;
+    delete machine;
+}
+
+int isa_load_program(isa_machine* machine, const char* text, size_t length){
+    return guarded(machine, [&]{
+        resetMachine();
+        machine->output.str("");
+        machine->loaded = false;
+
+        // The machine has to be rebuilt even if the program doesn't load
+        try {
+            loadProgramFromText(std::string(text, length));
+        } catch (...) {
+            buildMachine(machine);
+            throw;
+        }
+        buildMachine(machine);
+        machine->loaded = true;
+    });
+}
+
+int isa_write_memory(isa_machine* machine, int address, const isa_word* words, size_t count){
+    return guarded(machine, [&]{
+        if (address < 0 || address + count > dataMemory.size()) throw std::out_of_range("Outside of data memory");
+        for (size_t t = 0; t < hardwareThreads.size(); t++) {
+            switchThread(t);
+            for (size_t i = 0; i < count; i++) {
+                dataMemory.at(address + i) = (Word) words[i];
+                if (referenceModel) referenceModel->memory.at(address + i) = (Word) words[i];
+            }
+        }
+        switchThread(0);
+    });
+}
+
+long long isa_run(isa_machine* machine, long long cycles){
+    long long start = numOfCycles;
+    int status = guarded(machine, [&]{
+        if (!machine->loaded) throw std::invalid_argument("No program has been loaded");
+        while (!systemHaltFlag && (cycles < 0 || numOfCycles - start < cycles)) step<false>();
+        if (!divergenceReport.empty()) throw std::runtime_error(divergenceReport);
+    });
+    return status == 0 ? numOfCycles - start : -1;
+}
+
+int isa_halted(const isa_machine* machine){
+    return machine == currentMachine && systemHaltFlag;
+}
+
+int isa_read_register(const isa_machine* machine, int index, isa_word* value){
+    return guarded(machine, [&]{
+        switchThread(0);
+        *value = registerFile.at(index);
+    });
+}
+
+int isa_read_memory(const isa_machine* machine, int address, isa_word* words, size_t count){
+    return guarded(machine, [&]{
+        if (address < 0 || address + count > dataMemory.size()) throw std::out_of_range("Outside of data memory");
+        switchThread(0);
+        for (size_t i = 0; i < count; i++) words[i] = dataMemory.at(address + i);
+    });
+}
+
+int isa_read_pc(const isa_machine* machine, int* value){
+    return guarded(machine, [&]{
+        switchThread(0);
+        *value = PC;
+    });
+}
+
+long long isa_counter(const isa_machine* machine, const char* name){
+    if (machine == nullptr || machine != currentMachine || name == nullptr) return -1;
+    return readCounter(name);
+}
+
+const char* isa_output(isa_machine* machine){
+    if (machine == nullptr || machine != currentMachine) return "";
+    machine->outputText = machine->output.str();
+    return machine->outputText.c_str();
+}
+
+const char* isa_annotation(isa_machine* machine){
+    if (machine == nullptr || machine != currentMachine || hotspots == nullptr) return "";
+    std::ostringstream listing;
+    hotspots->print(listing, std::vector<std::string>(instrMemory.begin(), instrMemory.end()), amount_of_instruction_memory_to_output + 1, numOfCycles);
+    machine->annotationText = listing.str();
+    return machine->annotationText.c_str();
+}
+
+const char* isa_last_error(void){
+    return lastError.c_str();
+}
+
+}
+
+#pragma endregion C API
+
+
+// The library build (isa.h) brings its own entry points
+#ifndef ISA_LIBRARY
+int main(int argc, char** argv){    
+    startProfile();
+
+    const char* usage = "Usage: ./isa <program_name> -r|m|s|d [-loopbuffer] [-nofuse] [-event] [-cosim] [-annotate] [-load file@addr] [-out file] [-memsize n] [-memlat n] [-prefetch none|nextline|stride|stream] [-vpred none|last|stride] [-imemlat n] [-ftq n] [-lsus n] [-banks n] [-interleave n] [-intervals n] [-warmup n] [-record file] [-replay] [-cache dir] [-nocache] [-cachelimit n] [-threads n] [-smtfetch roundrobin|icount] [-pipeline stages]";
+
+    std::string programText;
+    std::ofstream outputFile;
+    try {
+        if (!handleProgramFlags(argc, argv)) {
+            std::cout << usage << std::endl;
+            return 0;
+        }
+
+        // The trace has the program in it and replaying it doesn't need data memory
+        if (REPLAY_FLAG) return replayTrace(argv[1]);
+
+        // Sizes data memory
+        resetMachine();
+
+        programText = loadProgramIntoMemory(argv[1]);
+        for (std::string& file : DATA_FILES) loadDataFile(file);
+
+        // OUT streams to a file instead of stdout
+        if (!OUTPUT_FILE.empty()) {
+            outputFile.open(OUTPUT_FILE);
+            if (!outputFile) throw std::invalid_argument("Cannot open output file: " + OUTPUT_FILE);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        std::cerr << usage << std::endl;
+        return 2;
+    }
+
+    // Errors in the program itself (an unknown opcode, an access outside data memory) only show up once it runs
+    try {
+        if (NUM_OF_INTERVALS > 0) return runIntervals(programText, OUTPUT_FILE.empty() ? std::cout : outputFile);
+        if (!RECORD_FILE.empty()) return recordTrace(RECORD_FILE, OUTPUT_FILE.empty() ? std::cout : outputFile);
+
+        std::ostream& output = OUTPUT_FILE.empty() ? std::cout : outputFile;
+
+        // A run that has been done before doesn't need doing again
+        ResultCache* cache = nullptr;
+        ResultKey key;
+        if (!CACHE_DIRECTORY.empty()) {
+            cache = new ResultCache(CACHE_DIRECTORY, CACHE_LIMIT * 1024 * 1024);
+            key = resultKey();
+
+            CachedResult cached;
+            if (!BYPASS_CACHE_FLAG && cache->load(key, cached)) {
+                delete cache;
+                return printCachedResult(key.hex(), cached, output);
+            }
+        }
+
+        // What OUT writes is kept for the cache as it goes out
+        std::ostringstream cachedOutput;
+        TeeBuffer tee(output.rdbuf(), cachedOutput.rdbuf());
+        std::ostream teeOutput(&tee);
+
+        createMachine();
+        for (LSU* l : LSUs) l->output = cache ? &teeOutput : &output;
+
+        // Only pay for the debugging checks when they have been asked for
+        if (DEBUG_MODE_FLAG || PRINT_REGISTERS_FLAG) cycle<true>();
+        else                                         cycle<false>();
+
+        // Only prints anything when built with -DISA_PROFILE
+        printProfile(numOfCycles);
+
+        // A divergence from the reference model is a failed run
+        int status = divergenceReport.empty() ? 0 : 1;
+
+        if (cache) {
+            cache->store(key, finishedResult(cachedOutput.str()));
+            delete cache;
+        }
+
+        // Clean up some pointers
+        destroyMachine();
+
+        return status;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
+#endif
@@ -0,0 +1,79 @@
+#pragma once
+
+// C interface to the simulator, for driving lots of runs from one process. Build it as a library with
+//   g++ -O2 -std=c++11 -shared -fPIC -DISA_LIBRARY -o libisa.so isa.cpp
+// A machine belongs to the thread that created it and a thread can only have one machine at a time, run machines in
+// parallel from separate threads. Nothing is printed unless trace is set - what OUT produces is kept for isa_output().
+// Functions returning int give 0 on success and -1 on error, isa_last_error() then says what went wrong.
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct isa_machine isa_machine;
+
+// Registers and memory words go through the API as 64 bits whichever word size the library was built with
+typedef long long isa_word;
+
+typedef struct isa_config {
+    int memory_size;            // -memsize, words of data memory
+    int memory_latency;         // -memlat, 0 = every load/store takes one cycle
+    const char* prefetcher;     // -prefetch: "none", "nextline", "stride" or "stream"
+    const char* value_predictor; // -vpred: "none", "last" or "stride"
+    int instruction_memory_latency; // -imemlat, 0 = every fetch takes one cycle
+    int fetch_target_queue;     // -ftq, 0 = no decoupled front end (needs instruction_memory_latency)
+    int loop_buffer;            // -loopbuffer
+    int fusion;                 // 0 = -nofuse
+    int event_driven;           // -event
+    int cosim;                  // -cosim, isa_run() fails at the first divergence and isa_last_error() has the report
+    int trace;                  // Print what every stage does each cycle to stdout like the isa executable does
+    int lsus;                   // -lsus
+    int banks;                  // -banks
+    int bank_interleave;        // -interleave
+    int annotate;               // -annotate, isa_annotation() then has the listing
+    const char* pipeline;       // -pipeline, the stages in order e.g. "IF,IF,ID,I,EX,EX,MA,C,WB"
+    int threads;                // -threads, hardware threads each running their own copy of the program, 0 = 1
+    const char* smtfetch;       // -smtfetch: "roundrobin" or "icount", NULL = "roundrobin"
+} isa_config;
+
+// Fills in the same defaults as running isa without any flags
+void isa_default_config(isa_config* config);
+
+isa_machine* isa_create(const isa_config* config);     // NULL on error
+void isa_destroy(isa_machine* machine);
+
+// Resets the machine and loads a program in the same text format as a program file
+int isa_load_program(isa_machine* machine, const char* text, size_t length);
+int isa_write_memory(isa_machine* machine, int address, const isa_word* words, size_t count);   // Every hardware thread's data memory
+
+// Runs until HALT or until the given number of cycles have passed (cycles < 0 = no limit), returns the cycles ran or -1.
+// With event_driven a skipped stretch can take it past the limit.
+long long isa_run(isa_machine* machine, long long cycles);
+int isa_halted(const isa_machine* machine);
+
+// With more than one hardware thread these read thread 0's
+int isa_read_register(const isa_machine* machine, int index, isa_word* value);
+int isa_read_memory(const isa_machine* machine, int address, isa_word* words, size_t count);
+int isa_read_pc(const isa_machine* machine, int* value);
+
+// The numbers -s prints: "instructions" (written back), "cycles", "branches", "stalls", "flushes", "ras_hits", "ras_misses", "compares", "fusions",
+// "skipped_cycles", "predicated", "predicated_off", "grouped_memory_ops", "bank_conflicts", "hardware_loops",
+// "hardware_loop_back_edges", "checked_instructions", "loop_buffer_hits", "loop_buffer_misses", "memory_accesses",
+// "memory_misses", "memory_stall_cycles", "prefetches", "useful_prefetches", "value_predictions", "value_mispredictions",
+// "instruction_misses", "fetch_stall_cycles", "instruction_prefetches", "fetch_resteers".
+// -1 if the name is unknown.
+long long isa_counter(const isa_machine* machine, const char* name);
+
+// Everything OUT has written since the program was loaded, one value per line. Valid until the next call on the machine.
+const char* isa_output(isa_machine* machine);
+
+// What -annotate prints for the cycles ran so far, "" unless annotate was set. Valid until the next call on the machine.
+const char* isa_annotation(isa_machine* machine);
+
+const char* isa_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif